@@ -2,15 +2,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include <pthread.h>
+#include <unistd.h> /* write */
 
 #include "moduleman.h"
 #include "command.h"
 
 #define COMMAND_TIMEOUT_SECONDS 5
 
-static bool cmd_channel_crashed = false;
+/*
+ * There is a command channel per event loop, the channel a module is
+ * currently running on is needed to know which one crashed.
+ */
+static _Thread_local cmd_channel_t *cmd_channel_current = NULL;
 
 struct cmd_link_s {
     cmd_entry_t *data;
@@ -29,16 +35,22 @@ struct cmd_channel_s {
     volatile bool   wrend;
     void          (*destroy)(cmd_entry_t *);
     bool            ready;
+    volatile bool   crashed;
     cmd_entry_t    *cmd_entry;
     pthread_mutex_t cmd_mutex;
+    int             wakefd;   /* written to when a command times out */
+    volatile sig_atomic_t timedout;
 };
 
 struct cmd_entry_s {
-    cmd_channel_t *associated;
-    module_t      *instance;
-    string_t      *channel;
-    string_t      *user;
-    string_t      *message;
+    cmd_channel_t  *associated;
+    module_t       *instance;
+    string_t       *channel;
+    string_t       *user;
+    string_t       *message;
+    cmd_resolved_t  resolved;  /* called instead of module_enter when set */
+    list_t         *addresses;
+    size_t          reloads;   /* of the module when the entry was made */
 };
 
 cmd_link_t *cmd_link_create(void) {
@@ -69,7 +81,10 @@ cmd_channel_t *cmd_channel_create(void) {
     channel->wrend     = false;
     channel->destroy   = NULL;
     channel->ready     = false;
+    channel->crashed   = false;
     channel->cmd_entry = NULL;
+    channel->wakefd    = -1;
+    channel->timedout  = 0;
 
     return channel;
 }
@@ -173,6 +188,30 @@ cmd_entry_t *cmd_entry_create(
     /* Users and messages can be empty */
     entry->user       = strchk(user) ? string_create(user) : NULL;
     entry->message    = strchk(message) ? string_create(message) : NULL;;
+    entry->resolved   = NULL;
+    entry->addresses  = NULL;
+    entry->reloads    = module->reloads;
+
+    return entry;
+}
+
+/*
+ * Lookups made by modules complete as commands of their own so they run on
+ * the command thread, under the same timeout, like the command which made
+ * them. The addresses are owned by the entry.
+ */
+cmd_entry_t *cmd_entry_resolved(
+    cmd_channel_t  *associated,
+    module_t       *module,
+    const char     *channel,
+    const char     *user,
+    cmd_resolved_t  callback,
+    list_t         *addresses
+) {
+    cmd_entry_t *entry = cmd_entry_create(associated, module, channel, user, NULL);
+
+    entry->resolved  = callback;
+    entry->addresses = addresses;
 
     return entry;
 }
@@ -185,6 +224,11 @@ void cmd_entry_destroy(cmd_entry_t *entry) {
     if (entry->user)    string_destroy(entry->user);
     if (entry->message) string_destroy(entry->message);
 
+    if (entry->addresses) {
+        list_foreach(entry->addresses, &free);
+        list_destroy(entry->addresses);
+    }
+
     module_t *load = entry->instance;
     module_mem_destroy(load);
 
@@ -193,30 +237,53 @@ void cmd_entry_destroy(cmd_entry_t *entry) {
 
 static void cmd_channel_signalhandle_quit(int sig) {
     /* not a timeout, i.e module crashed */
-    if (sig != SIGUSR2)
-        cmd_channel_crashed = true;
+    if (sig != SIGUSR2 && cmd_channel_current)
+        cmd_channel_current->crashed = true;
     pthread_exit(NULL);
 }
 
+/*
+ * The handler runs on whichever thread the signal lands on, that thread may
+ * be holding any lock. Stopping the command is left to the event loop which
+ * owns the channel, all that is done here is to wake it.
+ */
 static void cmd_channel_signalhandle_timeout(int sig, siginfo_t *si, void *ignore) {
     (void)sig; /* ignored */
     (void)ignore; /* ignored */
 
     cmd_channel_t *channel = si->si_value.sival_ptr;
+    int            saved   = errno;
+
+    channel->timedout = 1;
+    if (channel->wakefd != -1)
+        write(channel->wakefd, "timeout", 7);
+
+    errno = saved;
+}
+
+void cmd_channel_notify(cmd_channel_t *channel, int wakefd) {
+    channel->wakefd = wakefd;
+}
+
+bool cmd_channel_timeout(cmd_channel_t *channel) {
+    if (!channel->timedout)
+        return false;
+    channel->timedout = 0;
 
     /* Did a command timeout? */
     pthread_mutex_lock(&channel->cmd_mutex);
     module_t *instance = (channel->cmd_entry) ? channel->cmd_entry->instance : NULL;
     if (!instance) {
         pthread_mutex_unlock(&channel->cmd_mutex);
-        return;
+        return false;
     }
 
     pthread_kill(channel->thread, SIGUSR2);
     pthread_join(channel->thread, NULL);
     pthread_mutex_unlock(&channel->cmd_mutex);
 
-    cmd_entry_t *entry = channel->cmd_entry;
+    cmd_entry_t *entry   = channel->cmd_entry;
+    bool         crashed = channel->crashed;
     channel->cmd_entry = NULL;
 
     /*
@@ -230,18 +297,30 @@ static void cmd_channel_signalhandle_timeout(int sig, siginfo_t *si, void *ignor
         const char *user    = string_contents(entry->user);
 
         irc_write(irc, channel, "%s: command %s", user,
-            cmd_channel_crashed ? "crashed" : "timeout");
+            crashed ? "crashed" : "timeout");
     }
 
     cmd_entry_destroy(entry);
 
     channel->rdend = false;
     cmd_channel_begin(channel);
+    return true;
 }
 
 static void *cmd_channel_threader(void *data) {
     cmd_channel_t *channel = data;
     cmd_entry_t   *entry   = NULL;
+    sigset_t       mask;
+
+    /*
+     * The timeout only wakes the event loop, it's never handled on the
+     * thread it's meant to stop.
+     */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cmd_channel_current = channel;
 
     while (cmd_channel_pop(channel, &entry)) {
         module_t *module = entry->instance;
@@ -253,10 +332,15 @@ static void *cmd_channel_threader(void *data) {
         if (module_manager_unloaded_find(module->instance->moduleman, module))
             continue;
 
-        if (module->enter) {
+        /* A lookup finished before a reload would call into the old code */
+        if (entry->resolved && entry->reloads != module->reloads) {
+            cmd_entry_destroy(entry);
+            continue;
+        }
+
+        if (module->enter || entry->resolved) {
             module_singleton_set(module);
             channel->cmd_entry = entry;
-            module->memory     = list_create();
 
             struct itimerspec its = {
                 .it_value = {
@@ -271,12 +355,20 @@ static void *cmd_channel_threader(void *data) {
             if (timer_settime(channel->timerid, 0, &its, NULL) == -1)
                 abort();
 
-            module->enter(
-                module->instance,
-                string_contents(entry->channel),
-                string_contents(entry->user),
-                string_contents(entry->message)
-            );
+            if (entry->resolved)
+                entry->resolved(
+                    module->instance,
+                    string_contents(entry->channel),
+                    string_contents(entry->user),
+                    entry->addresses
+                );
+            else
+                module->enter(
+                    module->instance,
+                    string_contents(entry->channel),
+                    string_contents(entry->user),
+                    string_contents(entry->message)
+                );
 
             pthread_mutex_lock(&channel->cmd_mutex);
             cmd_entry_destroy(entry);
@@ -335,7 +427,7 @@ bool cmd_channel_begin(cmd_channel_t *channel) {
         /* reestablish signal handler because SIG_DFL */
         signal(SIGUSR2, &cmd_channel_signalhandle_quit);
         signal(SIGSEGV, &cmd_channel_signalhandle_quit);
-        cmd_channel_crashed = false;
+        channel->crashed = false;
     }
 
     if (pthread_create(&channel->thread, NULL, &cmd_channel_threader, channel) == 0) {
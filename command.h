@@ -6,6 +6,9 @@ typedef struct cmd_link_s    cmd_link_t;
 typedef struct cmd_channel_s cmd_channel_t;
 typedef struct cmd_entry_s   cmd_entry_t;
 
+/* Continuation of a module command once a name it looked up is resolved */
+typedef void (*cmd_resolved_t)(irc_t *irc, const char *channel, const char *user, list_t *addresses);
+
 cmd_entry_t *cmd_entry_create(
     cmd_channel_t *associated,
     module_t      *module,
@@ -14,6 +17,15 @@ cmd_entry_t *cmd_entry_create(
     const char    *message
 );
 
+cmd_entry_t *cmd_entry_resolved(
+    cmd_channel_t  *associated,
+    module_t       *module,
+    const char     *channel,
+    const char     *user,
+    cmd_resolved_t  callback,
+    list_t         *addresses
+);
+
 void cmd_entry_destroy(cmd_entry_t *entry);
 void cmd_channel_rdclose(cmd_channel_t *channel);
 void cmd_channel_wrclose(cmd_channel_t *channel);
@@ -22,6 +34,7 @@ bool cmd_channel_push(cmd_channel_t *channel, cmd_entry_t *entry);
 bool cmd_channel_begin(cmd_channel_t *channel);
 bool cmd_channel_ready(cmd_channel_t *channel);
 bool cmd_channel_timeout(cmd_channel_t *channel);
+void cmd_channel_notify(cmd_channel_t *channel, int wakefd);
 void cmd_channel_process(cmd_channel_t *channel);
 cmd_channel_t *cmd_channel_create(void);
 void cmd_channel_destroy(cmd_channel_t *channel);
@@ -53,7 +53,7 @@ static void config_channel_destroy(config_channel_t *channel) {
     free(channel);
 }
 
-/* Instance: (name + nick + pattern + host + port + database + auth + channel(s)) */
+/* Instance: (name + nick + pattern + host + port + database + auth + sasl + channel(s)) */
 static config_instance_t *config_instance_create(const char *name) {
     config_instance_t *instance = calloc(1, sizeof(*instance));
     instance->channels = hashtable_create(32);
@@ -69,6 +69,9 @@ static void config_instance_destroy(config_instance_t *instance) {
     free(instance->port);
     free(instance->database);
     free(instance->auth);
+    free(instance->sasl);
+    free(instance->account);
+    free(instance->certificate);
 
     hashtable_foreach(instance->channels, &config_channel_destroy);
     hashtable_destroy(instance->channels);
@@ -159,6 +162,8 @@ static bool config_entry_handler(void *user, const char *section, const char *na
         /* Web configuration:
          *  TODO.
          */
+    } else if (!strcmp(section, "redroid")) {
+        /* Global configuration: see config_threads and config_nameserver */
     } else {
         /* Instance configuration */
         config_instance_t *instance = config_instance_find(config, section);
@@ -175,8 +180,16 @@ static bool config_entry_handler(void *user, const char *section, const char *na
             else if (!strcmp(name, "host"))      instance->host     = strdup(value);
             else if (!strcmp(name, "port"))      instance->port     = strdup(value);
             else if (!strcmp(name, "auth"))      instance->auth     = strdup(value);
+            else if (!strcmp(name, "sasl"))      instance->sasl     = strdup(value);
+            else if (!strcmp(name, "account"))   instance->account  = strdup(value);
+            else if (!strcmp(name, "certificate")) instance->certificate = strdup(value);
             else if (!strcmp(name, "database"))  instance->database = strdup(value);
             else if (!strcmp(name, "ssl"))       instance->ssl      = ini_boolean(value);
+            else if (!strcmp(name, "flood_burst"))   instance->floodburst   = strtoul(value, NULL, 10);
+            else if (!strcmp(name, "flood_rate"))    instance->floodrate    = strtoul(value, NULL, 10);
+            else if (!strcmp(name, "flood_penalty")) instance->floodpenalty = strtoul(value, NULL, 10);
+            else if (!strcmp(name, "ping_interval")) instance->pinginterval = strtoul(value, NULL, 10);
+            else if (!strcmp(name, "ping_missed"))   instance->pingmissed   = strtoul(value, NULL, 10);
         }
     }
     free(find);
@@ -209,6 +222,37 @@ list_t *config_load(const char *file) {
     return list;
 }
 
+/* Global options: the amount of event loop threads and the nameserver */
+static bool config_threads_handler(void *user, const char *section, const char *name, const char *value) {
+    size_t *threads = user;
+    if (!strcmp(section, "redroid") && !strcmp(name, "threads"))
+        *threads = strtoul(value, NULL, 10);
+    return true;
+}
+
+size_t config_threads(const char *file) {
+    size_t threads = 0;
+    if (!ini_parse(file, &config_threads_handler, &threads) || threads == 0)
+        return 1;
+    return threads;
+}
+
+static bool config_nameserver_handler(void *user, const char *section, const char *name, const char *value) {
+    char **nameserver = user;
+    if (!strcmp(section, "redroid") && !strcmp(name, "nameserver")) {
+        free(*nameserver);
+        *nameserver = strdup(value);
+    }
+    return true;
+}
+
+/* NULL when the nameservers from resolv.conf should be used */
+char *config_nameserver(const char *file) {
+    char *nameserver = NULL;
+    ini_parse(file, &config_nameserver_handler, &nameserver);
+    return nameserver;
+}
+
 void config_unload(list_t *list) {
     list_foreach(list, &config_instance_destroy);
     list_destroy(list);
@@ -222,15 +266,31 @@ typedef struct {
 } config_save_t;
 
 void config_save(list_t *config, const char *file) {
+    /* Global options aren't part of the instance list, keep them */
+    size_t threads    = config_threads(file);
+    char  *nameserver = config_nameserver(file);
+
     FILE *fp;
-    if (!(fp = fopen(file, "w")))
+    if (!(fp = fopen(file, "w"))) {
+        free(nameserver);
         return;
+    }
 
     char timestamp[256];
     strftime(timestamp, sizeof(timestamp) - 1,
         "%B %d, %Y %I:%M %p", localtime(&(time_t){time(0)}));
     fprintf(fp, "# Redroid configuration last modified %s\n", timestamp);
 
+    if (threads != 1 || nameserver) {
+        fprintf(fp, "[redroid]\n");
+        if (threads != 1)
+            fprintf(fp, "    threads  = %zu\n", threads);
+        if (nameserver)
+            fprintf(fp, "    nameserver = %s\n", nameserver);
+        fprintf(fp, "\n");
+    }
+    free(nameserver);
+
     /* For all instances */
     list_foreach(config, fp,
         lambda void(config_instance_t *instance, FILE *fp) {
@@ -250,8 +310,25 @@ void config_save(list_t *config, const char *file) {
             fprintf(fp, "    host     = %s\n", instance->host);
             fprintf(fp, "    port     = %s\n", instance->port);
             fprintf(fp, "    auth     = %s\n", instance->auth);
+            if (instance->sasl)
+                fprintf(fp, "    sasl     = %s\n", instance->sasl);
+            if (instance->account)
+                fprintf(fp, "    account  = %s\n", instance->account);
+            if (instance->certificate)
+                fprintf(fp, "    certificate = %s\n", instance->certificate);
             fprintf(fp, "    database = %s\n", instance->database);
-            fprintf(fp, "    ssl      = %s\n\n", instance->ssl ? "True" : "False");
+            fprintf(fp, "    ssl      = %s\n", instance->ssl ? "True" : "False");
+            if (instance->floodburst)
+                fprintf(fp, "    flood_burst   = %zu\n", instance->floodburst);
+            if (instance->floodrate)
+                fprintf(fp, "    flood_rate    = %zu\n", instance->floodrate);
+            if (instance->floodpenalty)
+                fprintf(fp, "    flood_penalty = %zu\n", instance->floodpenalty);
+            if (instance->pinginterval)
+                fprintf(fp, "    ping_interval = %zu\n", instance->pinginterval);
+            if (instance->pingmissed)
+                fprintf(fp, "    ping_missed   = %zu\n", instance->pingmissed);
+            fprintf(fp, "\n");
 
             fprintf(fp, "# Channels for `%s'\n", instance->name);
             hashtable_foreach(instance->channels, &save,
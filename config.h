@@ -20,9 +20,17 @@ typedef struct {
     char        *pattern;    /* bot pattern                    */
     char        *host;       /* server host                    */
     char        *port;       /* server port                    */
-    char        *auth;       /* auth password (NickServ)       */
+    char        *auth;       /* auth password (NickServ, SASL) */
+    char        *sasl;       /* SASL mechanism or NULL         */
+    char        *account;    /* SASL account, defaults to nick */
+    char        *certificate;/* TLS client certificate + key   */
     char        *database;   /* database file for IRC instance */
     bool         ssl;        /* SSL network                    */
+    size_t       floodburst; /* lines sent back to back        */
+    size_t       floodrate;  /* milliseconds to earn a line    */
+    size_t       floodpenalty;/* bytes costing another line    */
+    size_t       pinginterval;/* seconds between lag probes     */
+    size_t       pingmissed; /* unanswered probes till dead    */
     hashtable_t *channels;   /* map<config_channel_t*>         */
 } config_instance_t;
 
@@ -32,5 +40,7 @@ config_instance_t *config_instance_find(list_t *list, const char *name);
 
 list_t *config_load(const char *file);
 void config_unload(list_t *list);
+size_t config_threads(const char *file);
+char *config_nameserver(const char *file);
 void config_save(list_t *config, const char *file);
 #endif
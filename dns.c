@@ -0,0 +1,964 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include <unistd.h>     /* close */
+#include <pthread.h>    /* pthread_mutex_t */
+#include <netdb.h>      /* getnameinfo */
+#include <arpa/inet.h>  /* inet_pton, htons */
+#include <sys/socket.h> /* socket, sendto, recvfrom */
+#include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+
+#include "dns.h"
+#include "hashtable.h"
+#include "list.h"
+#include "mt.h"
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA   6
+#define DNS_TYPE_AAAA  28
+#define DNS_TYPE_OPT   41
+#define DNS_CLASS_IN   1
+
+#define DNS_FLAG_RESPONSE  0x8000
+#define DNS_FLAG_TRUNCATED 0x0200
+#define DNS_FLAG_RECURSE   0x0100
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_HEADER  12
+#define DNS_PAYLOAD 1232 /* EDNS0 UDP payload advertised to the nameserver */
+#define DNS_NAME    253  /* longest name in its dotted form */
+
+/* A lookup is a query for each of these, in the order results are given */
+static const uint16_t dns_types[] = { DNS_TYPE_AAAA, DNS_TYPE_A };
+#define DNS_TYPES (sizeof(dns_types) / sizeof(*dns_types))
+
+typedef struct {
+    dns_address_t *addresses;
+    size_t         count;   /* zero for names known not to exist */
+    uint64_t       expires; /* wheel_now() deadline, UINT64_MAX for the hosts file */
+} dns_entry_t;
+
+/*
+ * The nameservers and the cache are shared by the resolvers of all event
+ * loops. Only the cache changes after dns_init, it has a lock of its own.
+ */
+static struct {
+    struct sockaddr_storage nameservers[DNS_NAMESERVERS];
+    size_t                  count;
+    char                    search[DNS_SEARCH][DNS_NAME + 1];
+    size_t                  searches;
+    size_t                  ndots;
+    hashtable_t            *cache;
+    pthread_mutex_t         lock;
+} dns_shared;
+
+struct dns_s {
+    wheel_t *wheel;
+    mt_t    *random;
+    list_t  *lookups;
+    int      fd;      /* epoll of the sockets of all lookups */
+};
+
+/*
+ * Everyone resolving the same name waits on one lookup. It tries the names
+ * the search domains make of it one after the other, every name is asked
+ * from sockets of its own so the source port is as hard to guess as the IDs.
+ */
+typedef struct {
+    dns_t          *dns;
+    char           *key;      /* the name as it was given                */
+    list_t         *queries;  /* list<dns_query_t> waiting on the answer */
+    bool            finishing;
+    char            names[DNS_SEARCH + 1][DNS_NAME + 1];
+    size_t          candidates;
+    size_t          candidate;
+    wheel_timer_t  *timer;
+    int             fds[2];   /* AF_INET and AF_INET6, made when needed  */
+    uint16_t        ids[DNS_TYPES];
+    bool            answered[DNS_TYPES];
+    size_t          attempts;
+    dns_address_t  *addresses;
+    size_t          count;
+    uint32_t        ttl;      /* of the addresses                        */
+    uint32_t        negative; /* of the answer when there are none       */
+} dns_lookup_t;
+
+struct dns_query_s {
+    dns_lookup_t   *lookup;
+    dns_callback_t  callback;
+    void           *data;
+};
+
+static inline uint16_t dns_get16(const unsigned char *data) {
+    return (data[0] << 8) | data[1];
+}
+
+static inline uint32_t dns_get32(const unsigned char *data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static inline unsigned char *dns_put16(unsigned char *data, uint16_t value) {
+    *data++ = value >> 8;
+    *data++ = value & 0xFF;
+    return data;
+}
+
+static inline uint32_t dns_min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
+static socklen_t dns_nameserver_length(const struct sockaddr_storage *address) {
+    return (address->ss_family == AF_INET6)
+               ? sizeof(struct sockaddr_in6)
+               : sizeof(struct sockaddr_in);
+}
+
+static bool dns_address_parse(const char *text, dns_address_t *address) {
+    if (inet_pton(AF_INET6, text, &address->ipv6) == 1) {
+        address->family = AF_INET6;
+        return true;
+    }
+    if (inet_pton(AF_INET, text, &address->ipv4) == 1) {
+        address->family = AF_INET;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Names are looked up and cached in lower case without the trailing dot,
+ * anything which cannot be encoded in a query is rejected here.
+ */
+static bool dns_name_normalize(const char *name, char *normal) {
+    size_t length = strlen(name);
+    if (length && name[length - 1] == '.')
+        length--;
+    if (length == 0 || length > DNS_NAME)
+        return false;
+
+    size_t label = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] == '.') {
+            if (label == 0)
+                return false;
+            label = 0;
+        } else if (++label > 63) {
+            return false;
+        }
+        normal[i] = tolower((unsigned char)name[i]);
+    }
+    normal[length] = '\0';
+    return label != 0;
+}
+
+/*
+ * Reads a possibly compressed name, next is set to what follows the name
+ * where it started.
+ */
+static bool dns_name_read(const unsigned char *packet, size_t length, size_t offset, char *name, size_t *next) {
+    size_t written = 0;
+    size_t jumps   = 0;
+    bool   jumped  = false;
+
+    for (;;) {
+        if (offset >= length)
+            return false;
+
+        size_t label = packet[offset];
+        if ((label & 0xC0) == 0xC0) {
+            if (offset + 1 >= length || ++jumps > 16)
+                return false;
+            if (!jumped)
+                *next = offset + 2;
+            jumped = true;
+            offset = ((label & 0x3F) << 8) | packet[offset + 1];
+            continue;
+        }
+
+        if (label & 0xC0)
+            return false;
+        offset++;
+        if (label == 0)
+            break;
+        if (offset + label > length || written + label + 1 > DNS_NAME + 1)
+            return false;
+
+        if (written)
+            name[written++] = '.';
+        for (size_t i = 0; i < label; i++)
+            name[written++] = tolower(packet[offset + i]);
+        offset += label;
+    }
+
+    if (!jumped)
+        *next = offset;
+    name[written] = '\0';
+    return true;
+}
+
+/* Cache */
+static void dns_entry_destroy(dns_entry_t *entry) {
+    free(entry->addresses);
+    free(entry);
+}
+
+/*
+ * The addresses are copied out as the entry can be replaced any time. Only
+ * entries of the hosts file are found when hosts is set.
+ */
+static bool dns_cache_find(const char *name, bool hosts, dns_address_t **addresses, size_t *count) {
+    pthread_mutex_lock(&dns_shared.lock);
+    dns_entry_t *entry = hashtable_find(dns_shared.cache, name);
+    if (entry && entry->expires <= wheel_now()) {
+        hashtable_remove(dns_shared.cache, name);
+        dns_entry_destroy(entry);
+        entry = NULL;
+    }
+    if (entry && hosts && entry->expires != UINT64_MAX)
+        entry = NULL;
+
+    if (entry) {
+        *count     = entry->count;
+        *addresses = malloc(sizeof(dns_address_t) * entry->count);
+        memcpy(*addresses, entry->addresses, sizeof(dns_address_t) * entry->count);
+    }
+    pthread_mutex_unlock(&dns_shared.lock);
+
+    return entry != NULL;
+}
+
+typedef struct {
+    list_t   *expired;
+    uint64_t  now;
+} dns_cache_expire_t;
+
+static void dns_cache_expire(void) {
+    dns_cache_expire_t expire = {
+        .expired = list_create(),
+        .now     = wheel_now()
+    };
+
+    hashtable_foreachkv(dns_shared.cache, &expire,
+        lambda void(const char *name, dns_entry_t *entry, dns_cache_expire_t *expire) {
+            /* Keys only live as long as the callback */
+            if (entry->expires <= expire->now)
+                list_push(expire->expired, strdup(name));
+        }
+    );
+
+    char *name;
+    while ((name = list_pop(expire.expired))) {
+        dns_entry_t *entry = hashtable_find(dns_shared.cache, name);
+        hashtable_remove(dns_shared.cache, name);
+        dns_entry_destroy(entry);
+        free(name);
+    }
+    list_destroy(expire.expired);
+}
+
+static void dns_cache_insert(const char *name, const dns_address_t *addresses, size_t count, uint32_t ttl) {
+    if (ttl == 0)
+        return;
+
+    pthread_mutex_lock(&dns_shared.lock);
+    dns_entry_t *entry = hashtable_find(dns_shared.cache, name);
+    if (entry) {
+        hashtable_remove(dns_shared.cache, name);
+        dns_entry_destroy(entry);
+    } else if (hashtable_elements(dns_shared.cache) >= DNS_CACHE_MAX) {
+        dns_cache_expire();
+    }
+
+    /* Still full of live entries, this one just isn't cached */
+    if (hashtable_elements(dns_shared.cache) < DNS_CACHE_MAX) {
+        entry = malloc(sizeof(*entry));
+        entry->count     = count;
+        entry->expires   = wheel_now() + (uint64_t)dns_min(ttl, DNS_TTL_MAX) * 1000;
+        entry->addresses = malloc(sizeof(dns_address_t) * count);
+        memcpy(entry->addresses, addresses, sizeof(dns_address_t) * count);
+        hashtable_insert(dns_shared.cache, name, entry);
+    }
+    pthread_mutex_unlock(&dns_shared.lock);
+}
+
+/* Hosts file entries never expire and take precedence over the nameservers */
+static void dns_hosts_add(const char *name, const dns_address_t *address) {
+    dns_entry_t *entry = hashtable_find(dns_shared.cache, name);
+    if (!entry) {
+        entry = malloc(sizeof(*entry));
+        entry->addresses = NULL;
+        entry->count     = 0;
+        entry->expires   = UINT64_MAX;
+        hashtable_insert(dns_shared.cache, name, entry);
+    }
+
+    entry->addresses = realloc(entry->addresses, sizeof(dns_address_t) * (entry->count + 1));
+    entry->addresses[entry->count++] = *address;
+}
+
+static void dns_hosts_load(const char *file) {
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+        return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char         *save;
+        char         *token = strtok_r(line, " \t\r\n", &save);
+        dns_address_t address;
+        if (!token || !dns_address_parse(token, &address))
+            continue;
+
+        char name[DNS_NAME + 1];
+        while ((token = strtok_r(NULL, " \t\r\n", &save)))
+            if (dns_name_normalize(token, name))
+                dns_hosts_add(name, &address);
+    }
+    fclose(fp);
+}
+
+/* Nameservers */
+static bool dns_nameserver_add(const char *text, unsigned short port) {
+    if (dns_shared.count == DNS_NAMESERVERS)
+        return false;
+
+    /* Addresses with a port are either "[::1]:53" or "127.0.0.1:53" */
+    char  host[INET6_ADDRSTRLEN];
+    const char *colon = strrchr(text, ':');
+    const char *end   = text + strlen(text);
+    if (*text == '[') {
+        const char *close = strchr(text, ']');
+        if (!close)
+            return false;
+        if (close[1] == ':')
+            port = strtoul(close + 2, NULL, 10);
+        else if (close[1])
+            return false;
+        text++;
+        end = close;
+    } else if (colon && colon == strchr(text, ':')) {
+        port = strtoul(colon + 1, NULL, 10);
+        end  = colon;
+    }
+
+    if ((size_t)(end - text) >= sizeof(host) || port == 0)
+        return false;
+    memcpy(host, text, end - text);
+    host[end - text] = '\0';
+
+    dns_address_t address;
+    if (!dns_address_parse(host, &address))
+        return false;
+
+    struct sockaddr_storage *nameserver = &dns_shared.nameservers[dns_shared.count++];
+    memset(nameserver, 0, sizeof(*nameserver));
+    if (address.family == AF_INET6) {
+        struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)nameserver;
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port   = htons(port);
+        ipv6->sin6_addr   = address.ipv6;
+    } else {
+        struct sockaddr_in *ipv4 = (struct sockaddr_in *)nameserver;
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port   = htons(port);
+        ipv4->sin_addr   = address.ipv4;
+    }
+    return true;
+}
+
+/* The nameservers unless one was given, the search domains and ndots */
+static void dns_resolv_load(const char *file, bool nameservers) {
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+        return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *save;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        if (!token)
+            continue;
+
+        if (!strcmp(token, "nameserver")) {
+            if (!nameservers || !(token = strtok_r(NULL, " \t\r\n", &save)))
+                continue;
+            if (!dns_nameserver_add(token, 53))
+                fprintf(stderr, "    dns      => ignoring nameserver %s (%s)\n", token,
+                    (dns_shared.count == DNS_NAMESERVERS) ? "too many" : "invalid");
+        } else if (!strcmp(token, "search") || !strcmp(token, "domain")) {
+            /* Whichever comes last is used like the C library does */
+            dns_shared.searches = 0;
+            while ((token = strtok_r(NULL, " \t\r\n", &save)) && dns_shared.searches < DNS_SEARCH)
+                if (dns_name_normalize(token, dns_shared.search[dns_shared.searches]))
+                    dns_shared.searches++;
+        } else if (!strcmp(token, "options")) {
+            while ((token = strtok_r(NULL, " \t\r\n", &save)))
+                if (!strncmp(token, "ndots:", 6))
+                    dns_shared.ndots = dns_min(strtoul(token + 6, NULL, 10), 15);
+        }
+    }
+    fclose(fp);
+}
+
+/* Answers are only taken from the nameservers the queries were sent to */
+static bool dns_nameserver_find(const struct sockaddr_storage *from) {
+    for (size_t i = 0; i < dns_shared.count; i++) {
+        const struct sockaddr_storage *nameserver = &dns_shared.nameservers[i];
+        if (from->ss_family != nameserver->ss_family)
+            continue;
+
+        if (from->ss_family == AF_INET6) {
+            const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)from;
+            const struct sockaddr_in6 *b = (const struct sockaddr_in6 *)nameserver;
+            if (a->sin6_port == b->sin6_port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)))
+                return true;
+        } else {
+            const struct sockaddr_in *a = (const struct sockaddr_in *)from;
+            const struct sockaddr_in *b = (const struct sockaddr_in *)nameserver;
+            if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+                return true;
+        }
+    }
+    return false;
+}
+
+bool dns_init(const char *nameserver) {
+    if (pthread_mutex_init(&dns_shared.lock, NULL) != 0)
+        return false;
+
+    dns_shared.count    = 0;
+    dns_shared.searches = 0;
+    dns_shared.ndots    = 1;
+    dns_shared.cache    = hashtable_create(DNS_CACHE_MAX);
+
+    if (nameserver && !dns_nameserver_add(nameserver, 53))
+        fprintf(stderr, "    dns      => invalid nameserver %s (using resolv.conf)\n", nameserver);
+    dns_resolv_load("/etc/resolv.conf", !dns_shared.count);
+
+    /* What the C library falls back to as well */
+    if (!dns_shared.count)
+        dns_nameserver_add("127.0.0.1", 53);
+
+    dns_hosts_load("/etc/hosts");
+
+    for (size_t i = 0; i < dns_shared.count; i++) {
+        char host[INET6_ADDRSTRLEN];
+        char port[8];
+        getnameinfo((struct sockaddr *)&dns_shared.nameservers[i], dns_nameserver_length(&dns_shared.nameservers[i]),
+            host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+        printf("    dns      => nameserver %s port %s\n", host, port);
+    }
+    for (size_t i = 0; i < dns_shared.searches; i++)
+        printf("    dns      => search %s (ndots %zu)\n", dns_shared.search[i], dns_shared.ndots);
+
+    return true;
+}
+
+void dns_deinit(void) {
+    hashtable_foreach(dns_shared.cache, &dns_entry_destroy);
+    hashtable_destroy(dns_shared.cache);
+    pthread_mutex_destroy(&dns_shared.lock);
+}
+
+
+/*
+ * The names tried for a name, in order, the way the C library does it.
+ * Names with fewer dots than ndots go through the search domains before
+ * they're tried as they are, the others are tried as they are first. Names
+ * ending with a dot are only ever tried as they are.
+ */
+static size_t dns_search(const char *name, char (*names)[DNS_NAME + 1]) {
+    char normal[DNS_NAME + 1];
+    if (!dns_name_normalize(name, normal))
+        return 0;
+
+    size_t dots = 0;
+    for (const char *find = normal; (find = strchr(find, '.')); find++)
+        dots++;
+
+    bool   absolute = name[strlen(name) - 1] == '.';
+    bool   first    = absolute || dots >= dns_shared.ndots;
+    size_t count    = 0;
+
+    if (first)
+        strcpy(names[count++], normal);
+    for (size_t i = 0; !absolute && i < dns_shared.searches; i++) {
+        char joined[2 * (DNS_NAME + 1)];
+        snprintf(joined, sizeof(joined), "%s.%s", normal, dns_shared.search[i]);
+        if (dns_name_normalize(joined, names[count]))
+            count++;
+    }
+    if (!first)
+        strcpy(names[count++], normal);
+
+    return count;
+}
+
+/* Resolvers */
+dns_t *dns_create(wheel_t *wheel) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    dns_t *dns = malloc(sizeof(*dns));
+    dns->wheel   = wheel;
+    dns->random  = mt_create();
+    dns->lookups = list_create();
+    dns->fd      = fd;
+
+    return dns;
+}
+
+static void dns_lookup_close(dns_lookup_t *lookup) {
+    for (size_t i = 0; i < 2; i++) {
+        if (lookup->fds[i] != -1)
+            close(lookup->fds[i]);
+        lookup->fds[i] = -1;
+    }
+}
+
+static void dns_lookup_destroy(dns_lookup_t *lookup) {
+    dns_lookup_close(lookup);
+    wheel_timer_destroy(lookup->timer);
+    list_foreach(lookup->queries, &free);
+    list_destroy(lookup->queries);
+    free(lookup->addresses);
+    free(lookup->key);
+    free(lookup);
+}
+
+void dns_destroy(dns_t *dns) {
+    if (!dns)
+        return;
+
+    list_foreach(dns->lookups, &dns_lookup_destroy);
+    list_destroy(dns->lookups);
+    mt_destroy(dns->random);
+    close(dns->fd);
+    free(dns);
+}
+
+int dns_getfd(const dns_t *dns) {
+    return dns->fd;
+}
+
+static size_t dns_query_packet(const dns_lookup_t *lookup, size_t type, unsigned char *packet) {
+    unsigned char *data = packet;
+
+    data = dns_put16(data, lookup->ids[type]);
+    data = dns_put16(data, DNS_FLAG_RECURSE);
+    data = dns_put16(data, 1); /* question      */
+    data = dns_put16(data, 0); /* answers       */
+    data = dns_put16(data, 0); /* authority     */
+    data = dns_put16(data, 1); /* additional    */
+
+    for (const char *label = lookup->names[lookup->candidate]; *label; ) {
+        size_t length = strcspn(label, ".");
+        *data++ = length;
+        memcpy(data, label, length);
+        data  += length;
+        label += length;
+        if (*label == '.')
+            label++;
+    }
+    *data++ = 0;
+    data = dns_put16(data, dns_types[type]);
+    data = dns_put16(data, DNS_CLASS_IN);
+
+    /* EDNS0 pseudo record so answers with many addresses aren't truncated */
+    *data++ = 0;
+    data = dns_put16(data, DNS_TYPE_OPT);
+    data = dns_put16(data, DNS_PAYLOAD);
+    data = dns_put16(data, 0);
+    data = dns_put16(data, 0);
+    data = dns_put16(data, 0);
+
+    return data - packet;
+}
+
+/*
+ * Sockets are made for the family of the nameserver when it's first asked.
+ * They're never bound, the kernel picks a random ephemeral port for them.
+ */
+static int dns_lookup_socket(dns_lookup_t *lookup, int family) {
+    int *fd = &lookup->fds[family == AF_INET6];
+    if (*fd != -1)
+        return *fd;
+
+    if ((*fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+
+    struct epoll_event event = {
+        .events  = EPOLLIN,
+        .data.fd = *fd
+    };
+    if (epoll_ctl(lookup->dns->fd, EPOLL_CTL_ADD, *fd, &event) == -1) {
+        close(*fd);
+        *fd = -1;
+    }
+    return *fd;
+}
+
+/* Every attempt goes to the next nameserver, only unanswered queries are sent */
+static void dns_lookup_send(dns_lookup_t *lookup) {
+    const struct sockaddr_storage *nameserver = &dns_shared.nameservers[lookup->attempts++ % dns_shared.count];
+    int                            fd         = dns_lookup_socket(lookup, nameserver->ss_family);
+
+    for (size_t i = 0; fd != -1 && i < DNS_TYPES; i++) {
+        if (lookup->answered[i])
+            continue;
+
+        /* A send which fails is no different than a lost answer */
+        unsigned char packet[DNS_HEADER + DNS_NAME + 2 + 4 + 11];
+        size_t        length = dns_query_packet(lookup, i, packet);
+        sendto(fd, packet, length, 0, (const struct sockaddr *)nameserver, dns_nameserver_length(nameserver));
+    }
+
+    wheel_timer_schedule(lookup->timer, DNS_TIMEOUT);
+}
+
+/*
+ * Asks for the next name which isn't known not to exist, with new IDs from
+ * new sockets. False when there's nothing left to ask, the addresses are
+ * whatever is known then.
+ */
+static bool dns_lookup_start(dns_lookup_t *lookup) {
+    dns_lookup_close(lookup);
+    free(lookup->addresses);
+    lookup->addresses = NULL;
+    lookup->count     = 0;
+
+    for (; lookup->candidate < lookup->candidates; lookup->candidate++) {
+        dns_address_t *addresses;
+        size_t         count;
+        if (!dns_cache_find(lookup->names[lookup->candidate], false, &addresses, &count))
+            break;
+        if (count) {
+            lookup->addresses = addresses;
+            lookup->count     = count;
+            return false;
+        }
+        free(addresses);
+    }
+    if (lookup->candidate == lookup->candidates)
+        return false;
+
+    lookup->attempts = 0;
+    lookup->ttl      = DNS_TTL_MAX;
+    lookup->negative = DNS_TTL_MAX;
+    for (size_t i = 0; i < DNS_TYPES; i++) {
+        lookup->ids[i]      = mt_urand(lookup->dns->random) & 0xFFFF;
+        lookup->answered[i] = false;
+    }
+
+    dns_lookup_send(lookup);
+    return true;
+}
+
+/* Everyone waiting is called back, they may cancel the others meanwhile */
+static void dns_lookup_finish(dns_lookup_t *lookup) {
+    list_erase(lookup->dns->lookups, lookup);
+    lookup->finishing = true;
+
+    dns_query_t *query;
+    while ((query = list_shift(lookup->queries))) {
+        query->callback(lookup->addresses, lookup->count, query->data);
+        free(query);
+    }
+
+    dns_lookup_destroy(lookup);
+}
+
+/*
+ * Done with a name. Timeouts and nameserver failures aren't cached, names
+ * which exist without addresses or don't exist at all are. Without any
+ * addresses the next name is tried.
+ */
+static void dns_lookup_done(dns_lookup_t *lookup) {
+    const char *name     = lookup->names[lookup->candidate];
+    bool        answered = true;
+    for (size_t i = 0; i < DNS_TYPES; i++)
+        answered = answered && lookup->answered[i];
+
+    if (lookup->count) {
+        /* Addresses of the first type go first */
+        dns_address_t *sorted = malloc(sizeof(dns_address_t) * lookup->count);
+        size_t         next   = 0;
+        for (size_t i = 0; i < DNS_TYPES; i++)
+            for (size_t j = 0; j < lookup->count; j++)
+                if (lookup->addresses[j].family == ((dns_types[i] == DNS_TYPE_AAAA) ? AF_INET6 : AF_INET))
+                    sorted[next++] = lookup->addresses[j];
+        free(lookup->addresses);
+        lookup->addresses = sorted;
+
+        dns_cache_insert(name, lookup->addresses, lookup->count, lookup->ttl);
+    } else if (answered) {
+        dns_cache_insert(name, NULL, 0, lookup->negative);
+    }
+
+    if (!lookup->count) {
+        lookup->candidate++;
+        if (dns_lookup_start(lookup))
+            return;
+    }
+
+    dns_lookup_finish(lookup);
+}
+
+static void dns_lookup_timeout(wheel_timer_t *timer, dns_lookup_t *lookup) {
+    (void)timer;
+    if (lookup->attempts < DNS_ATTEMPTS)
+        dns_lookup_send(lookup);
+    else
+        dns_lookup_done(lookup);
+}
+
+static dns_lookup_t *dns_lookup_find(dns_t *dns, int fd) {
+    return list_search(dns->lookups, &fd,
+        lambda bool(dns_lookup_t *lookup, int *fd)
+            => return lookup->fds[0] == *fd || lookup->fds[1] == *fd;
+    );
+}
+
+/* Walks the resource records of a section, returning the offset past them */
+typedef void (*dns_record_func)(dns_lookup_t *lookup, size_t type, uint16_t rrtype, uint32_t ttl, const unsigned char *data, size_t length);
+
+static size_t dns_records(const unsigned char *packet, size_t length, size_t offset, size_t count, dns_lookup_t *lookup, size_t type, dns_record_func record) {
+    char name[DNS_NAME + 2];
+    for (size_t i = 0; i < count; i++) {
+        if (!dns_name_read(packet, length, offset, name, &offset) || offset + 10 > length)
+            return 0;
+
+        uint16_t rrtype  = dns_get16(packet + offset);
+        uint16_t rrclass = dns_get16(packet + offset + 2);
+        uint32_t ttl     = dns_get32(packet + offset + 4);
+        uint16_t rdlen   = dns_get16(packet + offset + 8);
+        offset += 10;
+
+        if (offset + rdlen > length)
+            return 0;
+        if (rrclass == DNS_CLASS_IN)
+            record(lookup, type, rrtype, ttl, packet + offset, rdlen);
+        offset += rdlen;
+    }
+    return offset;
+}
+
+/* Answers of a recursive nameserver contain the CNAME chain followed by the addresses */
+static void dns_record_answer(dns_lookup_t *lookup, size_t type, uint16_t rrtype, uint32_t ttl, const unsigned char *data, size_t length) {
+    dns_address_t address = { .family = (dns_types[type] == DNS_TYPE_AAAA) ? AF_INET6 : AF_INET };
+    size_t        size    = (address.family == AF_INET6) ? sizeof(address.ipv6) : sizeof(address.ipv4);
+
+    if (rrtype == DNS_TYPE_CNAME) {
+        lookup->ttl = dns_min(lookup->ttl, ttl);
+        return;
+    }
+
+    if (rrtype != dns_types[type] || length != size)
+        return;
+
+    memcpy((address.family == AF_INET6) ? (void *)&address.ipv6 : (void *)&address.ipv4, data, size);
+    lookup->addresses = realloc(lookup->addresses, sizeof(dns_address_t) * (lookup->count + 1));
+    lookup->addresses[lookup->count++] = address;
+    lookup->ttl = dns_min(lookup->ttl, ttl);
+}
+
+/* Negative answers are cached for as long as the SOA says (RFC 2308) */
+static void dns_record_authority(dns_lookup_t *lookup, size_t type, uint16_t rrtype, uint32_t ttl, const unsigned char *data, size_t length) {
+    (void)type;
+    if (rrtype != DNS_TYPE_SOA || length < 20)
+        return;
+    lookup->negative = dns_min(lookup->negative, dns_min(ttl, dns_get32(data + length - 4)));
+}
+
+static void dns_answer(dns_lookup_t *lookup, const unsigned char *packet, size_t length) {
+    if (length < DNS_HEADER)
+        return;
+
+    uint16_t id        = dns_get16(packet);
+    uint16_t flags     = dns_get16(packet + 2);
+    uint16_t questions = dns_get16(packet + 4);
+    uint16_t answers   = dns_get16(packet + 6);
+    uint16_t authority = dns_get16(packet + 8);
+    uint16_t rcode     = flags & 0x0F;
+
+    if (!(flags & DNS_FLAG_RESPONSE) || questions != 1)
+        return;
+
+    size_t type = 0;
+    while (type < DNS_TYPES && (lookup->ids[type] != id || lookup->answered[type]))
+        type++;
+    if (type == DNS_TYPES)
+        return;
+
+    /* The question has to be ours as well, the ID alone is easy to guess */
+    char   name[DNS_NAME + 2];
+    size_t offset;
+    if (!dns_name_read(packet, length, DNS_HEADER, name, &offset) || offset + 4 > length)
+        return;
+    if (strcmp(name, lookup->names[lookup->candidate]) || dns_get16(packet + offset) != dns_types[type])
+        return;
+    offset += 4;
+
+    /* Server failures and refusals are retried on the next nameserver */
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN)
+        return;
+
+    size_t count = lookup->count;
+    if (!(offset = dns_records(packet, length, offset, answers, lookup, type, &dns_record_answer)))
+        return;
+
+    if (lookup->count == count) {
+        /* A truncated answer without addresses says nothing */
+        if (flags & DNS_FLAG_TRUNCATED)
+            return;
+
+        uint32_t negative = lookup->negative;
+        lookup->negative = UINT32_MAX;
+        dns_records(packet, length, offset, authority, lookup, type, &dns_record_authority);
+        lookup->negative = dns_min(negative, (lookup->negative == UINT32_MAX) ? DNS_TTL_NEGATIVE : lookup->negative);
+    }
+
+    lookup->answered[type] = true;
+    for (size_t i = 0; i < DNS_TYPES; i++)
+        if (!lookup->answered[i])
+            return;
+
+    dns_lookup_done(lookup);
+}
+
+/*
+ * Answering can complete the lookup owning a socket and close it, the owner
+ * is looked for again before every read.
+ */
+void dns_process(dns_t *dns) {
+    unsigned char      packet[DNS_PAYLOAD];
+    struct epoll_event events[16];
+    int                ready;
+
+    while ((ready = epoll_wait(dns->fd, events, sizeof(events) / sizeof(*events), 0)) > 0) {
+        for (int i = 0; i < ready; i++) {
+            int           fd = events[i].data.fd;
+            dns_lookup_t *lookup;
+            while ((lookup = dns_lookup_find(dns, fd))) {
+                struct sockaddr_storage from;
+                socklen_t               fromlen = sizeof(from);
+                ssize_t                 length  = recvfrom(fd, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromlen);
+                if (length == -1)
+                    break;
+                if (dns_nameserver_find(&from))
+                    dns_answer(lookup, packet, length);
+            }
+        }
+    }
+}
+
+bool dns_cached(const char *name, dns_address_t **addresses, size_t *count) {
+    dns_address_t literal;
+    if (dns_address_parse(name, &literal)) {
+        *addresses = malloc(sizeof(literal));
+        *count     = 1;
+        **addresses = literal;
+        return true;
+    }
+
+    /* Names which cannot be looked up are as good as known not to exist */
+    char   names[DNS_SEARCH + 1][DNS_NAME + 1];
+    size_t candidates = dns_search(name, names);
+    if (!candidates) {
+        *addresses = NULL;
+        *count     = 0;
+        return true;
+    }
+
+    /* The hosts file only knows names as they are */
+    char normal[DNS_NAME + 1];
+    dns_name_normalize(name, normal);
+    if (dns_cache_find(normal, true, addresses, count))
+        return true;
+
+    /* Known once a name has addresses or all of them are known not to exist */
+    for (size_t i = 0; i < candidates; i++) {
+        if (!dns_cache_find(names[i], false, addresses, count))
+            return false;
+        if (*count)
+            return true;
+        free(*addresses);
+    }
+
+    *addresses = NULL;
+    *count     = 0;
+    return true;
+}
+
+dns_query_t *dns_resolve(dns_t *dns, const char *name, dns_callback_t callback, void *data) {
+    dns_address_t *addresses;
+    size_t         count;
+    if (dns_cached(name, &addresses, &count)) {
+        callback(addresses, count, data);
+        free(addresses);
+        return NULL;
+    }
+
+    /* Relative and absolute names are looked up differently */
+    char key[DNS_NAME + 2];
+    dns_name_normalize(name, key);
+    if (name[strlen(name) - 1] == '.')
+        strcat(key, ".");
+
+    dns_lookup_t *lookup = list_search(dns->lookups, key,
+        lambda bool(dns_lookup_t *lookup, const char *key)
+            => return !strcmp(lookup->key, key);
+    );
+
+    if (!lookup) {
+        lookup = calloc(1, sizeof(*lookup));
+        lookup->dns        = dns;
+        lookup->key        = strdup(key);
+        lookup->queries    = list_create();
+        lookup->candidates = dns_search(name, lookup->names);
+        lookup->fds[0]     = -1;
+        lookup->fds[1]     = -1;
+        lookup->timer      = wheel_timer_create(dns->wheel, (wheel_callback_t)&dns_lookup_timeout, lookup);
+
+        /* Another resolver may have just found the answer */
+        if (!dns_lookup_start(lookup)) {
+            callback(lookup->addresses, lookup->count, data);
+            dns_lookup_destroy(lookup);
+            return NULL;
+        }
+        list_push(dns->lookups, lookup);
+    }
+
+    dns_query_t *query = malloc(sizeof(*query));
+    query->lookup   = lookup;
+    query->callback = callback;
+    query->data     = data;
+    list_push(lookup->queries, query);
+    return query;
+}
+
+void dns_cancel(dns_query_t *query) {
+    if (!query)
+        return;
+
+    /* Its callback is being called right now */
+    dns_lookup_t *lookup = query->lookup;
+    if (!list_erase(lookup->queries, query))
+        return;
+    free(query);
+
+    /* Nobody is waiting on the answer anymore */
+    if (!lookup->finishing && !list_length(lookup->queries)) {
+        list_erase(lookup->dns->lookups, lookup);
+        dns_lookup_destroy(lookup);
+    }
+}
@@ -0,0 +1,153 @@
+#ifndef REDROID_DNS_HDR
+#define REDROID_DNS_HDR
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "wheel.h"
+
+typedef struct dns_s       dns_t;
+typedef struct dns_query_s dns_query_t;
+
+/*
+ * Type: dns_address_t
+ *  A resolved address of either family.
+ */
+typedef struct {
+    int family; /* AF_INET or AF_INET6 */
+    union {
+        struct in_addr  ipv4;
+        struct in6_addr ipv6;
+    };
+} dns_address_t;
+
+/*
+ * Type: dns_callback_t
+ *  Called once a lookup completes. A count of zero means the name could
+ *  not be resolved. The addresses are only valid for the duration of the
+ *  call.
+ */
+typedef void (*dns_callback_t)(const dns_address_t *addresses, size_t count, void *data);
+
+#define DNS_TIMEOUT      1000  /* ms before a query is sent again            */
+#define DNS_ATTEMPTS     4     /* sends before a lookup is given up on        */
+#define DNS_NAMESERVERS  3     /* nameservers taken from resolv.conf          */
+#define DNS_SEARCH       6     /* search domains taken from resolv.conf       */
+#define DNS_TTL_MAX      86400 /* s an answer is cached at most               */
+#define DNS_TTL_NEGATIVE 30    /* s a failure is cached when there is no SOA  */
+#define DNS_CACHE_MAX    1024  /* names held in the cache                     */
+
+/*
+ * Function: dns_init
+ *  Configure the nameservers, the search domains and ndots, and load the
+ *  hosts file into the cache shared by all resolvers.
+ *
+ * Parameters:
+ *  nameserver  - An address and optional port of the nameserver to use,
+ *                "127.0.0.1:5353" or "[::1]:5353", NULL to use the ones
+ *                from /etc/resolv.conf. The search domains always come
+ *                from there.
+ *
+ * Returns:
+ *  True on success, false otherwise.
+ */
+bool dns_init(const char *nameserver);
+
+/*
+ * Function: dns_deinit
+ *  Release the cache, all resolvers must be destroyed first.
+ */
+void dns_deinit(void);
+
+/*
+ * Function: dns_create
+ *  Create an asynchronous resolver. Retransmissions are scheduled on the
+ *  given wheel and answers are read with <dns_process> when the descriptor
+ *  of the resolver becomes readable, both must happen on the same thread.
+ *
+ * Parameters:
+ *  wheel   - The timer wheel of the event loop driving the resolver
+ *
+ * Returns:
+ *  A resolver or NULL on failure.
+ */
+dns_t *dns_create(wheel_t *wheel);
+
+/*
+ * Function: dns_destroy
+ *  Destroy a resolver. Lookups still in flight are dropped without their
+ *  callbacks being called.
+ *
+ * Parameters:
+ *  dns     - The resolver to destroy
+ */
+void dns_destroy(dns_t *dns);
+
+/*
+ * Function: dns_getfd
+ *  Get the descriptor of a resolver to wait for readability on. It's an
+ *  epoll descriptor for the sockets of the lookups in flight.
+ *
+ * Parameters:
+ *  dns     - The resolver
+ */
+int dns_getfd(const dns_t *dns);
+
+/*
+ * Function: dns_process
+ *  Read all pending answers, completing the lookups they belong to. Every
+ *  socket is drained so it is suitable for edge-triggered polling.
+ *
+ * Parameters:
+ *  dns     - The resolver
+ */
+void dns_process(dns_t *dns);
+
+/*
+ * Function: dns_cached
+ *  Look up what is already known about a name without asking the
+ *  nameservers: address literals, the hosts file and the cache. Names
+ *  are completed with the search domains like <dns_resolve> does.
+ *
+ * Parameters:
+ *  name        - The name to look up
+ *  addresses   - Set to the addresses which must be freed by the caller
+ *  count       - Set to the amount of addresses, zero for names which
+ *                are known not to exist
+ *
+ * Returns:
+ *  True if the name is known, false when it needs to be resolved.
+ */
+bool dns_cached(const char *name, dns_address_t **addresses, size_t *count);
+
+/*
+ * Function: dns_resolve
+ *  Resolve both the IPv6 and IPv4 addresses of a name. Address literals,
+ *  hosts file entries and cached answers complete right away by calling
+ *  the callback before this returns. Names with fewer dots than ndots
+ *  are tried with the search domains first. Resolving a name which is
+ *  already being resolved waits on the same lookup.
+ *
+ * Parameters:
+ *  dns         - The resolver
+ *  name        - The name to resolve
+ *  callback    - Called when the lookup completes
+ *  data        - Passed to the callback
+ *
+ * Returns:
+ *  The lookup in flight which can be cancelled with <dns_cancel> or NULL
+ *  when the callback was already called.
+ */
+dns_query_t *dns_resolve(dns_t *dns, const char *name, dns_callback_t callback, void *data);
+
+/*
+ * Function: dns_cancel
+ *  Cancel a lookup in flight, its callback won't be called. The names
+ *  stop being asked for once nobody waits on them anymore.
+ *
+ * Parameters:
+ *  query   - The lookup to cancel, NULL is ignored
+ */
+void dns_cancel(dns_query_t *query);
+
+#endif
@@ -1,214 +1,472 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <pthread.h>
 
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
 #include "hashtable.h"
-#include "list.h"
+#include "probe.h"
+
+/*
+ * An open addressed table in the style of a Swiss table. Next to the slots
+ * is an array of control bytes, one per slot, either HASHTABLE_EMPTY or
+ * the top seven bits of the hash of the key in the slot. Lookups compare a
+ * group of sixteen control bytes at once (with SSE2 where available) and
+ * only look at the slots whose control byte matches.
+ *
+ * Probing is linear so removal shifts the slots after a hole back rather
+ * than leaving tombstones behind. The first group of control bytes is
+ * mirrored past the end so a group can always be loaded in one go.
+ *
+ * Slots keep the full hash and keys short enough are kept inline in the
+ * slot, longer keys are copied to the heap. Like before inserting doesn't
+ * look for the key, when a key is inserted twice the first one is found
+ * until it is removed.
+ *
+ * When three quarters full the table grows to twice the size, but rather
+ * than moving everything at once the old slots are moved over a run at a
+ * time by the insertions and removals that follow. Until then lookups look
+ * in the old slots before the new ones.
+ *
+ * Lookups only read the table so they take the lock shared and run next to
+ * each other, only insertions and removals take it exclusively. Iteration
+ * takes a snapshot of the elements under the shared lock and calls back
+ * after letting go of it, so callbacks don't hold up writers and may
+ * change the table themselves.
+ *
+ * The snapshot holds the values, not their lifetime. Whoever frees values
+ * of a table others iterate must make sure no callback still uses them:
+ * the channels of an instance are only removed and freed with its shard
+ * locked, and everything iterating them off the event loop locks it too.
+ */
+#define HASHTABLE_GROUP 16
+#define HASHTABLE_EMPTY ((int8_t)-128)
+#define HASHTABLE_LOCAL 16
+#define HASHTABLE_MOVE  HASHTABLE_GROUP /* old slots visited per operation */
+
+typedef struct {
+    uint64_t hash;
+    void    *value;
+    union {
+        char *heap;
+        char  local[HASHTABLE_LOCAL]; /* last byte is zero for local keys */
+    } key;
+} hashtable_slot_t;
+
+typedef struct {
+    int8_t           *control;  /* size + HASHTABLE_GROUP bytes */
+    hashtable_slot_t *slots;
+    size_t            elements;
+    size_t            size;     /* power of two, at least HASHTABLE_GROUP */
+} hashtable_array_t;
 
 struct hashtable_s {
-    list_t        **table;
-    size_t          elements;
-    size_t          size;
-    pthread_mutex_t mutex;
+    hashtable_array_t table;
+    hashtable_array_t old;      /* being moved into table, empty otherwise */
+    size_t            first;    /* empty slot of old the move started from */
+    size_t            moved;    /* slots of old visited from there */
+    size_t            resizes;
+    pthread_rwlock_t  lock;
 };
 
 static inline size_t hashtable_pot(size_t size) {
-    size--;
-    size |= size >> 1;
-    size |= size >> 2;
-    size |= size >> 8;
-    size |= size >> 16;
+    size_t pot = HASHTABLE_GROUP;
+    while (pot < size)
+        pot <<= 1;
+    return pot;
+}
 
-    if (sizeof(size_t) == 8)
-        size |= size >> (sizeof(size_t) * 4); /* to prevent a warning where sizeof(size_t) != 8 */
+/* FNV-1a finished with a mix so the low bits used for the slot are good */
+static inline uint64_t hashtable_hash(const char *string) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*string)
+        hash = (hash ^ (unsigned char)*string++) * 1099511628211ull;
 
-    return size + 1;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-static inline size_t hashtable_hash(const char *string) {
-    size_t hash   = 0;
-    int    ch     = 0;
+static inline int8_t hashtable_tag(uint64_t hash) {
+    return (int8_t)(hash >> 57);
+}
 
-    while ((ch = *string++))
-        hash = ch + (hash << 6) + (hash << 16) - hash;
+/* Bit i of the mask is set when control byte i of the group matches */
+#if defined(__SSE2__)
+static inline uint32_t hashtable_group_match(const int8_t *group, int8_t tag) {
+    __m128i load = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(load, _mm_set1_epi8(tag)));
+}
 
-    return hash;
+static inline uint32_t hashtable_group_empty(const int8_t *group) {
+    /* Only empty control bytes have the top bit set */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+static inline uint32_t hashtable_group_match(const int8_t *group, int8_t tag) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < HASHTABLE_GROUP; i++)
+        mask |= (uint32_t)(group[i] == tag) << i;
+    return mask;
 }
 
-typedef struct {
-    char        *key;
-    void        *value;
-    hashtable_t *hashtable;
-} hashtable_entry_t;
+static inline uint32_t hashtable_group_empty(const int8_t *group) {
+    return hashtable_group_match(group, HASHTABLE_EMPTY);
+}
+#endif
 
-static inline hashtable_entry_t *hashtable_entry_create(const void *key, void *value) {
-    hashtable_entry_t *entry = malloc(sizeof(*entry));
-    entry->key   = strdup(key);
-    entry->value = value;
-    return entry;
+static inline const char *hashtable_slot_key(const hashtable_slot_t *slot) {
+    return slot->key.local[HASHTABLE_LOCAL - 1] ? slot->key.heap : slot->key.local;
+}
+
+static inline void hashtable_slot_fill(hashtable_slot_t *slot, const char *key, uint64_t hash, void *value) {
+    size_t length = strlen(key);
+    memset(&slot->key, 0, sizeof(slot->key));
+    if (length < HASHTABLE_LOCAL) {
+        memcpy(slot->key.local, key, length);
+    } else {
+        slot->key.heap = strdup(key);
+        slot->key.local[HASHTABLE_LOCAL - 1] = 1;
+    }
+    slot->hash  = hash;
+    slot->value = value;
 }
 
-static inline void hashtable_entry_destroy(hashtable_entry_t *entry) {
-    free(entry->key);
-    free(entry);
+static inline void hashtable_slot_clear(hashtable_slot_t *slot) {
+    if (slot->key.local[HASHTABLE_LOCAL - 1])
+        free(slot->key.heap);
 }
 
-static inline void *hashtable_entry_find(hashtable_t *hashtable, const char *key, size_t *index) {
-    *index = hashtable_hash(key) & (hashtable->size - 1);
+static inline void hashtable_control(hashtable_array_t *array, size_t index, int8_t control) {
+    array->control[index] = control;
+    if (index < HASHTABLE_GROUP)
+        array->control[array->size + index] = control;
+}
 
-    hashtable_entry_t pass = {
-        .key       = (char *)key,
-        .hashtable = hashtable
-    };
+static void hashtable_allocate(hashtable_array_t *array, size_t size) {
+    array->size     = size;
+    array->elements = 0;
+    array->slots    = malloc(sizeof(hashtable_slot_t) * size);
+    array->control  = malloc(size + HASHTABLE_GROUP);
+    memset(array->control, HASHTABLE_EMPTY, size + HASHTABLE_GROUP);
+}
 
-    return list_search(hashtable->table[*index], &pass,
-        lambda bool(const hashtable_entry_t *entrya, const hashtable_entry_t *entryb)
-            => return !strcmp(entrya->key, entryb->key);
-    );
+static void hashtable_release(hashtable_array_t *array) {
+    for (size_t i = 0; i < array->size; i++)
+        if (array->control[i] != HASHTABLE_EMPTY)
+            hashtable_slot_clear(&array->slots[i]);
+    free(array->slots);
+    free(array->control);
+    memset(array, 0, sizeof(*array));
 }
 
-hashtable_t *hashtable_create(size_t size) {
-    pthread_mutex_t mutex;
-    if (pthread_mutex_init(&mutex, NULL) != 0)
-        return NULL;
+/* The first empty slot on the way from where a hash starts */
+static size_t hashtable_vacant(hashtable_array_t *array, uint64_t hash) {
+    size_t mask = array->size - 1;
+    for (size_t index = hash & mask; ; index = (index + HASHTABLE_GROUP) & mask) {
+        uint32_t empty = hashtable_group_empty(&array->control[index]);
+        if (empty)
+            return (index + __builtin_ctz(empty)) & mask;
+    }
+}
+
+static size_t hashtable_index(hashtable_array_t *array, const char *key, uint64_t hash) {
+    if (!array->elements)
+        return SIZE_MAX;
+
+    size_t mask = array->size - 1;
+    int8_t tag  = hashtable_tag(hash);
+    for (size_t index = hash & mask; ; index = (index + HASHTABLE_GROUP) & mask) {
+        const int8_t *group = &array->control[index];
+        for (uint32_t match = hashtable_group_match(group, tag); match; match &= match - 1) {
+            size_t            find = (index + __builtin_ctz(match)) & mask;
+            hashtable_slot_t *slot = &array->slots[find];
+            if (slot->hash == hash && !strcmp(hashtable_slot_key(slot), key))
+                return find;
+        }
+        /* Nothing is stored past the first empty slot */
+        if (hashtable_group_empty(group))
+            return SIZE_MAX;
+    }
+}
+
+static void hashtable_place(hashtable_array_t *array, const hashtable_slot_t *slot) {
+    size_t index = hashtable_vacant(array, slot->hash);
+    array->slots[index] = *slot;
+    hashtable_control(array, index, hashtable_tag(slot->hash));
+    array->elements++;
+}
+
+static void hashtable_erase(hashtable_array_t *array, size_t hole) {
+    hashtable_slot_clear(&array->slots[hole]);
+
+    size_t mask = array->size - 1;
+    for (size_t next = (hole + 1) & mask; array->control[next] != HASHTABLE_EMPTY; next = (next + 1) & mask) {
+        if (probe_shifts(mask, array->slots[next].hash & mask, hole, next)) {
+            array->slots[hole] = array->slots[next];
+            hashtable_control(array, hole, array->control[next]);
+            hole = next;
+        }
+    }
+
+    hashtable_control(array, hole, HASHTABLE_EMPTY);
+    array->elements--;
+}
+
+/*
+ * Slots are moved elsewhere from an empty slot onwards, so a run of slots
+ * wrapping past the end stays in order and the first of a key inserted
+ * twice is still found first.
+ */
+static size_t hashtable_first(const hashtable_array_t *array) {
+    size_t first = 0;
+    while (array->control[first] != HASHTABLE_EMPTY)
+        first++;
+    return first;
+}
+
+/*
+ * Move the run of slots around an old slot into the table. Whole runs are
+ * moved so whatever is left in the old slots can still be found there.
+ */
+static void hashtable_move_run(hashtable_t *hashtable, size_t index) {
+    hashtable_array_t *old  = &hashtable->old;
+    size_t             mask = old->size - 1;
+
+    while (old->control[(index - 1) & mask] != HASHTABLE_EMPTY)
+        index = (index - 1) & mask;
+
+    for (; old->control[index] != HASHTABLE_EMPTY; index = (index + 1) & mask) {
+        hashtable_place(&hashtable->table, &old->slots[index]);
+        hashtable_control(old, index, HASHTABLE_EMPTY);
+        old->elements--;
+    }
+}
+
+static void hashtable_move(hashtable_t *hashtable, size_t count) {
+    hashtable_array_t *old = &hashtable->old;
+    if (!old->size)
+        return;
+
+    for (; count && hashtable->moved < old->size; count--, hashtable->moved++) {
+        size_t index = (hashtable->first + hashtable->moved) & (old->size - 1);
+        if (old->control[index] != HASHTABLE_EMPTY)
+            hashtable_move_run(hashtable, index);
+    }
+
+    if (hashtable->moved == old->size)
+        hashtable_release(old);
+}
+
+static void hashtable_grow(hashtable_t *hashtable) {
+    if (!probe_crowded(hashtable->table.elements + 1, hashtable->table.size))
+        return;
+
+    /* Only when growing again before the last one was done */
+    hashtable_move(hashtable, SIZE_MAX);
+
+    hashtable->old   = hashtable->table;
+    hashtable->first = hashtable_first(&hashtable->old);
+    hashtable->moved = 0;
+    hashtable->resizes++;
+    hashtable_allocate(&hashtable->table, hashtable->old.size * 2);
+}
 
+hashtable_t *hashtable_create(size_t size) {
     hashtable_t *hashtable = malloc(sizeof(*hashtable));
-    hashtable->size     = hashtable_pot(size);
-    hashtable->mutex    = mutex;
-    hashtable->table    = malloc(sizeof(list_t*) * size);
-    hashtable->elements = 0;
+    if (pthread_rwlock_init(&hashtable->lock, NULL) != 0) {
+        free(hashtable);
+        return NULL;
+    }
 
-    for (size_t i = 0; i < hashtable->size; i++)
-        hashtable->table[i] = list_create();
+    hashtable->first   = 0;
+    hashtable->moved   = 0;
+    hashtable->resizes = 0;
+    memset(&hashtable->old, 0, sizeof(hashtable->old));
+    hashtable_allocate(&hashtable->table, hashtable_pot(size));
 
     return hashtable;
 }
 
 void hashtable_destroy(hashtable_t *hashtable) {
-    pthread_mutex_lock(&hashtable->mutex);
-    for (size_t i = 0; i < hashtable->size; i++) {
-        hashtable_entry_t *entry;
-        while ((entry = list_pop(hashtable->table[i])))
-            hashtable_entry_destroy(entry);
-        list_destroy(hashtable->table[i]);
-    }
-
-    free(hashtable->table);
-    pthread_mutex_unlock(&hashtable->mutex);
-    pthread_mutex_destroy(&hashtable->mutex);
+    pthread_rwlock_wrlock(&hashtable->lock);
+    hashtable_release(&hashtable->old);
+    hashtable_release(&hashtable->table);
+    pthread_rwlock_unlock(&hashtable->lock);
+    pthread_rwlock_destroy(&hashtable->lock);
     free(hashtable);
 }
 
 void hashtable_insert(hashtable_t *hashtable, const char *key, void *value) {
-    size_t hash = hashtable_hash(key) & (hashtable->size - 1);
-    pthread_mutex_lock(&hashtable->mutex);
-    list_push(hashtable->table[hash], hashtable_entry_create(key, value));
-    hashtable->elements++;
-    pthread_mutex_unlock(&hashtable->mutex);
+    uint64_t hash = hashtable_hash(key);
+    pthread_rwlock_wrlock(&hashtable->lock);
+    hashtable_move(hashtable, HASHTABLE_MOVE);
+    hashtable_grow(hashtable);
+
+    /* Whatever the key is inserted after has to be moved first */
+    hashtable_array_t *old = &hashtable->old;
+    if (old->size && old->control[hash & (old->size - 1)] != HASHTABLE_EMPTY)
+        hashtable_move_run(hashtable, hash & (old->size - 1));
+
+    hashtable_slot_t slot;
+    hashtable_slot_fill(&slot, key, hash, value);
+    hashtable_place(&hashtable->table, &slot);
+    pthread_rwlock_unlock(&hashtable->lock);
 }
 
 bool hashtable_remove(hashtable_t *hashtable, const char *key) {
-    bool   value = true;
-    size_t index = 0;
-
-    pthread_mutex_lock(&hashtable->mutex);
-    hashtable_entry_t *find = hashtable_entry_find(hashtable, key, &index);
-    if (!find) {
-        value = false;
-        goto hashtable_remove_finish;
-    }
+    uint64_t hash = hashtable_hash(key);
+
+    pthread_rwlock_wrlock(&hashtable->lock);
+    hashtable_move(hashtable, HASHTABLE_MOVE);
 
-    if (!list_erase(hashtable->table[index], find)) {
-        value = false;
-        goto hashtable_remove_finish;
+    hashtable_array_t *array = &hashtable->old;
+    size_t             index = hashtable_index(array, key, hash);
+    if (index == SIZE_MAX) {
+        array = &hashtable->table;
+        index = hashtable_index(array, key, hash);
     }
 
-    hashtable_entry_destroy(find);
-    hashtable->elements--;
+    if (index != SIZE_MAX)
+        hashtable_erase(array, index);
+    pthread_rwlock_unlock(&hashtable->lock);
 
-hashtable_remove_finish:
-    pthread_mutex_unlock(&hashtable->mutex);
-    return value;
+    return index != SIZE_MAX;
 }
 
 void *hashtable_find(hashtable_t *hashtable, const char *key) {
-    pthread_mutex_lock(&hashtable->mutex);
-    hashtable_entry_t *find = hashtable_entry_find(hashtable, key, &(size_t){0});
-    pthread_mutex_unlock(&hashtable->mutex);
+    uint64_t hash = hashtable_hash(key);
+
+    pthread_rwlock_rdlock(&hashtable->lock);
+    hashtable_array_t *array = &hashtable->old;
+    size_t             index = hashtable_index(array, key, hash);
+    if (index == SIZE_MAX) {
+        array = &hashtable->table;
+        index = hashtable_index(array, key, hash);
+    }
+
+    void *value = (index != SIZE_MAX) ? array->slots[index].value : NULL;
+    pthread_rwlock_unlock(&hashtable->lock);
 
-    return find ? find->value : NULL;
+    return value;
 }
 
 size_t hashtable_elements(hashtable_t *hashtable) {
-    return hashtable ? hashtable->elements : 0;
+    return hashtable ? hashtable->table.elements + hashtable->old.elements : 0;
+}
+
+/* Probe lengths are how many slots a lookup looks at to find an element */
+void hashtable_stats(hashtable_t *hashtable, hashtable_stats_t *stats) {
+    size_t probes = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_rwlock_rdlock(&hashtable->lock);
+    const hashtable_array_t *arrays[] = { &hashtable->old, &hashtable->table };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++) {
+        const hashtable_array_t *array = arrays[i];
+        size_t                   mask  = array->size - 1;
+        for (size_t j = 0; j < array->size; j++) {
+            if (array->control[j] == HASHTABLE_EMPTY)
+                continue;
+            size_t probe = ((j - array->slots[j].hash) & mask) + 1;
+            probes += probe;
+            if (probe > stats->probemax)
+                stats->probemax = probe;
+        }
+    }
+
+    stats->elements  = hashtable->table.elements + hashtable->old.elements;
+    stats->size      = hashtable->table.size;
+    stats->load      = (double)stats->elements / stats->size;
+    stats->probemean = stats->elements ? (double)probes / stats->elements : 0;
+    stats->resizes   = hashtable->resizes;
+    stats->resizing  = hashtable->old.size != 0;
+    pthread_rwlock_unlock(&hashtable->lock);
 }
 
 /*
- * This structure when used in the context of foreach takes on two meanings.
- *  If `keys' is true then `keyfunc' callback is used, otherwise `valuefunc'
- *  is. The latter is called with the value of the current iteration and
- *  `pass' as the second argument, while the former is called with the same
- *  arguments except shifted forward with the `const char *' being passed the
- *  key of the current iteration.
- *
- * This structure when used in the context of a copy only has one meaning.
- *  The copyfunc callback is to be called passing in the value of the current
- *  iteration, `pass' and `keys' are ignored.
+ * If `keys' is true the callback is called with the key of the current
+ * iteration, its value and `pass', otherwise just with the value and
+ * `pass'. Keys are copied into the snapshot along with the values, they
+ * are only valid for the duration of the callback. Values are not kept
+ * alive by the snapshot, see above.
  */
 typedef struct {
-    union {
-        void *callback;
-        void (*valuefunc)(void *, void *);
-        void (*keyfunc)(const char *, void *, void *);
-        void *(*copyfunc)(void *);
-    };
-    void *pass;
-} hashtable_pass_t;
+    const char *key;
+    void       *value;
+} hashtable_entry_t;
 
 void hashtable_foreach_impl(hashtable_t *hashtable, void *pass, void *callback, bool keys) {
-    pthread_mutex_lock(&hashtable->mutex);
-    for (size_t i = 0; i < hashtable->size; i++) {
-        list_t *list = hashtable->table[i];
-        if (!list)
-            break;
-
-        hashtable_pass_t data = {
-            .callback = callback,
-            .pass = pass,
-        };
+    void (*valuefunc)(void *, void *)              = callback;
+    void (*keyfunc)(const char *, void *, void *) = callback;
+
+    pthread_rwlock_rdlock(&hashtable->lock);
+    const hashtable_array_t *arrays[] = { &hashtable->old, &hashtable->table };
+    size_t                   count    = hashtable->old.elements + hashtable->table.elements;
+    size_t                   bytes    = 0;
+
+    if (keys)
+        for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++)
+            for (size_t j = 0; j < arrays[i]->size; j++)
+                if (arrays[i]->control[j] != HASHTABLE_EMPTY)
+                    bytes += strlen(hashtable_slot_key(&arrays[i]->slots[j])) + 1;
+
+    hashtable_entry_t *entries = malloc(sizeof(*entries) * count + bytes);
+    hashtable_entry_t *entry   = entries;
+    char              *copy    = (char *)(entries + count);
+
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++) {
+        const hashtable_array_t *array = arrays[i];
+        for (size_t j = 0; j < array->size; j++) {
+            if (array->control[j] == HASHTABLE_EMPTY)
+                continue;
+
+            entry->value = array->slots[j].value;
+            if (keys) {
+                size_t length = strlen(hashtable_slot_key(&array->slots[j])) + 1;
+                entry->key = memcpy(copy, hashtable_slot_key(&array->slots[j]), length);
+                copy += length;
+            }
+            entry++;
+        }
+    }
+    pthread_rwlock_unlock(&hashtable->lock);
 
+    for (size_t i = 0; i < count; i++) {
         if (keys)
-            list_foreach(list, &data,
-                lambda void(hashtable_entry_t *entry, hashtable_pass_t *pass)
-                    => pass->keyfunc(entry->key, entry->value, pass->pass);
-            );
+            keyfunc(entries[i].key, entries[i].value, pass);
         else
-            list_foreach(list, &data,
-                lambda void(hashtable_entry_t *entry, hashtable_pass_t *pass)
-                    => pass->valuefunc(entry->value, pass->pass);
-            );
+            valuefunc(entries[i].value, pass);
     }
-    pthread_mutex_unlock(&hashtable->mutex);
+    free(entries);
 }
 
 hashtable_t *hashtable_copy_impl(hashtable_t *hashtable, void *(*copy)(void *)) {
-    hashtable_t *copied = hashtable_create(hashtable->size);
-    pthread_mutex_lock(&hashtable->mutex);
-    for (size_t i = 0; i < hashtable->size; i++) {
-        list_t *list = hashtable->table[i];
-        if (!list)
-            break;
-
-        list_foreach(list,
-            &((hashtable_pass_t) {
-                .copyfunc = copy,
-                .pass     = copied
-            }),
-            lambda void(hashtable_entry_t *entry, hashtable_pass_t *pass)
-                => hashtable_insert(pass->pass, entry->key, pass->copyfunc(entry->value));
-        );
+    pthread_rwlock_rdlock(&hashtable->lock);
+    hashtable_t *copied = hashtable_create(hashtable_elements(hashtable) * 4 / 3);
+
+    /* Old slots hold what was inserted first */
+    const hashtable_array_t *arrays[] = { &hashtable->old, &hashtable->table };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++) {
+        const hashtable_array_t *array = arrays[i];
+        if (!array->size)
+            continue;
+
+        size_t first = hashtable_first(array);
+        for (size_t j = 0; j < array->size; j++) {
+            size_t index = (first + j) & (array->size - 1);
+            if (array->control[index] == HASHTABLE_EMPTY)
+                continue;
+
+            hashtable_slot_t *slot = &array->slots[index];
+            hashtable_insert(copied, hashtable_slot_key(slot), copy(slot->value));
+        }
     }
-    pthread_mutex_unlock(&hashtable->mutex);
+    pthread_rwlock_unlock(&hashtable->lock);
     return copied;
 }
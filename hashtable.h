@@ -23,6 +23,18 @@ hashtable_t *hashtable_copy_impl(hashtable_t *hashtable, void *(*copy)(void *));
 
 size_t hashtable_elements(hashtable_t *hashtable);
 
+typedef struct {
+    size_t elements;
+    size_t size;      /* slots                                        */
+    double load;      /* elements per slot                            */
+    double probemean; /* slots looked at to find an element           */
+    size_t probemax;
+    size_t resizes;
+    bool   resizing;  /* elements still being moved to a larger table */
+} hashtable_stats_t;
+
+void hashtable_stats(hashtable_t *hashtable, hashtable_stats_t *stats);
+
 #define hashtable_foreach_3(HASHTABLE, PASS, CALLBACK) \
     hashtable_foreach_impl((HASHTABLE), (void *)(PASS), (void *)(CALLBACK), false)
 #define hashtable_foreach_2(HASHTABLE, CALLBACK) \
@@ -411,8 +411,10 @@ void http_process(http_t *http) {
     http_client_accept(http);
 
     list_foreach(http->clients, http,
-        lambda void(http_client_t *client, http_t *http)
-            => http_client_process(http, client->sock);
+        lambda void(http_client_t *client, http_t *http) {
+            http_client_process(http, client->sock);
+            sock_flush(client->sock);
+        }
     );
 
     list_foreach(http->clients, http,
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "intern.h"
+#include "probe.h"
+
+/*
+ * Every distinct string is stored once behind a small header holding its
+ * hash and the amount of references to it, the pool is a probe table of
+ * those.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t references;
+    char     string[];
+} intern_entry_t;
+
+struct intern_s {
+    probe_t table;
+};
+
+static intern_entry_t *intern_entry(const char *string) {
+    return (intern_entry_t *)(string - offsetof(intern_entry_t, string));
+}
+
+/* FNV-1a */
+uint32_t intern_hash(const char *string) {
+    uint32_t hash = 2166136261u;
+    while (*string)
+        hash = (hash ^ (unsigned char)*string++) * 16777619u;
+    return hash;
+}
+
+intern_t *intern_create(void) {
+    intern_t *intern = malloc(sizeof(*intern));
+    probe_init(&intern->table, sizeof(probe_slot_t));
+    return intern;
+}
+
+void intern_destroy(intern_t *intern) {
+    if (!intern)
+        return;
+    for (size_t i = 0; i < intern->table.size; i++)
+        free(probe_at(&intern->table, i)->entry);
+    probe_release(&intern->table);
+    free(intern);
+}
+
+static bool intern_match(const void *entry, const void *string) {
+    return !strcmp(((const intern_entry_t *)entry)->string, string);
+}
+
+static bool intern_same(const void *entry, const void *find) {
+    return entry == find;
+}
+
+const char *intern_get(intern_t *intern, const char *string) {
+    uint32_t      hash = intern_hash(string);
+    probe_slot_t *slot = probe_claim(&intern->table, hash, &intern_match, string);
+
+    if (slot->entry) {
+        intern_entry_t *find = slot->entry;
+        find->references++;
+        return find->string;
+    }
+
+    size_t          length = strlen(string) + 1;
+    intern_entry_t *entry  = malloc(sizeof(*entry) + length);
+    entry->hash       = hash;
+    entry->references = 1;
+    memcpy(entry->string, string, length);
+
+    slot->entry = entry;
+    return entry->string;
+}
+
+void intern_put(intern_t *intern, const char *string) {
+    if (!string)
+        return;
+
+    intern_entry_t *entry = intern_entry(string);
+    if (--entry->references)
+        return;
+
+    probe_vacate(&intern->table, probe_find(&intern->table, entry->hash, &intern_same, entry));
+    free(entry);
+}
+
+size_t intern_size(const intern_t *intern) {
+    return intern->table.count;
+}
@@ -0,0 +1,74 @@
+#ifndef REDROID_INTERN_HDR
+#define REDROID_INTERN_HDR
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct intern_s intern_t;
+
+/*
+ * Function: intern_create
+ *  Create a pool of interned strings. Equal strings taken from the pool
+ *  share one reference counted copy. A pool isn't thread safe, it belongs
+ *  to whoever owns the structures referencing its strings. The pool of an
+ *  instance is only used with the shard of the instance locked.
+ *
+ * Returns:
+ *  An empty pool
+ */
+intern_t *intern_create(void);
+
+/*
+ * Function: intern_destroy
+ *  Destroy a pool and every string still in it.
+ *
+ * Parameters:
+ *  intern  - The pool to destroy
+ */
+void intern_destroy(intern_t *intern);
+
+/*
+ * Function: intern_get
+ *  Take a reference to the interned copy of a string, the copy is made
+ *  the first time the string is seen.
+ *
+ * Parameters:
+ *  intern  - The pool
+ *  string  - The string to intern
+ *
+ * Returns:
+ *  The interned copy which stays valid until its last reference is put
+ *  back with <intern_put>.
+ */
+const char *intern_get(intern_t *intern, const char *string);
+
+/*
+ * Function: intern_put
+ *  Give back a reference taken with <intern_get>, the copy is freed with
+ *  its last reference.
+ *
+ * Parameters:
+ *  intern  - The pool
+ *  string  - The interned string, NULL is ignored
+ */
+void intern_put(intern_t *intern, const char *string);
+
+/*
+ * Function: intern_hash
+ *  The hash the pool uses, exposed so tables keyed by interned strings
+ *  can store it alongside them.
+ *
+ * Parameters:
+ *  string  - The string to hash
+ */
+uint32_t intern_hash(const char *string);
+
+/*
+ * Function: intern_size
+ *  Get the amount of distinct strings in the pool.
+ *
+ * Parameters:
+ *  intern  - The pool
+ */
+size_t intern_size(const intern_t *intern);
+
+#endif
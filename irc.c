@@ -1,7 +1,15 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <inttypes.h>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
 
 #include "irc.h"
 #include "command.h"
@@ -16,7 +24,7 @@ static const char *irc_target_host(const char *target);
 
 /* Raw communication protocol */
 typedef int (*irc_func_standard_t)(irc_t *, const char *);
-typedef int (*irc_func_extended_t)(irc_t *, const char *, const char *);
+typedef int (*irc_func_extended_t)(irc_t *, const char *, const char *, size_t);
 
 typedef struct {
     const size_t        baselen; /* Base amount of bytes to represent an empty func */
@@ -44,18 +52,18 @@ int irc_quit_raw(irc_t *irc, const char *message) {
     return sock_sendf(irc->sock, "QUIT :%s\r\n", message);
 }
 
-int irc_write_raw(irc_t *irc, const char *target, const char *message) {
-    return sock_sendf(irc->sock, "PRIVMSG %s :%s\r\n", target, message);
+int irc_write_raw(irc_t *irc, const char *target, const char *message, size_t length) {
+    return sock_sendf(irc->sock, "PRIVMSG %s :%.*s\r\n", target, (int)length, message);
 }
 
-int irc_action_raw(irc_t *irc, const char *target, const char *action) {
-    return sock_sendf(irc->sock, "PRIVMSG %s :\001ACTION %s\001\r\n", target, action);
+int irc_action_raw(irc_t *irc, const char *target, const char *action, size_t length) {
+    return sock_sendf(irc->sock, "PRIVMSG %s :\001ACTION %.*s\001\r\n", target, (int)length, action);
 }
 
 static const irc_command_func_t irc_commands[] = {
-    [IRC_COMMAND_JOIN]   = { 0,  &irc_join_raw, NULL            },
-    [IRC_COMMAND_PART]   = { 0,  &irc_part_raw, NULL            },
-    [IRC_COMMAND_QUIT]   = { 0,  &irc_quit_raw, NULL            },
+    [IRC_COMMAND_JOIN]   = { 7,  &irc_join_raw, NULL            },
+    [IRC_COMMAND_PART]   = { 7,  &irc_part_raw, NULL            },
+    [IRC_COMMAND_QUIT]   = { 8,  &irc_quit_raw, NULL            },
     [IRC_COMMAND_WRITE]  = { 12, NULL,          &irc_write_raw  },
     [IRC_COMMAND_ACTION] = { 22, NULL,          &irc_action_raw }
 };
@@ -67,160 +75,538 @@ static const char *irc_colors[] = {
     "BLUE",     "MAGENTA", "DARKGRAY", "LIGHTGRAY"
 };
 
-static size_t irc_color_lookup(const char *color) {
+static const struct {
+    const char *tag;
+    char        code;
+} irc_markups[] = {
+    { "B",      '\x02' }, { "/B", '\x02' },
+    { "U",      '\x1F' }, { "/U", '\x1F' },
+    { "I",      '\x16' }, { "/I", '\x16' },
+    { "/COLOR", '\x0F' }
+};
+
+static size_t irc_color_lookup(const char *color, size_t length) {
     for (size_t i = 0; i < sizeof(irc_colors)/sizeof(*irc_colors); i++)
-        if (!strcmp(irc_colors[i], color))
+        if (!strncmp(irc_colors[i], color, length) && !irc_colors[i][length])
             return i;
     return 15;
 }
 
-static string_t *irc_color_parse_code(const char *source) {
-    const char *p1     = NULL;
-    const char *p2     = NULL;
-    const char *cur    = source;
-    string_t   *string = string_construct();
-
-    while ((p1 = strchr(cur, '['))) {
-        const char *replaced = NULL;
-        /* Suitable tag found */
-        if (p1[1] != '\0' && (p2 = strchr(p1, ']')) && (p2 - p1) > 1 && (p2 - p1) < 31) {
-            /* Extract the tag */
-            size_t taglen = p2 - p1 - 1;
-            char tagdata[32];
-            memcpy(tagdata, p1 + 1, taglen);
-            tagdata[taglen] = '\0';
-            /* Termination */
-            if (!strcmp(tagdata, "/COLOR"))
-                replaced = "\x0F";
-            else if (strstr(tagdata, "COLOR=") == tagdata) {
-                /* Parse the color line */
-                int fgc;
-                int bgc = -2;
-                /* Background color */
-                char *find = strchr(tagdata + 6, '/');
-                if (find) {
-                    *find++ = '\0';
-                    bgc = irc_color_lookup(find);
-                }
-                /* Foreground color */
-                fgc = irc_color_lookup(tagdata + 6);
-                if (fgc != -1 && bgc == -2) {
-                    snprintf(tagdata, sizeof(tagdata), "\x03%02d", fgc);
-                    replaced = tagdata;
-                } else if (fgc != -1 && bgc >= 0) {
-                    snprintf(tagdata, sizeof(tagdata), "\x03%02d,%02d", fgc, bgc);
-                    replaced = tagdata;
-                }
-            }
-            /* Deal with the other tags */
-            else if (!strcmp(tagdata, "B") || !strcmp(tagdata, "/B")) replaced = "\x02";
-            else if (!strcmp(tagdata, "U") || !strcmp(tagdata, "/U")) replaced = "\x1F";
-            else if (!strcmp(tagdata, "I") || !strcmp(tagdata, "/I")) replaced = "\x16";
+/* Control codes for the tag between the brackets, zero if it isn't one */
+static size_t irc_markup_code(const char *tag, size_t length, char *code) {
+    for (size_t i = 0; i < sizeof(irc_markups)/sizeof(*irc_markups); i++) {
+        if (!strncmp(irc_markups[i].tag, tag, length) && !irc_markups[i].tag[length]) {
+            *code = irc_markups[i].code;
+            return 1;
         }
-        if (replaced) {
-            string_catf(string, "%.*s%s", (int)(p1 - cur), cur, replaced);
-            cur = p2 + 1;
+    }
+
+    if (length < 6 || strncmp(tag, "COLOR=", 6))
+        return 0;
+
+    /* Foreground color and an optional background color */
+    const char *fg   = tag + 6;
+    const char *bg   = memchr(fg, '/', length - 6);
+    size_t      fgc  = irc_color_lookup(fg, (bg ? bg : tag + length) - fg);
+
+    if (!bg)
+        return sprintf(code, "\x03%02zu", fgc);
+
+    bg++;
+    return sprintf(code, "\x03%02zu,%02zu", fgc, irc_color_lookup(bg, tag + length - bg));
+}
+
+/*
+ * Translate markup tags to control codes in place, returning the length of
+ * the result. Every code is shorter than the tag it replaces so the string
+ * never grows.
+ */
+static size_t irc_markup(char *string) {
+    const char *read  = string;
+    char       *write = string;
+
+    while (*read) {
+        const char *close;
+        char        code[16];
+        size_t      length;
+
+        if (*read == '[' && (close = strchr(read + 1, ']'))
+                         && (close - read) > 1 && (close - read) < 31
+                         && (length = irc_markup_code(read + 1, close - read - 1, code))) {
+            memcpy(write, code, length);
+            write += length;
+            read   = close + 1;
+        } else if (*read == '\r' || (*read == '\n' && (write == string || write[-1] == '\n'))) {
+            /* Lines are split at newlines, empty ones are dropped */
+            read++;
         } else {
-            if (!p2) p2 = cur + strlen(cur);
-            string_catf(string, "%.*s", (int)(p2 - cur + 1), cur);
-            cur = p2 + 1;
+            *write++ = *read++;
+        }
+    }
+
+    *write = '\0';
+    return write - string;
+}
+
+/* Bytes taken by the color escape at the start of string */
+static size_t irc_color_escape(const char *string) {
+    size_t length = 1;
+    while (length < 3 && isdigit(string[length]))
+        length++;
+
+    if (length > 1 && string[length] == ',' && isdigit(string[length + 1])) {
+        length += 2;
+        if (isdigit(string[length]))
+            length++;
+    }
+    return length;
+}
+
+/*
+ * Longest prefix of at most budget bytes which doesn't end inside of a
+ * UTF-8 sequence or a color escape.
+ */
+static size_t irc_split(const char *string, size_t length, size_t budget) {
+    if (length <= budget)
+        return length;
+
+    size_t split = budget;
+    while (split && ((unsigned char)string[split] & 0xC0) == 0x80)
+        split--;
+
+    /* Color escapes are at most six bytes */
+    for (size_t i = (split > 5) ? split - 5 : 0; i < split; i++) {
+        if (string[i] == '\x03' && i + irc_color_escape(&string[i]) > split) {
+            split = i;
+            break;
         }
     }
-    string_catf(string, "%s", cur);
-    return string;
+
+    return split ? split : budget;
 }
 
-/* Buffered protocol */
+/*
+ * Buffered protocol. Entries are a single allocation with the target and
+ * the payload stored after them.
+ */
 typedef struct {
-    string_t     *target;
-    string_t     *payload;
+    char         *target;
+    size_t        targetlen;
+    char         *payload;
+    size_t        length;  /* of the payload */
+    size_t        offset;  /* payload already sent */
     irc_command_t command;
+    char          data[];
 } irc_queued_t;
 
-static void irc_enqueue_standard(irc_t *irc, const char *target, irc_command_t command) {
-    irc_queued_t *entry = malloc(sizeof(*entry));
+/* Every target has a lane of lines queued for it in each priority class */
+typedef struct {
+    char     *target;
+    vector_t *queue;   /* vector<irc_queued_t> */
+    size_t    deficit; /* bytes the lane may still send this round */
+} irc_lane_t;
+
+/* Flood control */
+static uint64_t irc_flood_cost(irc_flood_t *flood, size_t bytes) {
+    uint64_t cost = flood->rate;
+    if (flood->penalty)
+        cost += flood->rate * bytes / flood->penalty;
+    return cost;
+}
+
+/*
+ * Milliseconds until a line of bytes can be sent. A full bucket always
+ * lets a line through, even one which costs more than the whole bucket.
+ */
+static uint64_t irc_flood_wait(irc_flood_t *flood, uint64_t now, size_t bytes) {
+    if (flood->full <= now)
+        return 0;
 
-    entry->target  = string_create(target);
-    entry->payload = NULL;
-    entry->command = command;
+    uint64_t after = flood->full + irc_flood_cost(flood, bytes);
+    uint64_t limit = now + flood->burst * flood->rate;
+    return (after > limit) ? after - limit : 0;
+}
 
-    list_push(irc->queue, entry);
+static void irc_flood_take(irc_flood_t *flood, uint64_t now, size_t bytes) {
+    flood->full = ((flood->full > now) ? flood->full : now) + irc_flood_cost(flood, bytes);
 }
 
-static void irc_enqueue_extended(irc_t *irc, const char *target, string_t *payload, irc_command_t command) {
-    irc_queued_t *entry    = malloc(sizeof(*entry));
-    const char   *contents = string_contents(payload);
+/*
+ * Arm the flush timer of the instance for once the bucket allows sending
+ * again. The timer lives on the wheel of the event loop owning the
+ * instance, which is woken in case this is called from a command thread.
+ */
+static void irc_flush(irc_t *irc, uint64_t delay) {
+    if (!irc->flush)
+        return;
 
-    string_reassociate(payload, irc_color_parse_code(contents));
+    wheel_timer_schedule(irc->flush, delay);
+    irc_shard_wake(irc->shard);
+}
 
-    entry->target  = string_create(target);
-    entry->payload = payload;
-    entry->command = command;
+static irc_queued_t *irc_queued_create(const char *target, size_t length, irc_command_t command) {
+    size_t        targetlen = strlen(target);
+    irc_queued_t *entry     = malloc(sizeof(*entry) + targetlen + 1 + length + 1);
+
+    entry->target    = memcpy(entry->data, target, targetlen + 1);
+    entry->targetlen = targetlen;
+    entry->payload   = length ? entry->data + targetlen + 1 : NULL;
+    entry->length    = length;
+    entry->offset    = 0;
+    entry->command   = command;
+    return entry;
+}
 
-    list_push(irc->queue, entry);
+static void irc_queued_destroy(irc_queued_t *entry) {
+    free(entry);
 }
 
-void irc_unqueue(irc_t *irc) {
+/*
+ * Payload which goes in the line starting at offset. What the server puts
+ * in front when relaying the line has to fit in the 512 byte limit as
+ * well and newlines in the payload end the line.
+ */
+static size_t irc_queued_chunk(irc_t *irc, irc_queued_t *entry, size_t offset) {
+    const irc_command_func_t *func    = &irc_commands[entry->command];
+    const char               *payload = entry->payload + offset;
+    size_t                    budget  = 512 - (func->baselen + entry->targetlen + irc->prefixlen);
+    size_t                    length  = entry->length - offset;
+
+    const char *newline = memchr(payload, '\n', (length > budget) ? budget + 1 : length);
+    if (newline)
+        length = newline - payload;
+
+    return irc_split(payload, length, budget);
+}
+
+/* Move past a sent chunk and the newline ending it, true once all is sent */
+static bool irc_queued_advance(irc_queued_t *entry, size_t chunk) {
+    entry->offset += chunk;
+    while (entry->offset < entry->length && entry->payload[entry->offset] == '\n')
+        entry->offset++;
+    return entry->offset >= entry->length;
+}
+
+/*
+ * What an entry puts on the wire next: a single line or, with
+ * draft/multiline, as much of the rest of a long payload as the server
+ * takes in one batch. Tags and the BATCH lines themselves aren't counted.
+ */
+typedef struct {
+    size_t bytes; /* on the wire                          */
+    size_t chunk; /* payload in a single line             */
+    size_t lines; /* lines in a batch, 0 if it isn't one  */
+} irc_line_t;
+
+static void irc_queued_line(irc_t *irc, irc_queued_t *entry, irc_line_t *line) {
+    const irc_command_func_t *func = &irc_commands[entry->command];
+
+    line->chunk = entry->payload ? irc_queued_chunk(irc, entry, entry->offset) : 0;
+    line->bytes = func->baselen + entry->targetlen + line->chunk;
+    line->lines = 0;
+
+    if (!(irc->caps & IRC_CAP_MULTILINE) || entry->command != IRC_COMMAND_WRITE)
+        return;
+    if (!entry->payload || entry->offset + line->chunk >= entry->length)
+        return;
+
+    size_t offset  = entry->offset;
+    size_t content = 0;
+    size_t bytes   = 0;
+    size_t lines   = 0;
+    while (offset < entry->length && lines < irc->multilines) {
+        size_t chunk = irc_queued_chunk(irc, entry, offset);
+        if (content + chunk > irc->multibytes)
+            break;
+
+        content += chunk;
+        bytes   += func->baselen + entry->targetlen + chunk;
+        lines++;
+
+        for (offset += chunk; offset < entry->length && entry->payload[offset] == '\n'; offset++)
+            ;
+    }
+
+    if (lines > 1) {
+        line->bytes = bytes;
+        line->lines = lines;
+    }
+}
+
+static irc_lane_t *irc_lane_create(const char *target) {
+    irc_lane_t *lane = malloc(sizeof(*lane));
+    lane->target  = strdup(target);
+    lane->queue   = vector_create();
+    lane->deficit = 0;
+    return lane;
+}
+
+static void irc_lane_destroy(irc_lane_t *lane) {
     irc_queued_t *entry;
-    size_t        events = 0;
+    while ((entry = vector_shift(lane->queue)))
+        irc_queued_destroy(entry);
+    vector_destroy(lane->queue);
+    free(lane->target);
+    free(lane);
+}
+
+/*
+ * Identical single lines queued for other targets of the class are sent
+ * along in the same PRIVMSG, as many targets as TARGMAX allows. Joins are
+ * packed into one JOIN the same way.
+ */
+typedef struct {
+    irc_t        *irc;
+    irc_queued_t *entry;
+    irc_lane_t   *lanes[IRC_TARGETS_MAX];
+    size_t        count;
+    size_t        limit; /* targets in one line */
+    size_t        room;  /* bytes left in the line for more targets */
+} irc_coalesce_t;
+
+static size_t irc_queued_coalesce(irc_t *irc, irc_queue_t *queue, irc_queued_t *entry, irc_line_t *line, char *targets) {
+    irc_coalesce_t coalesce = {
+        .irc   = irc,
+        .entry = entry,
+        .count = 0,
+        .limit = (entry->command == IRC_COMMAND_JOIN) ? irc->joinmax : irc->targmax,
+        .room  = 512 - line->bytes
+    };
+
+    vector_foreach(queue->active, &coalesce,
+        lambda void(irc_lane_t *lane, irc_coalesce_t *coalesce) {
+            irc_queued_t *entry = coalesce->entry;
+            irc_queued_t *head  = vector_at(lane->queue, 0);
+
+            if (coalesce->count + 1 >= coalesce->limit || coalesce->count == IRC_TARGETS_MAX)
+                return;
+            if (head->command != entry->command || head->offset || head->length != entry->length)
+                return;
+            if (head->targetlen + 1 > coalesce->room)
+                return;
+            /* The relayed line has to fit for every target on its own */
+            if (entry->payload && (memcmp(head->payload, entry->payload, entry->length)
+                               || irc_queued_chunk(coalesce->irc, head, 0) != head->length))
+                return;
+
+            coalesce->lanes[coalesce->count++] = lane;
+            coalesce->room -= head->targetlen + 1;
+        }
+    );
+
+    char *write = targets + sprintf(targets, "%s", entry->target);
+    for (size_t i = 0; i < coalesce.count; i++) {
+        irc_lane_t   *lane = coalesce.lanes[i];
+        irc_queued_t *head = vector_shift(lane->queue);
+
+        write += sprintf(write, ",%s", head->target);
+        line->bytes += head->targetlen + 1;
+        irc_queued_destroy(head);
+
+        if (!vector_length(lane->queue)) {
+            vector_erase(queue->active, lane);
+            hashtable_remove(queue->lanes, lane->target);
+            irc_lane_destroy(lane);
+        }
+    }
+    return coalesce.count;
+}
+
+/* draft/multiline: the lines of a batch are joined back together by the client */
+static void irc_queued_batch(irc_t *irc, irc_queued_t *entry, irc_line_t *line) {
+    size_t batch = ++irc->batches;
+
+    sock_sendf(irc->sock, "BATCH +%zx draft/multiline %s\r\n", batch, entry->target);
+    for (size_t i = 0; i < line->lines; i++) {
+        size_t      chunk  = irc_queued_chunk(irc, entry, entry->offset);
+        const char *concat = (i && entry->payload[entry->offset - 1] != '\n') ? ";draft/multiline-concat" : "";
+
+        sock_sendf(irc->sock, "@batch=%zx%s PRIVMSG %s :%.*s\r\n",
+            batch, concat, entry->target, (int)chunk, entry->payload + entry->offset);
+        irc_queued_advance(entry, chunk);
+    }
+    sock_sendf(irc->sock, "BATCH -%zx\r\n", batch);
+}
+
+/*
+ * Send what irc_queued_line worked out for an entry, true once all of it
+ * is sent. The bytes of the line are updated for targets sent along. Lines
+ * are formatted straight into the output buffer of the socket.
+ */
+static bool irc_queued_send(irc_t *irc, irc_queue_t *queue, irc_queued_t *entry, irc_line_t *line) {
+    const irc_command_func_t *func = &irc_commands[entry->command];
+
+    char targets[512];
+
+    /* Otherwise we do a standard call */
+    if (!entry->payload) {
+        if (entry->command == IRC_COMMAND_JOIN && irc->joinmax > 1
+                                               && irc_queued_coalesce(irc, queue, entry, line, targets))
+            func->standard(irc, targets);
+        else
+            func->standard(irc, entry->target);
+        return true;
+    }
+
+    if (line->lines) {
+        irc_queued_batch(irc, entry, line);
+        return entry->offset >= entry->length;
+    }
+
+    /* If there is a payload we use the extended call */
+    if (!entry->offset && line->chunk == entry->length && irc->targmax > 1
+                       && irc_queued_coalesce(irc, queue, entry, line, targets))
+        func->extended(irc, targets, entry->payload, line->chunk);
+    else
+        func->extended(irc, entry->target, entry->payload + entry->offset, line->chunk);
 
-    /* Only when enough time has passed */
-    if (difftime(time(NULL), irc->lastunqueue) <= IRC_FLOOD_INTERVAL) {
-        irc_manager_wake(irc->manager);
+    return irc_queued_advance(entry, line->chunk);
+}
+
+/*
+ * Protocol commands come first, then anything said on behalf of a user and
+ * lastly the output of interval modules which nobody is waiting on.
+ */
+static irc_priority_t irc_priority(irc_command_t command) {
+    if (command == IRC_COMMAND_JOIN || command == IRC_COMMAND_PART || command == IRC_COMMAND_QUIT)
+        return IRC_PRIORITY_CONTROL;
+
+    module_t *module = module_singleton_get();
+    return (module && module->interval) ? IRC_PRIORITY_BACKGROUND : IRC_PRIORITY_INTERACTIVE;
+}
+
+static void irc_enqueue(irc_t *irc, irc_queued_t *entry) {
+    irc_queue_t *queue = &irc->queue[irc_priority(entry->command)];
+
+    pthread_mutex_lock(&irc->queuelock);
+    irc_lane_t *lane = hashtable_find(queue->lanes, entry->target);
+    if (!lane) {
+        lane = irc_lane_create(entry->target);
+        hashtable_insert(queue->lanes, lane->target, lane);
+        vector_push(queue->active, lane);
+    }
+    vector_push(lane->queue, entry);
+    uint64_t delay = irc_flood_wait(&irc->flood, wheel_now(), 0);
+    pthread_mutex_unlock(&irc->queuelock);
+
+    irc_flush(irc, delay);
+}
+
+static void irc_enqueue_standard(irc_t *irc, const char *target, irc_command_t command) {
+    irc_enqueue(irc, irc_queued_create(target, 0, command));
+}
+
+/*
+ * Formats the payload straight into the entry and translates its markup in
+ * place. Lines which fit the stack buffer are formatted only once.
+ */
+static void irc_enqueue_extended(irc_t *irc, const char *target, irc_command_t command, const char *fmt, va_list ap) {
+    char    buffer[512];
+    va_list va;
+
+    va_copy(va, ap);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, va);
+    va_end(va);
+
+    if (length <= 0)
         return;
+
+    irc_queued_t *entry = irc_queued_create(target, length, command);
+    if ((size_t)length < sizeof(buffer)) {
+        memcpy(entry->payload, buffer, length + 1);
+    } else {
+        va_copy(va, ap);
+        vsnprintf(entry->payload, length + 1, fmt, va);
+        va_end(va);
     }
 
-    while (events != IRC_FLOOD_LINES && (entry = list_shift(irc->queue))) {
-        const size_t              targetlen = string_length(entry->target);
-        const char               *target    = string_contents(entry->target);
-        const irc_command_func_t *func      = &irc_commands[entry->command];
-
-        /* If there is a payload we use the extended call */
-        if (entry->payload) {
-            size_t      payloadlen = string_length(entry->payload);
-            const char *payload    = string_contents(entry->payload);
-            size_t      corelen    = func->baselen + targetlen + 63; /* 63 is MAX_HOST_LENGTH */
-
-            /* Split payload for 512 byte IRC line limit */
-            while (corelen + payloadlen > 512) {
-                char truncate[512];
-                size_t size = sizeof(truncate) - corelen;
-                strncpy(truncate, payload, size);
-                truncate[size] = '\0';
-                func->extended(irc, target, truncate);
-                /* Flood protection */
-                if (++events == IRC_FLOOD_LINES) {
-                    /* Construct a new partial payload */
-                    char *move = string_move(entry->payload);
-                    entry->payload = string_create(move + (payload - move) + size);
-                    free(move);
-                    list_prepend(irc->queue, entry);
-                    break;
-                }
-                payloadlen -= size;
-                payload += size;
+    if (!(entry->length = irc_markup(entry->payload)))
+        return irc_queued_destroy(entry);
+
+    irc_enqueue(irc, entry);
+}
+
+/*
+ * Deficit round robin over the lanes of a class: every turn a lane is
+ * given a quantum of bytes to send, what it doesn't use carries over to
+ * its next turn. A long reply to one channel is interleaved with the
+ * replies to others instead of holding them back.
+ */
+static uint64_t irc_unqueue_class(irc_t *irc, irc_queue_t *queue, uint64_t now) {
+    irc_lane_t *lane;
+
+    while ((lane = vector_shift(queue->active))) {
+        irc_queued_t *entry = vector_shift(lane->queue);
+        irc_line_t    line;
+
+        irc_queued_line(irc, entry, &line);
+
+        /* Out of tokens before the lane had its turn */
+        uint64_t wait = irc_flood_wait(&irc->flood, now, line.bytes);
+        if (wait) {
+            vector_prepend(lane->queue, entry);
+            vector_prepend(queue->active, lane);
+            return wait;
+        }
+
+        lane->deficit += IRC_QUEUE_QUANTUM;
+        while (entry && line.bytes <= lane->deficit && !(wait = irc_flood_wait(&irc->flood, now, line.bytes))) {
+            bool sent = irc_queued_send(irc, queue, entry, &line);
+
+            irc_flood_take(&irc->flood, now, line.bytes);
+            lane->deficit -= (line.bytes < lane->deficit) ? line.bytes : lane->deficit;
+
+            if (sent) {
+                irc_queued_destroy(entry);
+                entry = vector_shift(lane->queue);
             }
-            func->extended(irc, target, payload);
-            events++;
-            string_destroy(entry->payload);
+            if (entry)
+                irc_queued_line(irc, entry, &line);
+        }
+
+        /* Lanes are only kept around for as long as they have lines */
+        if (!entry) {
+            hashtable_remove(queue->lanes, lane->target);
+            irc_lane_destroy(lane);
         } else {
-            /* Otherwise we do a standard call */
-            func->standard(irc, target);
-            events++;
+            vector_prepend(lane->queue, entry);
+            vector_push(queue->active, lane);
         }
-        string_destroy(entry->target);
-        free(entry);
-    }
 
-    /* Flood protection */
-    if (events == IRC_FLOOD_LINES) {
-        irc->lastunqueue = time(NULL);
-        irc_manager_wake(irc->manager);
+        if (wait)
+            return wait;
     }
+
+    return 0;
+}
+
+void irc_unqueue(irc_t *irc) {
+    uint64_t now  = wheel_now();
+    uint64_t wait = 0;
+
+    /* Lines wait for the connection and its handshake */
+    if (!irc->sock || irc->handshaking)
+        return;
+
+    /*
+     * Both the event loop owning the instance and its command channel
+     * unqueue, so the whole flush is serialized.
+     */
+    pthread_mutex_lock(&irc->queuelock);
+    for (size_t i = 0; !wait && i < IRC_PRIORITY_COUNT; i++)
+        wait = irc_unqueue_class(irc, &irc->queue[i], now);
+    pthread_mutex_unlock(&irc->queuelock);
+
+    /* Everything unqueued in this turn leaves in one write */
+    if (irc->sock)
+        sock_flush(irc->sock);
+
+    if (wait)
+        irc_flush(irc, wait);
 }
 
 static void irc_channel_destroy(irc_channel_t *channel);
-static void irc_user_destroy(irc_user_t *user);
+static void irc_channel_join(irc_t *irc, irc_channel_t *channel);
 static void irc_module_destroy(irc_module_t *module);
 static void irc_module_destroy(irc_module_t *module);
 static irc_module_t *irc_module_create(config_module_t *module);
@@ -229,8 +615,13 @@ void irc_quit(irc_t *irc, const char *message) {
     irc_enqueue_standard(irc, message, IRC_COMMAND_QUIT);
 }
 
+/*
+ * Joining and parting come from modules. The channels, their members and
+ * the strings they share are also changed by the event loop, the shard is
+ * locked to keep out of its way.
+ */
 void irc_join(irc_t *irc, const char *channel) {
-    irc_enqueue_standard(irc, channel, IRC_COMMAND_JOIN);
+    irc_shard_lock(irc->shard);
     /*
      * Note: casting away const is fine in this context, these objects
      * are copied from with irc_channels_add.
@@ -260,30 +651,51 @@ void irc_join(irc_t *irc, const char *channel) {
         hashtable_destroy(modules[i].kvs);
 
     hashtable_destroy(chan.modules);
+
+    /* Until syncronized the channel is joined along with all the others */
+    irc_channel_t *join = hashtable_find(irc->channels, channel);
+    if (join && irc->syncronized && !join->joining)
+        irc_channel_join(irc, join);
+
+    irc_shard_unlock(irc->shard);
 }
 
-void irc_part(irc_t *irc, const char *channel) {
+/*
+ * Forget a channel which was left, by parting or being kicked. Nobody may
+ * find it anymore before it's gone.
+ */
+static bool irc_channel_leave(irc_t *irc, const char *channel) {
     irc_channel_t *chan = hashtable_find(irc->channels, channel);
     if (!chan)
-        return;
+        return false;
+
+    if (chan->joined)
+        irc->joined--;
+    if (chan->joining)
+        irc->joining--;
+
+    /* The event loop mustn't dispatch a pending message to it either, it's queued once */
+    if (chan->dirty)
+        vector_erase(irc->dirty, chan);
 
-    irc_channel_destroy(chan);
     hashtable_remove(irc->channels, channel);
-    irc_enqueue_standard(irc, channel, IRC_COMMAND_PART);
+    irc_channel_destroy(chan);
+    return true;
+}
+
+void irc_part(irc_t *irc, const char *channel) {
+    irc_shard_lock(irc->shard);
+    if (irc_channel_leave(irc, channel))
+        irc_enqueue_standard(irc, channel, IRC_COMMAND_PART);
+    irc_shard_unlock(irc->shard);
 }
 
 void irc_actionv(irc_t *irc, const char *channel, const char *fmt, va_list ap) {
-    va_list va;
-    va_copy(va, ap);
-    irc_enqueue_extended(irc, channel, string_vformat(fmt, va), IRC_COMMAND_ACTION);
-    va_end(va);
+    irc_enqueue_extended(irc, channel, IRC_COMMAND_ACTION, fmt, ap);
 }
 
 void irc_writev(irc_t *irc, const char *channel, const char *fmt, va_list ap) {
-    va_list va;
-    va_copy(va, ap);
-    irc_enqueue_extended(irc, channel, string_vformat(fmt, va), IRC_COMMAND_WRITE);
-    va_end(va);
+    irc_enqueue_extended(irc, channel, IRC_COMMAND_WRITE, fmt, ap);
 }
 
 void irc_action(irc_t *irc, const char *channel, const char *fmt, ...) {
@@ -307,42 +719,81 @@ static void irc_message_destroy(irc_message_t *message) {
     free(message->content);
 }
 
-#define irc_message_change(MESSAGE, NICK, HOST, CONTENT) \
-    (((MESSAGE)->nick    = (NICK)),                      \
-     ((MESSAGE)->host    = (HOST)),                      \
-     ((MESSAGE)->content = (CONTENT)))
+#define irc_message_change(MESSAGE, NICK, HOST, CONTENT, TIME) \
+    (((MESSAGE)->nick    = (NICK)),                            \
+     ((MESSAGE)->host    = (HOST)),                            \
+     ((MESSAGE)->content = (CONTENT)),                         \
+     ((MESSAGE)->time    = (TIME)))
 
-static void irc_message_update(irc_message_t *message, const char *prefix, const char *content) {
+static void irc_message_update(irc_message_t *message, const char *prefix, const char *content, time_t time) {
     irc_message_destroy(message);
     irc_message_change(message, strdup(irc_target_nick(prefix)),
                                 strdup(irc_target_host(prefix)),
-                                strdup(content));
+                                strdup(content),
+                                time);
 }
 
 void irc_message_clear(irc_message_t *message) {
     irc_message_destroy(message);
-    irc_message_change(message, NULL, NULL, NULL);
+    irc_message_change(message, NULL, NULL, NULL, 0);
 }
 
 /* Channel management */
 static void irc_channel_destroy(irc_channel_t *channel) {
     free(channel->channel);
     free(channel->topic);
-    hashtable_foreach(channel->users, &irc_user_destroy);
-    hashtable_destroy(channel->users);
+    members_destroy(channel->users);
     hashtable_foreach(channel->modules, &irc_module_destroy);
     hashtable_destroy(channel->modules);
     irc_message_destroy(&channel->message);
     free(channel);
 }
 
+/*
+ * Joins go through the flood queue where they're packed into as few JOIN
+ * lines as the server allows. No more channels than CHANLIMIT are joined,
+ * only the channels joined are counted.
+ */
+static void irc_channel_join(irc_t *irc, irc_channel_t *channel) {
+    if (irc->joining == irc->chanlimit) {
+        printf("    irc      => channel limit of %zu reached, not joining %s\n", irc->chanlimit, channel->channel);
+        return;
+    }
+    channel->joining = true;
+    irc->joining++;
+    irc_enqueue_standard(irc, channel->channel, IRC_COMMAND_JOIN);
+}
+
 static void irc_channels_join(irc_t *irc) {
+    irc->joined    = 0;
+    irc->joining   = 0;
+    irc->joinstart = wheel_now();
+
     hashtable_foreach(irc->channels, irc,
-        lambda void(irc_channel_t *channel, irc_t *irc)
-            => irc_join_raw(irc, channel->channel);
+        lambda void(irc_channel_t *channel, irc_t *irc) {
+            channel->joined  = false;
+            channel->joining = false;
+            irc_channel_join(irc, channel);
+        }
     );
+
     irc->syncronized = true;
-    printf("    irc      => syncronized\n");
+    printf("    irc      => syncronized, joining %zu channels\n", irc->joining);
+}
+
+/* Joins are done once the server sent the names of the channel */
+static void irc_channels_joined(irc_t *irc, irc_channel_t *channel) {
+    if (channel->joined || !channel->joining)
+        return;
+
+    channel->joined = true;
+    irc->joined++;
+
+    size_t step = irc->joining / 10 ? irc->joining / 10 : 1;
+    if (irc->joined == irc->joining)
+        printf("    irc      => joined %zu channels in %" PRIu64 "ms\n", irc->joined, wheel_now() - irc->joinstart);
+    else if (irc->joined < irc->joining && irc->joined % step == 0)
+        printf("    irc      => joined %zu/%zu channels\n", irc->joined, irc->joining);
 }
 
 module_status_t irc_modules_add(irc_t *irc, const char *name);
@@ -355,13 +806,16 @@ bool irc_channels_add(irc_t *irc, config_channel_t *channel) {
 
     irc_channel_t *chan = malloc(sizeof(*chan));
 
-    chan->users    = hashtable_create(32);
+    chan->users    = members_create(irc->users);
     chan->channel  = strdup(channel->name);
     chan->topic    = NULL;
     chan->modules  = hashtable_create(32);
     chan->instance = irc;
+    chan->dirty    = false;
+    chan->joining  = false;
+    chan->joined   = false;
 
-    irc_message_change(&chan->message, NULL, NULL, NULL);
+    irc_message_change(&chan->message, NULL, NULL, NULL, 0);
 
     /* Deeply copy the config_channel_t modules hashtable and configuration
      * into an irc_channel_t + irc_module_t hashtable.
@@ -378,44 +832,75 @@ bool irc_channels_add(irc_t *irc, config_channel_t *channel) {
     return true;
 }
 
-/* User management */
-static void irc_user_destroy(irc_user_t *user) {
-    free(user->nick);
-    free(user->host);
-    free(user);
+/*
+ * User management. Members live in an open addressed table per channel
+ * pointing at one record per user in the registry of the instance, which
+ * also knows the channels of the user. Nicks and hosts are interned once
+ * for the instance.
+ */
+static void irc_user_account(users_t *users, user_t *user, const char *account) {
+    /* A star is used for not being logged in */
+    users_account(users, user, (account && strcmp(account, "*")) ? account : NULL);
 }
 
-static irc_user_t *irc_user_create(const char *nick, const char *host) {
-    irc_user_t *user = malloc(sizeof(*user));
-    user->nick = strdup(nick);
-    user->host = strdup(host);
-    return user;
+/* Channel prefixes are kept as bits, in the order of the PREFIX of the server */
+static uint8_t irc_user_modes(irc_t *irc, const char *prefixes, size_t length) {
+    uint8_t modes = 0;
+    for (size_t i = 0; i < length; i++)
+        modes |= 1 << (strchr(irc->prefixes, prefixes[i]) - irc->prefixes);
+    return modes;
 }
 
-void irc_users_insert(irc_t *irc, const char *channel, const char *prefix) {
-    irc_channel_t *chan = hashtable_find(irc->channels, channel);
-    if (!chan) return;
-
+static member_t *irc_users_insert(irc_channel_t *chan, const char *prefix) {
     const char *nick = irc_target_nick(prefix);
     const char *host = irc_target_host(prefix);
 
-    if (hashtable_find(chan->users, nick))
+    member_t *member = members_insert(chan->users, nick, host);
+    /* We may only now know the host */
+    if (*host)
+        users_host(chan->instance->users, member->user, host);
+    return member;
+}
+
+/*
+ * Lines we send are relayed with ":nick!user@host " in front. Until the
+ * server tells us our user@host it is taken to be as long as it may get
+ * (63 is MAX_HOST_LENGTH).
+ */
+static void irc_self_prefix(irc_t *irc) {
+    irc->prefixlen = strlen(irc->nick) + (irc->host ? strlen(irc->host) : 63) + 3;
+}
+
+static void irc_self_nick(irc_t *irc, const char *nick) {
+    free(irc->nick);
+    irc->nick = strdup(nick);
+    irc_self_prefix(irc);
+}
+
+static void irc_self_host(irc_t *irc, const char *host) {
+    if (!strchr(host, '@') || (irc->host && !strcmp(irc->host, host)))
         return;
+    free(irc->host);
+    irc->host = strdup(host);
+    irc_self_prefix(irc);
+}
+
+static bool irc_self(irc_t *irc, const char *prefix) {
+    return !strcasecmp(irc_target_nick(prefix), irc->nick);
+}
 
-    hashtable_insert(chan->users, nick, irc_user_create(nick, host));
+/* Apply a change to a user, which every channel they share with us sees */
+static void irc_users_update(irc_t *irc, const char *prefix, const char *value, void (*update)(users_t *users, user_t *user, const char *value)) {
+    user_t *user = users_find(irc->users, irc_target_nick(prefix));
+    if (user)
+        update(irc->users, user, value);
 }
 
-void irc_users_remove(irc_t *irc, const char *channel, const char *prefix) {
+static void irc_users_remove(irc_t *irc, const char *channel, const char *nick) {
     irc_channel_t *chan = hashtable_find(irc->channels, channel);
     if (!chan) return;
 
-    const char *nick = irc_target_nick(prefix);
-    irc_user_t *user = hashtable_find(chan->users, nick);
-    if (!user)
-        return;
-
-    irc_user_destroy(user);
-    hashtable_remove(chan->users, nick);
+    members_remove(chan->users, nick);
 }
 
 /* Instance management */
@@ -424,39 +909,97 @@ irc_t *irc_create(config_instance_t *instance) {
 
     irc->name         = strdup(instance->name);
     irc->nick         = strdup(instance->nick);
+    irc->host         = NULL;
     irc->pattern      = strdup(instance->pattern);
     irc->auth         = (instance->auth) ? strdup(instance->auth) : NULL;
+    irc->sasl         = (instance->sasl) ? strdup(instance->sasl) : NULL;
+    irc->account      = (instance->account) ? strdup(instance->account) : NULL;
+    irc->certificate  = (instance->certificate) ? strdup(instance->certificate) : NULL;
     irc->ready        = false;
     irc->syncronized  = false;
     irc->identified   = false;
+    irc->loggedin     = false;
+    irc->killed       = false;
+    irc->caps         = 0;
+    irc->capsoffered  = 0;
+    irc->targmax      = 1;
+    irc->joinmax      = 1;
+    irc->chanlimit    = SIZE_MAX;
+    strcpy(irc->prefixes, IRC_PREFIXES);
+    irc->joined       = 0;
+    irc->joining      = 0;
+    irc->joinstart    = 0;
+    irc->multibytes   = 0;
+    irc->multilines   = 0;
+    irc->batches      = 0;
+    irc->time         = 0;
     irc->channels     = hashtable_create(64);
-    irc->queue        = list_create();
+    irc->strings      = intern_create();
+    irc->users        = users_create(irc->strings);
+    irc->dirty        = vector_create();
+    for (size_t i = 0; i < IRC_PRIORITY_COUNT; i++) {
+        irc->queue[i].lanes  = hashtable_create(32);
+        irc->queue[i].active = vector_create();
+    }
     irc->database     = database_create(instance->database);
     irc->regexprcache = regexpr_cache_create();
     irc->moduleman    = module_manager_create(irc);
-    irc->lastunqueue  = 0;
-
-    irc->buffer.data[0]  = '\0';
-    irc->buffer.offset   = 0;
-
-    irc_message_change(&irc->message, NULL, NULL, NULL);
+    irc->manager      = NULL;
+    irc->shard        = NULL;
+    irc->flush        = NULL;
+    irc->sock         = NULL;
+    irc->connect      = NULL;
+    irc->resolving    = NULL;
+    irc->connecting   = NULL;
+    irc->connectstart = 0;
+    irc->handshaking  = 0;
+    irc->backoff      = IRC_RECONNECT_MIN;
+    irc->ssl          = false;
+    irc->flood.burst   = instance->floodburst   ? instance->floodburst   : IRC_FLOOD_BURST;
+    irc->flood.rate    = instance->floodrate    ? instance->floodrate    : IRC_FLOOD_RATE;
+    irc->flood.penalty = instance->floodpenalty ? instance->floodpenalty : IRC_FLOOD_PENALTY;
+    irc->flood.full    = 0;
+    irc->pinging      = NULL;
+    irc->dispatched   = 0;
+    irc->skipped      = 0;
+
+    pthread_mutex_init(&irc->queuelock, NULL);
+
+    memset(&irc->lag, 0, sizeof(irc->lag));
+    pthread_mutex_init(&irc->lag.lock, NULL);
+    irc->lag.interval  = (uint64_t)(instance->pinginterval ? instance->pinginterval : IRC_PING_INTERVAL) * 1000;
+    irc->lag.threshold = instance->pingmissed ? instance->pingmissed : IRC_PING_MISSED;
+
+    irc->buffer.length  = 0;
+    irc->buffer.discard = false;
+
+    irc_message_change(&irc->message, NULL, NULL, NULL, 0);
+    irc_self_prefix(irc);
 
     printf("instance: %s\n", irc->name);
     printf("    nick     => %s\n", irc->nick);
     printf("    pattern  => %s\n", irc->pattern);
     printf("    auth     => %s\n", irc->auth ? "(Yes)" : "(No)");
+    printf("    sasl     => %s\n", irc->sasl ? irc->sasl : "(No)");
     printf("    database => %s\n", instance->database);
     printf("    host     => %s\n", instance->host);
     printf("    port     => %s\n", instance->port);
     printf("    ssl      => %s\n", instance->ssl ? "(Yes)" : "(No)");
+    printf("    flood    => %" PRIu64 " lines, one per %" PRIu64 "ms\n", irc->flood.burst, irc->flood.rate);
+    printf("    ping     => every %" PRIu64 "s, dead after %zu missed\n", irc->lag.interval / 1000, irc->lag.threshold);
 
     return irc;
 }
 
 void irc_destroy(irc_t *irc, sock_restart_t *restart, char **name) {
     irc_unqueue(irc);
+    wheel_timer_destroy(irc->flush);
+    wheel_timer_destroy(irc->connecting);
+    wheel_timer_destroy(irc->pinging);
+    dns_cancel(irc->resolving);
+    sock_connect_destroy(irc->connect);
 
-    if (irc->sock && !restart)
+    if (irc->sock && !irc->handshaking && !restart)
         irc_quit_raw(irc, "Shutting down");
 
     if (name)
@@ -467,9 +1010,22 @@ void irc_destroy(irc_t *irc, sock_restart_t *restart, char **name) {
     module_manager_destroy(irc->moduleman);
     hashtable_foreach(irc->channels, &irc_channel_destroy);
     hashtable_destroy(irc->channels);
-    list_destroy(irc->queue);
+    users_destroy(irc->users);
+    intern_destroy(irc->strings);
+    vector_destroy(irc->dirty);
+    for (size_t i = 0; i < IRC_PRIORITY_COUNT; i++) {
+        vector_foreach(irc->queue[i].active, &irc_lane_destroy);
+        vector_destroy(irc->queue[i].active);
+        hashtable_destroy(irc->queue[i].lanes);
+    }
+    pthread_mutex_destroy(&irc->queuelock);
+    pthread_mutex_destroy(&irc->lag.lock);
     free(irc->auth);
+    free(irc->sasl);
+    free(irc->account);
+    free(irc->certificate);
     free(irc->nick);
+    free(irc->host);
     free(irc->name);
     free(irc->pattern);
     sock_destroy(irc->sock, restart);
@@ -494,6 +1050,7 @@ module_status_t irc_modules_add(irc_t *irc, const char *name) {
 
     if ((module = module_open(string_contents(file), irc->moduleman, &error))) {
         printf("    module   => %s [%s] loaded\n", module->name, module->file);
+        irc_manager_schedule(irc, module);
         string_destroy(file);
         return MODULE_STATUS_SUCCESS;
     }
@@ -525,7 +1082,7 @@ static void irc_module_destroy(irc_module_t *module) {
 }
 
 static bool irc_modules_exists(irc_t *irc, const char *name) {
-    return list_search(irc->moduleman->modules, name,
+    return vector_search(irc->moduleman->modules, name,
         lambda bool(module_t *module, const char *name)
             => return !strcmp(module->name, name);
     );
@@ -544,6 +1101,7 @@ static size_t irc_modules_refs(irc_t *irc, const char *inmodule, const char *exc
         .exclude  = exclude,
         .inmodule = inmodule
     };
+    irc_shard_lock(irc->shard);
     hashtable_foreach(irc->channels, &ref,
         lambda void(irc_channel_t *channel, irc_module_ref_t *ref) {
             if (!strcmp(ref->exclude, channel->channel))
@@ -556,12 +1114,15 @@ static size_t irc_modules_refs(irc_t *irc, const char *inmodule, const char *exc
             );
         }
     );
+    irc_shard_unlock(irc->shard);
     return ref.count;
 }
 module_status_t irc_modules_reload(irc_t *irc, const char *name) {
     /* Reloading a module reloads it everywhere */
     if (!module_manager_reload(irc->moduleman, name))
         return MODULE_STATUS_FAILURE;
+    /* The interval may have changed */
+    irc_manager_schedule(irc, module_manager_search(irc->moduleman, name, MMSEARCH_NAME));
     return MODULE_STATUS_SUCCESS;
 }
 
@@ -574,21 +1135,31 @@ module_status_t irc_modules_unload(irc_t *irc, const char *channel, const char *
     return MODULE_STATUS_SUCCESS;
 }
 
+/*
+ * Channels are only freed with the shard locked, modules of a channel are
+ * changed and looked at with it locked as well.
+ */
 module_status_t irc_modules_disable(irc_t *irc, const char *chan, const char *name) {
+    irc_shard_lock(irc->shard);
     irc_channel_t *channel = hashtable_find(irc->channels, chan);
-    if (hashtable_find(channel->modules, name)) {
-        return hashtable_remove(channel->modules, name)
-                   ? MODULE_STATUS_SUCCESS
-                   : MODULE_STATUS_FAILURE;
+    if (channel && hashtable_find(channel->modules, name)) {
+        bool removed = hashtable_remove(channel->modules, name);
+        irc_shard_unlock(irc->shard);
+        return removed ? MODULE_STATUS_SUCCESS : MODULE_STATUS_FAILURE;
     }
+    irc_shard_unlock(irc->shard);
     if (irc_modules_exists(irc, name))
         return MODULE_STATUS_ALREADY;
     return MODULE_STATUS_NONEXIST;
 }
 
 module_status_t irc_modules_enable(irc_t *irc, const char *chan, const char *name) {
-    irc_channel_t *ch = hashtable_find(irc->channels, chan);
-    if (hashtable_find(ch->modules, name))
+    irc_shard_lock(irc->shard);
+    irc_channel_t *ch      = hashtable_find(irc->channels, chan);
+    bool           already = ch && hashtable_find(ch->modules, name);
+    irc_shard_unlock(irc->shard);
+
+    if (already)
         return MODULE_STATUS_ALREADY;
     if (!irc_modules_exists(irc, name))
         return MODULE_STATUS_NONEXIST;
@@ -600,6 +1171,16 @@ module_status_t irc_modules_enable(irc_t *irc, const char *chan, const char *nam
     list_t            *config   = config_load("config.ini");
     config_instance_t *instance = config_instance_find(config, irc->name);
     config_channel_t  *channel  = config_channel_find(instance, chan);
+
+    /* The channel may have been left or the module enabled meanwhile */
+    irc_shard_lock(irc->shard);
+    ch = hashtable_find(irc->channels, chan);
+    if (!ch || hashtable_find(ch->modules, name)) {
+        irc_shard_unlock(irc->shard);
+        config_unload(config);
+        return ch ? MODULE_STATUS_ALREADY : MODULE_STATUS_NONEXIST;
+    }
+
     if (channel) {
         /* Channel has module configuration */
         config_module_t *module = config_module_find(channel, name);
@@ -613,6 +1194,7 @@ module_status_t irc_modules_enable(irc_t *irc, const char *chan, const char *nam
         hashtable_insert(ch->modules, name, irc_module_create(&module));
         hashtable_destroy(module.kvs);
     }
+    irc_shard_unlock(irc->shard);
 
     config_unload(config);
     return MODULE_STATUS_SUCCESS;
@@ -624,7 +1206,7 @@ module_status_t irc_modules_enable(irc_t *irc, const char *chan, const char *nam
 list_t *irc_modules_loaded(irc_t *irc) {
     list_t *list = list_create();
 
-    list_foreach(irc->moduleman->modules, list,
+    vector_foreach(irc->moduleman->modules, list,
         lambda void(module_t *entry, list_t *list)
             => list_push(list, (char *)entry->name);
     );
@@ -635,15 +1217,20 @@ list_t *irc_modules_loaded(irc_t *irc) {
     return list;
 }
 
+/* Names of enabled modules are copies owned by the list, like irc_users */
 list_t *irc_modules_enabled(irc_t *irc, const char *chan) {
+    irc_shard_lock(irc->shard);
     irc_channel_t *channel = hashtable_find(irc->channels, chan);
-    if (!channel)
+    if (!channel) {
+        irc_shard_unlock(irc->shard);
         return NULL;
+    }
     list_t *list = list_create();
     hashtable_foreach(channel->modules, list,
         lambda void(irc_module_t *module, list_t *list)
-            => list_push(list, module->module);
+            => list_push(list, strdup(module->module));
     );
+    irc_shard_unlock(irc->shard);
     list_sort(list,
         lambda bool(const char *a, const char *b)
             => return strcmp(a, b) >= 0;
@@ -652,14 +1239,178 @@ list_t *irc_modules_enabled(irc_t *irc, const char *chan) {
 }
 
 /* Network management */
+/*
+ * Nothing is connected here, the network is resolved and its addresses
+ * raced by the event loop of the shard owning the instance.
+ */
 bool irc_connect(irc_t *irc, const char *host, const char *port, bool ssl) {
+    if (!(irc->connect = sock_connect_create(host, port)))
+        return false;
+    irc->ssl = ssl;
+    return true;
+}
+
+/* Once a connection attempt won the race */
+bool irc_connected(irc_t *irc) {
     sock_restart_t info = {
-        .ssl = ssl,
-        .fd  = -1
+        .ssl         = irc->ssl,
+        .fd          = -1,
+        .certificate = irc->certificate
     };
 
-    if (!(irc->sock = sock_create(host, port, &info)))
+    if (!(irc->sock = sock_connect_finish(irc->connect, &info)))
+        return false;
+
+    printf("    irc      => %s connected in %" PRIu64 "ms\n", irc->name, wheel_now() - irc->connectstart);
+    irc->connectstart = 0;
+    irc->handshaking  = wheel_now();
+    return true;
+}
+
+/*
+ * The handshake of a fresh connection is driven by the event loop as the
+ * socket becomes ready. Returns 1 once the connection can be used, 0 while
+ * it waits for the socket and -1 when it failed.
+ */
+int irc_handshake(irc_t *irc) {
+    int status = sock_handshake(irc->sock);
+    if (status != 1)
+        return status;
+
+    if (irc->ssl)
+        printf("    irc      => %s handshake in %" PRIu64 "ms\n", irc->name, wheel_now() - irc->handshaking);
+
+    irc->handshaking = 0;
+    return 1;
+}
+
+/*
+ * Drop the connection. Everything learned from the session is forgotten so
+ * the next connection registers and joins the channels again, lines still
+ * queued are sent once it's there.
+ */
+void irc_disconnect(irc_t *irc) {
+    sock_destroy(irc->sock, NULL);
+    irc->sock        = NULL;
+    irc->handshaking = 0;
+
+    irc->ready       = false;
+    irc->syncronized = false;
+    irc->identified  = false;
+    irc->loggedin    = false;
+    irc->killed      = false;
+    irc->caps        = 0;
+    irc->capsoffered = 0;
+    irc->targmax     = 1;
+    irc->joinmax     = 1;
+    irc->chanlimit   = SIZE_MAX;
+    strcpy(irc->prefixes, IRC_PREFIXES);
+    irc->joined      = 0;
+    irc->joining     = 0;
+    irc->multibytes  = 0;
+    irc->multilines  = 0;
+    irc->flood.full  = 0;
+
+    irc->buffer.length  = 0;
+    irc->buffer.discard = false;
+
+    free(irc->host);
+    irc->host = NULL;
+    irc_self_prefix(irc);
+
+    hashtable_foreach(irc->channels,
+        lambda void(irc_channel_t *channel) {
+            members_clear(channel->users);
+            channel->joining = false;
+            channel->joined  = false;
+        }
+    );
+
+    pthread_mutex_lock(&irc->lag.lock);
+    irc->lag.sent   = 0;
+    irc->lag.missed = 0;
+    pthread_mutex_unlock(&irc->lag.lock);
+}
+
+/* Lag measurement */
+static uint64_t irc_lag_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Values below 2 * IRC_LAG_SUB get a bucket each. Above that the top
+ * IRC_LAG_SUBBITS + 1 bits of a value select one of the IRC_LAG_SUB
+ * buckets of its power of two.
+ */
+static size_t irc_lag_bucket(uint64_t value) {
+    if (value >= (UINT64_C(1) << IRC_LAG_RANGE))
+        value = (UINT64_C(1) << IRC_LAG_RANGE) - 1;
+    if (value < 2 * IRC_LAG_SUB)
+        return value;
+
+    size_t shift = (63 - __builtin_clzll(value)) - IRC_LAG_SUBBITS;
+    return shift * IRC_LAG_SUB + (value >> shift);
+}
+
+/* The largest value which lands in a bucket */
+static uint64_t irc_lag_highest(size_t bucket) {
+    if (bucket < 2 * IRC_LAG_SUB)
+        return bucket;
+
+    size_t shift = bucket / IRC_LAG_SUB - 1;
+    return ((uint64_t)(bucket - shift * IRC_LAG_SUB + 1) << shift) - 1;
+}
+
+static uint64_t irc_lag_percentile(const irc_lag_t *lag, double percentile) {
+    if (!lag->samples)
+        return 0;
+
+    uint64_t rank  = (uint64_t)(percentile * lag->samples + 0.5);
+    uint64_t count = 0;
+    if (rank == 0)
+        rank = 1;
+
+    for (size_t i = 0; i < IRC_LAG_BUCKETS; i++) {
+        if ((count += lag->counts[i]) < rank)
+            continue;
+        uint64_t highest = irc_lag_highest(i);
+        return highest < lag->max ? highest : lag->max;
+    }
+    return lag->max;
+}
+
+static void irc_lag_record(irc_lag_t *lag, uint64_t rtt) {
+    lag->counts[irc_lag_bucket(rtt)]++;
+    lag->samples++;
+    lag->last = rtt;
+    if (rtt > lag->max)
+        lag->max = rtt;
+}
+
+/*
+ * Called every lag interval. The PING goes straight to the socket rather
+ * than through the flood queue so the round trip is that of the link
+ * alone. Returns false once too many probes went unanswered, the link is
+ * dead even though TCP may take a long time to notice.
+ */
+bool irc_ping(irc_t *irc) {
+    /* Servers don't answer PINGs before registration */
+    if (!irc->sock || irc->handshaking || !irc->ready)
+        return true;
+
+    uint64_t now = irc_lag_now();
+    pthread_mutex_lock(&irc->lag.lock);
+    if (irc->lag.sent && ++irc->lag.missed >= irc->lag.threshold) {
+        pthread_mutex_unlock(&irc->lag.lock);
         return false;
+    }
+    irc->lag.sent = now;
+    pthread_mutex_unlock(&irc->lag.lock);
+
+    sock_sendf(irc->sock, "PING :lag-%" PRIu64 "\r\n", now);
+    sock_flush(irc->sock);
     return true;
 }
 
@@ -668,12 +1419,19 @@ bool irc_reinstate(irc_t *irc, const char *host, const char *port, sock_restart_
         return false;
     irc->ready      = true;
     irc->identified = true;
+    irc->loggedin   = true;
+
+    /*
+     * Still on the channels from before the restart, the server ignores
+     * joins for those. Channels added to the configuration are joined.
+     */
+    irc_channels_join(irc);
     return true;
 }
 
 /* Parser */
 static const char *irc_target_nick(const char *target) {
-    static char buffer[128];
+    static _Thread_local char buffer[128];
 
     char *split = strstr(target, "!");
     size_t length = split ? (size_t)(split - target) : strlen(target);
@@ -686,53 +1444,960 @@ static const char *irc_target_nick(const char *target) {
 }
 
 static const char *irc_target_host(const char *target) {
-    static char buffer[128];
+    static _Thread_local char buffer[128];
     const char *split = strstr(target, "!");
-    if (!split)
-        split = target;
+    split = split ? split + 1 : target + strlen(target);
 
     size_t length = strlen(split);
     if (length > sizeof(buffer) - 1)
         length = sizeof(buffer) - 1;
 
-    memcpy(buffer, target, length);
+    memcpy(buffer, split, length);
     buffer[length] = '\0';
     return buffer;
 }
 
-static void irc_parse(irc_t *irc, void *data) {
-    char *params[11];
-    char *command = NULL;
-    char *prefix  = NULL;
-    char *parse   = irc->buffer.data;
-    char *end     = irc->buffer.data + irc->buffer.offset;
-    int   numeric = 0;
+/*
+ * Always modules only see channels with a new message and only when the
+ * channel has them enabled. Nothing is dispatched before the instance is
+ * syncronized, the message is dropped all the same.
+ */
+typedef struct {
+    cmd_channel_t *commander;
+    irc_channel_t *channel;
+} irc_dispatch_t;
+
+static void irc_channel_dispatch(irc_channel_t *channel, cmd_channel_t *commander) {
+    if (channel->instance->syncronized)
+        vector_foreach(channel->instance->moduleman->modules,
+            &((irc_dispatch_t) {
+                .commander = commander,
+                .channel   = channel
+            }),
+            lambda void(module_t *module, irc_dispatch_t *dispatch) {
+                if (*module->match != '\0' || module->interval != 0)
+                    return;
+                if (!hashtable_find(dispatch->channel->modules, module->name))
+                    return;
+
+                cmd_channel_push(dispatch->commander,
+                    cmd_entry_create(dispatch->commander, module, dispatch->channel->channel,
+                        dispatch->channel->message.nick, dispatch->channel->message.content));
+                dispatch->channel->instance->dispatched++;
+            }
+        );
 
-    /* <prefix> ::= <servername> | <nick> [ '!' <user> ] [ '@' <host> ] */
-    if (irc->buffer.data[0] == ':') {
-        while (*parse && *parse != ' ')
+    irc_message_clear(&channel->message);
+    channel->dirty = false;
+}
+
+static void irc_dispatch(irc_t *irc, cmd_channel_t *commander) {
+    size_t         dispatched = irc->dispatched;
+    size_t         always     = 0;
+    irc_channel_t *channel;
+
+    while ((channel = vector_shift(irc->dirty)))
+        if (channel->dirty)
+            irc_channel_dispatch(channel, commander);
+
+    irc_message_clear(&irc->message);
+
+    if (!irc->syncronized)
+        return;
+
+    /*
+     * Keep count of what dispatching every always module on every channel
+     * after each read would have cost.
+     */
+    vector_foreach(irc->moduleman->modules, &always,
+        lambda void(module_t *module, size_t *always) {
+            if (*module->match == '\0' && module->interval == 0)
+                (*always)++;
+        }
+    );
+
+    size_t visited = always * hashtable_elements(irc->channels);
+    size_t pushed  = irc->dispatched - dispatched;
+    if (visited > pushed)
+        irc->skipped += visited - pushed;
+}
+
+/*
+ * Protocol handlers. Every handler is registered for a command verb or a
+ * numeric along with the amount of parameters it needs, lines with fewer
+ * parameters than that never reach the handler.
+ */
+typedef void (*irc_handler_func_t)(irc_t *irc, void *data, const char *prefix, char **params);
+
+typedef struct {
+    size_t             params;
+    irc_handler_func_t handler;
+} irc_handler_t;
+
+typedef struct {
+    const char   *verb;
+    irc_handler_t handler;
+} irc_verb_t;
+
+static void irc_parse_ping(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    sock_sendf(irc->sock, "PONG :%s\r\n", params[0]);
+}
+
+/* PONG <server> :lag-<sent>, a late answer still counts */
+static void irc_parse_pong(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    const char *token = params[1] ? params[1] : params[0];
+    uint64_t    sent;
+    if (sscanf(token, "lag-%" SCNu64, &sent) != 1)
+        return;
+
+    uint64_t now = irc_lag_now();
+    if (sent > now)
+        return;
+
+    pthread_mutex_lock(&irc->lag.lock);
+    irc_lag_record(&irc->lag, now - sent);
+    if (sent == irc->lag.sent)
+        irc->lag.sent = 0;
+    irc->lag.missed = 0;
+    pthread_mutex_unlock(&irc->lag.lock);
+}
+
+/* Capabilities we make use of, anything else the server offers is ignored */
+static const struct {
+    const char *name;
+    irc_cap_t   cap;
+} irc_caps[] = {
+    { "multi-prefix",      IRC_CAP_MULTI_PREFIX      },
+    { "userhost-in-names", IRC_CAP_USERHOST_IN_NAMES },
+    { "extended-join",     IRC_CAP_EXTENDED_JOIN     },
+    { "away-notify",       IRC_CAP_AWAY_NOTIFY       },
+    { "account-notify",    IRC_CAP_ACCOUNT_NOTIFY    },
+    { "server-time",       IRC_CAP_SERVER_TIME       },
+    { "sasl",              IRC_CAP_SASL              },
+    { "chghost",           IRC_CAP_CHGHOST           },
+    { "batch",             IRC_CAP_BATCH             },
+    { "draft/multiline",   IRC_CAP_MULTILINE         }
+};
+
+/* Caps from a space separated list, values (cap=value) are ignored */
+static unsigned int irc_caps_parse(const char *list, unsigned int *removed) {
+    unsigned int caps = 0;
+
+    while (*list) {
+        while (*list == ' ')
+            list++;
+
+        bool remove = (*list == '-');
+        if (remove)
+            list++;
+
+        size_t length = strcspn(list, " =");
+        for (size_t i = 0; i < sizeof(irc_caps)/sizeof(*irc_caps); i++) {
+            if (strlen(irc_caps[i].name) != length || strncmp(irc_caps[i].name, list, length))
+                continue;
+            if (remove && removed)
+                *removed |= irc_caps[i].cap;
+            else if (!remove)
+                caps |= irc_caps[i].cap;
+        }
+
+        list += strcspn(list, " ");
+    }
+
+    return caps;
+}
+
+/* Value of a cap in a space separated list (cap=value), NULL without one */
+static const char *irc_caps_value(const char *list, const char *name, size_t *length) {
+    size_t size = strlen(name);
+    for (; *list; list += strcspn(list, " ")) {
+        while (*list == ' ')
+            list++;
+        if (strncmp(list, name, size) || list[size] != '=')
+            continue;
+        *length = strcspn(list + size + 1, " ");
+        return list + size + 1;
+    }
+    return NULL;
+}
+
+/* draft/multiline=max-bytes=<bytes>[,max-lines=<lines>] */
+static void irc_caps_multiline(irc_t *irc, const char *list) {
+    size_t      length = 0;
+    const char *value  = irc_caps_value(list, "draft/multiline", &length);
+    if (!value)
+        return;
+
+    irc->multibytes = 0;
+    irc->multilines = SIZE_MAX;
+    for (const char *end = value + length; value < end; value += strcspn(value, ",") + 1) {
+        if (!strncmp(value, "max-bytes=", 10))
+            irc->multibytes = strtoul(value + 10, NULL, 10);
+        else if (!strncmp(value, "max-lines=", 10))
+            irc->multilines = strtoul(value + 10, NULL, 10);
+    }
+}
+
+static void irc_caps_request(irc_t *irc, unsigned int caps) {
+    string_t   *request = string_create("CAP REQ :");
+    const char *space   = "";
+    for (size_t i = 0; i < sizeof(irc_caps)/sizeof(*irc_caps); i++) {
+        if (!(caps & irc_caps[i].cap))
+            continue;
+        string_catf(request, "%s%s", space, irc_caps[i].name);
+        space = " ";
+    }
+    sock_sendf(irc->sock, "%s\r\n", string_contents(request));
+    string_destroy(request);
+}
+
+/* Registration continues once the capabilities are settled */
+static void irc_caps_end(irc_t *irc) {
+    if (irc->ready)
+        return;
+    sock_sendf(irc->sock, "CAP END\r\n");
+}
+
+/*
+ * SASL is only requested when it's configured and the server offers the
+ * mechanism. Servers before CAP 302 don't list mechanisms, with those we
+ * try anyways.
+ */
+static bool irc_sasl_offered(irc_t *irc, const char *list) {
+    if (!irc->sasl)
+        return false;
+
+    for (; *list; list += strcspn(list, " ")) {
+        while (*list == ' ')
+            list++;
+        if (strncmp(list, "sasl", 4) || (list[4] != '=' && list[4] != ' ' && list[4] != '\0'))
+            continue;
+        if (list[4] != '=')
+            return true;
+
+        const char *mechanism = list + 5;
+        size_t      length    = strlen(irc->sasl);
+        while (*mechanism && *mechanism != ' ') {
+            size_t size = strcspn(mechanism, ", ");
+            if (size == length && !strncasecmp(mechanism, irc->sasl, length))
+                return true;
+            mechanism += size;
+            if (*mechanism == ',')
+                mechanism++;
+        }
+        printf("    irc      => SASL %s isn't offered\n", irc->sasl);
+        return false;
+    }
+    return false;
+}
+
+static string_t *irc_base64(const unsigned char *data, size_t size) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string_t *encode = string_construct();
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t block = (uint32_t)data[i] << 16;
+        if (i + 1 < size) block |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < size) block |= data[i + 2];
+
+        string_catf(encode, "%c%c%c%c",
+            table[(block >> 18) & 63],
+            table[(block >> 12) & 63],
+            (i + 1 < size) ? table[(block >> 6) & 63] : '=',
+            (i + 2 < size) ? table[block & 63]        : '=');
+    }
+    return encode;
+}
+
+/* The server asked for our credentials with an empty challenge */
+static void irc_sasl_respond(irc_t *irc) {
+    /* EXTERNAL uses the client certificate, the response is empty */
+    if (strcasecmp(irc->sasl, "PLAIN") || !irc->auth) {
+        sock_sendf(irc->sock, "AUTHENTICATE +\r\n");
+        return;
+    }
+
+    /* PLAIN: authzid \0 authcid \0 password */
+    const char *account = irc->account ? irc->account : irc->nick;
+    size_t      length  = strlen(account);
+    size_t      size    = length * 2 + strlen(irc->auth) + 2;
+    char       *plain   = malloc(size);
+
+    memcpy(plain, account, length);
+    plain[length] = '\0';
+    memcpy(plain + length + 1, account, length);
+    plain[length * 2 + 1] = '\0';
+    memcpy(plain + length * 2 + 2, irc->auth, strlen(irc->auth));
+
+    string_t *encode = irc_base64((unsigned char *)plain, size);
+    memset(plain, 0, size);
+    free(plain);
+
+    /* Responses are sent in chunks of 400, a full last chunk is ended with + */
+    const char *response = string_contents(encode);
+    size_t      remains  = string_length(encode);
+    do {
+        size_t chunk = remains > 400 ? 400 : remains;
+        sock_sendf(irc->sock, "AUTHENTICATE %.*s\r\n", (int)chunk, response);
+        response += chunk;
+        remains  -= chunk;
+        if (chunk == 400 && !remains)
+            sock_sendf(irc->sock, "AUTHENTICATE +\r\n");
+    } while (remains);
+
+    memset((char *)string_contents(encode), 0, string_length(encode));
+    string_destroy(encode);
+}
+
+static void irc_parse_cap(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    const char *command = params[1];
+
+    /* The list is the last parameter, a star before it means there is more */
+    bool        more = params[3] && !strcmp(params[2], "*");
+    const char *list = more ? params[3] : params[2];
+
+    if (!strcmp(command, "LS") || !strcmp(command, "NEW")) {
+        unsigned int offered = irc_caps_parse(list, NULL);
+        if ((offered & IRC_CAP_SASL) && (irc->ready || !irc_sasl_offered(irc, list)))
+            offered &= ~IRC_CAP_SASL;
+
+        if (offered & IRC_CAP_MULTILINE)
+            irc_caps_multiline(irc, list);
+
+        irc->capsoffered |= offered;
+        if (more)
+            return;
+
+        /* Multiline messages are sent as batches */
+        unsigned int request = irc->capsoffered & ~irc->caps;
+        if (!(irc->capsoffered & IRC_CAP_BATCH))
+            request &= ~IRC_CAP_MULTILINE;
+        if (request)
+            irc_caps_request(irc, request);
+        else
+            irc_caps_end(irc);
+    } else if (!strcmp(command, "ACK")) {
+        unsigned int removed = 0;
+        irc->caps |= irc_caps_parse(list, &removed);
+        irc->caps &= ~removed;
+        printf("    irc      => capabilities %s\n", list);
+        if (more)
+            return;
+
+        /* Authenticate before registration is finished */
+        if ((irc->caps & IRC_CAP_SASL) && !irc->ready) {
+            printf("    irc      => authenticating (SASL %s)\n", irc->sasl);
+            sock_sendf(irc->sock, "AUTHENTICATE %s\r\n", irc->sasl);
+            return;
+        }
+        irc_caps_end(irc);
+    } else if (!strcmp(command, "NAK")) {
+        irc_caps_end(irc);
+    } else if (!strcmp(command, "DEL")) {
+        unsigned int removed = irc_caps_parse(list, NULL);
+        irc->caps        &= ~removed;
+        irc->capsoffered &= ~removed;
+    }
+}
+
+static void irc_parse_authenticate(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    /* Neither mechanism has more than the one empty challenge */
+    if (irc->sasl && !strcmp(params[0], "+"))
+        irc_sasl_respond(irc);
+    else
+        sock_sendf(irc->sock, "AUTHENTICATE *\r\n");
+}
+
+static void irc_parse_loggedin(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)irc;    /* ignored */
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    printf("    irc      => logged in as %s\n", params[2]);
+}
+
+static void irc_parse_saslsuccess(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    (void)params; /* ignored */
+
+    /*
+     * NickServ has nothing left to do. The secret is kept, it's needed
+     * again when the connection is made anew.
+     */
+    printf("    irc      => authenticated\n");
+    irc->loggedin = true;
+    irc_caps_end(irc);
+}
+
+/*
+ * When SASL fails registration continues without it, NickServ is still
+ * there to authenticate with.
+ */
+static void irc_parse_saslfail(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    printf("    irc      => SASL failed: %s\n", params[1]);
+    irc_caps_end(irc);
+}
+
+static void irc_parse_away(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    /* AWAY with a message is going away, without one is coming back */
+    irc_users_update(irc, prefix, params[0],
+        lambda void(users_t *users, user_t *user, const char *message) {
+            (void)users;
+            user->away = (message != NULL);
+        }
+    );
+}
+
+static void irc_parse_account(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+    irc_users_update(irc, prefix, params[0], &irc_user_account);
+}
+
+static void irc_parse_privmsg(irc_t *irc, void *data, const char *prefix, char **params) {
+    irc_channel_t *channel = hashtable_find(irc->channels, params[0]);
+    irc_message_t *message = channel ? &channel->message : &irc->message;
+    const char    *nick    = irc_target_nick(prefix);
+
+    /* The bot ignores anyone who is -1 as well as itself */
+    if (access_ignore(irc, nick) || !strcmp(irc->nick, nick))
+        return;
+
+    /*
+     * Several messages can arrive in one read, don't drop the last one. The
+     * channel stays queued, it's only ever in the queue once.
+     */
+    bool queued = channel && channel->dirty;
+    if (queued)
+        irc_channel_dispatch(channel, data);
+
+    irc_message_update(message, prefix, params[1], irc->time);
+
+    /* Trim trailing whitespace */
+    char *trail = message->content + strlen(message->content) - 1;
+    while (trail > message->content && isspace(*trail))
+        trail--;
+    trail[1] = '\0';
+
+    if (channel) {
+        channel->dirty = true;
+        if (!queued)
+            vector_push(irc->dirty, channel);
+    }
+
+    /* Did someone initiate a module? */
+    if (strncmp(params[1], irc->pattern, strlen(irc->pattern)))
+        return;
+
+    /* Skip the pattern and strip the string */
+    char *skip  = params[1] + strlen(irc->pattern);
+    char *strip = strchr(skip, ' ');
+    if (strip)
+        *strip = '\0';
+
+    /* Check for the appropriate module for this command */
+    module_t *find = module_manager_command(irc->moduleman, skip);
+    if (!find) {
+        irc_write(irc, message->nick,
+            "Sorry, there is no command named %s available. I do however, take requests if asked nicely.", skip);
+        return;
+    }
+
+    /* If the channel doesn't have the module we don't bother */
+    if (channel && !hashtable_find(channel->modules, skip))
+        return;
+
+    /* Skip the initial part of the module */
+    char *next = message->content + strlen(irc->pattern) + strlen(skip);
+    while (isspace(*next))
+        next++;
+
+    cmd_channel_push (
+        data,
+        cmd_entry_create (
+            data,
+            find,
+            channel ? params[0] : message->nick,
+            message->nick,
+            next
+        )
+    );
+}
+
+static void irc_parse_notice(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    /*
+     * This is a special case to support Atheme's nick services.
+     * NickServ sends a NOTICE containing "This nickname is registered",
+     * we check for that and PRIVMSG NickServ to authenticate using
+     * the authentication syntax. NickServ will send a NOTICE when
+     * we're authenticated. For all other NOTICEs from NickServ we
+     * simply ignore them.
+     */
+    if (!irc->auth || irc->loggedin || strcmp(irc_target_nick(prefix), "NickServ"))
+        return;
+
+    if (strstr(params[1], "You are now identified")) {
+        printf("    irc      => authenticated\n");
+        irc->loggedin = true;
+    } else if (strstr(params[1], "This nickname is registered")) {
+        sock_sendf(irc->sock, "PRIVMSG NickServ :IDENTIFY %s %s\r\n", irc->nick, irc->auth);
+    }
+}
+
+static void irc_parse_kill(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    /* KILL <nick> :<reason>, anyone but us just leaves our channels */
+    if (params[0] && !irc_self(irc, params[0])) {
+        user_t *user = users_find(irc->users, params[0]);
+        if (user)
+            users_remove(irc->users, user);
+        return;
+    }
+
+    /*
+     * The instance is still being processed, the shard drops the
+     * connection and connects again once the read is done.
+     */
+    printf("    irc      => killed: %s\n", params[1] ? params[1] : "no reason");
+    irc->killed = true;
+}
+
+static void irc_parse_join(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    /* Our own JOIN is echoed with our full prefix */
+    if (irc_self(irc, prefix))
+        irc_self_host(irc, irc_target_host(prefix));
+
+    if (access_shitlist(irc, prefix)) {
+        sock_sendf(irc->sock, "KICK %s :you are banned\r\n", params[0]);
+        /* TODO: ban */
+        return;
+    }
+
+    irc_channel_t *channel = hashtable_find(irc->channels, params[0]);
+    if (!channel)
+        return;
+
+    member_t *member = irc_users_insert(channel, prefix);
+
+    /* extended-join: JOIN <channel> <account> :<realname> */
+    if (params[1] && params[2])
+        irc_user_account(irc->users, member->user, params[1]);
+}
+
+static void irc_parse_part(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    /* Parted by the server, our own PART left the channel already */
+    if (irc_self(irc, prefix)) {
+        if (irc_channel_leave(irc, params[0]))
+            printf("    channel  => %s parted\n", params[0]);
+        return;
+    }
+
+    irc_users_remove(irc, params[0], irc_target_nick(prefix));
+}
+
+/* KICK <channel> <nick> [:<reason>] */
+static void irc_parse_kick(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    if (!strcasecmp(params[1], irc->nick)) {
+        if (irc_channel_leave(irc, params[0]))
+            printf("    channel  => %s kicked\n", params[0]);
+        return;
+    }
+
+    irc_users_remove(irc, params[0], params[1]);
+}
+
+/* Leaving the network leaves every channel we share with the user */
+static void irc_parse_quit(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)params; /* ignored */
+
+    user_t *user = users_find(irc->users, irc_target_nick(prefix));
+    if (user)
+        users_remove(irc->users, user);
+}
+
+/*
+ * When the server sends the end of it's MOTD or it doesn't send a MOTD at
+ * all we consider this the syncronized state and join the channels we
+ * need to.
+ */
+static void irc_parse_endofmotd(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    (void)params; /* ignored */
+    irc_channels_join(irc);
+}
+
+static void irc_parse_welcome(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    /*
+     * The welcome is addressed to the nick we really got and usually ends
+     * in our nick!user@host.
+     */
+    if (params[0] && strcmp(irc->nick, params[0]))
+        irc_self_nick(irc, params[0]);
+
+    const char *mask = params[0] && params[1] ? strrchr(params[1], ' ') : NULL;
+    if (mask && strchr(mask, '!') && strchr(mask, '@'))
+        irc_self_host(irc, irc_target_host(mask + 1));
+
+    /* Registered, no more deadline and a fresh start for the retry delay */
+    wheel_timer_cancel(irc->connecting);
+    irc->backoff = IRC_RECONNECT_MIN;
+    irc->ready   = true;
+    printf("    irc      => ready\n");
+}
+
+/*
+ * Limit for a key in a comma separated list of key:limit pairs as used by
+ * TARGMAX and CHANLIMIT. Keys of CHANLIMIT are a set of channel prefixes.
+ * An empty limit means there is none.
+ */
+static void irc_isupport_limit(const char *list, const char *key, size_t *limit) {
+    size_t length = strlen(key);
+    while (*list) {
+        size_t      size  = strcspn(list, ",");
+        const char *colon = memchr(list, ':', size);
+
+        bool match = colon && ((*key == '#')
+            ? memchr(list, '#', colon - list) != NULL
+            : (size_t)(colon - list) == length && !strncasecmp(list, key, length));
+
+        if (match) {
+            *limit = isdigit(colon[1]) ? strtoul(colon + 1, NULL, 10) : (*key == '#') ? SIZE_MAX : IRC_TARGETS_MAX;
+            return;
+        }
+        list += size + (list[size] == ',');
+    }
+}
+
+/*
+ * 005: <nick> <token>... :are supported by this server
+ * Only what the bot makes use of is picked out of the tokens.
+ */
+static void irc_parse_isupport(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    for (size_t i = 1; params[i] && params[i + 1]; i++) {
+        const char *token = params[i];
+
+        /* TARGMAX=PRIVMSG:4,NOTICE:4,JOIN: where an empty limit is none */
+        if (!strncmp(token, "TARGMAX=", 8)) {
+            irc_isupport_limit(token + 8, "PRIVMSG", &irc->targmax);
+            irc_isupport_limit(token + 8, "JOIN", &irc->joinmax);
+        } else if (!strncmp(token, "MAXTARGETS=", 11)) {
+            irc->targmax = strtoul(token + 11, NULL, 10);
+        } else if (!strcmp(token, "-TARGMAX") || !strcmp(token, "-MAXTARGETS")) {
+            irc->targmax = 1;
+            irc->joinmax = 1;
+        } else if (!strncmp(token, "CHANLIMIT=", 10)) {
+            /* CHANLIMIT=#&:50,+:10 where only the limit for # is of interest */
+            irc_isupport_limit(token + 10, "#", &irc->chanlimit);
+        } else if (!strncmp(token, "PREFIX=", 7)) {
+            /* PREFIX=(qaohv)~&@%+ where PREFIX= means there are none */
+            const char *symbols = strchr(token + 7, ')');
+            symbols = symbols ? symbols + 1 : token + 7;
+            snprintf(irc->prefixes, sizeof(irc->prefixes), "%s", symbols);
+        } else if (!strcmp(token, "-PREFIX")) {
+            strcpy(irc->prefixes, IRC_PREFIXES);
+        }
+    }
+}
+
+/* 396: <nick> <host> :is now your hidden host */
+static void irc_parse_hosthidden(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    if (strchr(params[1], '@'))
+        return irc_self_host(irc, params[1]);
+
+    /* Only the host changed, keep the user we know */
+    const char *at = irc->host ? strchr(irc->host, '@') : NULL;
+    if (!at)
+        return;
+
+    string_t *host = string_format("%.*s@%s", (int)(at - irc->host), irc->host, params[1]);
+    irc_self_host(irc, string_contents(host));
+    string_destroy(host);
+}
+
+/* chghost: CHGHOST <user> <host> */
+static void irc_parse_chghost(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    string_t *host = string_format("%s@%s", params[0], params[1]);
+    if (irc_self(irc, prefix))
+        irc_self_host(irc, string_contents(host));
+
+    irc_users_update(irc, prefix, string_contents(host),
+        lambda void(users_t *users, user_t *user, const char *host)
+            => users_host(users, user, host);
+    );
+    string_destroy(host);
+}
+
+static void irc_parse_nick(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data; /* ignored */
+
+    if (irc_self(irc, prefix))
+        irc_self_nick(irc, params[0]);
+
+    user_t *user = users_find(irc->users, irc_target_nick(prefix));
+    if (user)
+        users_rename(irc->users, user, params[0]);
+}
+
+static void irc_parse_topic(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    irc_channel_t *channel = hashtable_find(irc->channels, params[1]);
+    if (!channel)
+        return;
+    /* Update the channel topic */
+    free(channel->topic);
+    channel->topic = strdup(params[2]);
+}
+
+static void irc_parse_endofnames(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    irc_channel_t *channel = hashtable_find(irc->channels, params[1]);
+    if (channel)
+        irc_channels_joined(irc, channel);
+}
+
+static void irc_parse_namreply(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+
+    irc_channel_t *channel = hashtable_find(irc->channels, params[2]);
+    if (!channel)
+        return;
+    /*
+     * Update the names, event loops parse on several threads at once. With
+     * multi-prefix every channel prefix of a user is listed in front of
+     * the nick and with userhost-in-names the nick is a full nick!user@host.
+     * Room for all names of the line is made up front.
+     */
+    size_t names = 1;
+    for (const char *space = params[3]; (space = strchr(space, ' ')); space++)
+        names++;
+    members_reserve(channel->users, names);
+
+    char *save     = NULL;
+    char *tokenize = strtok_r(params[3], " ", &save);
+    while (tokenize) {
+        size_t    modes = strspn(tokenize, irc->prefixes);
+        member_t *member = irc_users_insert(channel, tokenize + modes);
+        member->modes = irc_user_modes(irc, tokenize, modes);
+        tokenize = strtok_r(NULL, " ", &save);
+    }
+}
+
+static void irc_parse_nicknameinuse(irc_t *irc, void *data, const char *prefix, char **params) {
+    (void)data;   /* ignored */
+    (void)prefix; /* ignored */
+    (void)params; /* ignored */
+
+    /* Change nickname by appending a tail */
+    string_t *tail = string_format("%s_", irc->nick);
+    irc_self_nick(irc, string_contents(tail));
+    string_destroy(tail);
+    sock_sendf(irc->sock, "NICK %s\r\n", irc->nick);
+}
+
+static const irc_verb_t irc_verbs[] = {
+    { "PING",         { 1, &irc_parse_ping         } },
+    { "PONG",         { 1, &irc_parse_pong         } },
+    { "CAP",          { 3, &irc_parse_cap          } },
+    { "AUTHENTICATE", { 1, &irc_parse_authenticate } },
+    { "AWAY",         { 0, &irc_parse_away         } },
+    { "ACCOUNT",      { 1, &irc_parse_account      } },
+    { "PRIVMSG",      { 2, &irc_parse_privmsg      } },
+    { "NOTICE",       { 2, &irc_parse_notice       } },
+    { "KILL",         { 0, &irc_parse_kill         } },
+    { "JOIN",         { 1, &irc_parse_join         } },
+    { "PART",         { 1, &irc_parse_part         } },
+    { "QUIT",         { 0, &irc_parse_quit         } },
+    { "KICK",         { 2, &irc_parse_kick         } },
+    { "NICK",         { 1, &irc_parse_nick         } },
+    { "CHGHOST",      { 2, &irc_parse_chghost      } }
+};
+
+static const irc_handler_t irc_numerics[1000] = {
+    [RPL_WELCOME]       = { 0, &irc_parse_welcome       },
+    [RPL_ISUPPORT]      = { 2, &irc_parse_isupport      },
+    [RPL_TOPIC]         = { 3, &irc_parse_topic         },
+    [RPL_NAMREPLY]      = { 4, &irc_parse_namreply      },
+    [RPL_ENDOFNAMES]    = { 2, &irc_parse_endofnames    },
+    [RPL_HOSTHIDDEN]    = { 2, &irc_parse_hosthidden    },
+    [RPL_ENDOFMOTD]     = { 0, &irc_parse_endofmotd     },
+    [ERR_NOMOTD]        = { 0, &irc_parse_endofmotd     },
+    [ERR_NICKNAMEINUSE] = { 0, &irc_parse_nicknameinuse },
+    [RPL_LOGGEDIN]      = { 3, &irc_parse_loggedin      },
+    [RPL_SASLSUCCESS]   = { 0, &irc_parse_saslsuccess   },
+    [ERR_SASLFAIL]      = { 2, &irc_parse_saslfail      },
+    [ERR_SASLTOOLONG]   = { 2, &irc_parse_saslfail      },
+    [ERR_SASLABORTED]   = { 2, &irc_parse_saslfail      },
+    [ERR_SASLALREADY]   = { 2, &irc_parse_saslfail      }
+};
+
+/*
+ * Verbs are found through an open addressed table of indices into the
+ * registrations above. It's built once and only read after that, a lookup
+ * costs a hash of the verb and a single compare for anything registered.
+ */
+#define IRC_VERB_SLOTS 64
+
+static unsigned char  irc_verb_slots[IRC_VERB_SLOTS];
+static pthread_once_t irc_verb_once = PTHREAD_ONCE_INIT;
+
+static size_t irc_verb_hash(const char *verb) {
+    size_t hash = 2166136261u;
+    while (*verb)
+        hash = (hash ^ (unsigned char)*verb++) * 16777619u;
+    return hash;
+}
+
+static void irc_verb_init(void) {
+    for (size_t i = 0; i < sizeof(irc_verbs)/sizeof(*irc_verbs); i++) {
+        size_t slot = irc_verb_hash(irc_verbs[i].verb) & (IRC_VERB_SLOTS - 1);
+        while (irc_verb_slots[slot])
+            slot = (slot + 1) & (IRC_VERB_SLOTS - 1);
+        irc_verb_slots[slot] = i + 1; /* zero is an empty slot */
+    }
+}
+
+static const irc_handler_t *irc_verb_find(const char *verb) {
+    pthread_once(&irc_verb_once, &irc_verb_init);
+
+    size_t slot = irc_verb_hash(verb) & (IRC_VERB_SLOTS - 1);
+    while (irc_verb_slots[slot]) {
+        const irc_verb_t *find = &irc_verbs[irc_verb_slots[slot] - 1];
+        if (!strcmp(find->verb, verb))
+            return &find->handler;
+        slot = (slot + 1) & (IRC_VERB_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/*
+ * server-time: time=YYYY-MM-DDThh:mm:ss.sssZ, always in UTC. Converted by
+ * hand as timegm isn't available everywhere.
+ */
+static time_t irc_parse_time(const char *value) {
+    int year, month, day, hour, minute, second;
+    if (sscanf(value, "%4d-%2d-%2dT%2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second) != 6)
+        return 0;
+
+    /* Days since the epoch of a date in the proleptic Gregorian calendar */
+    year -= month <= 2;
+    long era  = (year >= 0 ? year : year - 399) / 400;
+    long yoe  = year - era * 400;
+    long doy  = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe  = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + doe - 719468;
+
+    return (time_t)days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/* <tags> ::= <tag> [';' <tag>]*, only the ones we use are looked at */
+static void irc_parse_tags(irc_t *irc, const char *tags) {
+    while (*tags) {
+        if (!strncmp(tags, "time=", 5)) {
+            time_t time = irc_parse_time(tags + 5);
+            if (time)
+                irc->time = time;
+        }
+        tags += strcspn(tags, ";");
+        if (*tags)
+            tags++;
+    }
+}
+
+static void irc_parse(irc_t *irc, void *data, char *line) {
+    char       *params[11] = { NULL };
+    char       *command = NULL;
+    const char *prefix  = NULL;
+    char       *parse   = line;
+    int         numeric = 0;
+    size_t      count   = 0;
+
+    /* <message> ::= ['@' <tags> <SPACE>] [':' <prefix> <SPACE> ] <command> <params> */
+    irc->time = time(NULL);
+    if (parse[0] == '@') {
+        char *tags = ++parse;
+        while (*parse && *parse != ' ')
             parse++;
-        *parse++ = '\0';
-        prefix = irc->buffer.data + 1;
+        if (*parse)
+            *parse++ = '\0';
+        irc_parse_tags(irc, tags);
     }
 
-    /* <command> ::= <letter> { <letter> } | <number> <number> <number> */
+    /* <prefix> ::= <servername> | <nick> [ '!' <user> ] [ '@' <host> ] */
+    if (parse[0] == ':') {
+        prefix = parse + 1;
+        while (*parse && *parse != ' ')
+            parse++;
+        if (*parse)
+            *parse++ = '\0';
+    }
+
+    /*
+     * <command> ::= <letter> { <letter> } | <number> <number> <number>
+     *
+     * The line is parsed in place in the receive buffer, so nothing may
+     * step past its terminator into the lines after it.
+     */
     if (isdigit(parse[0]) && isdigit(parse[1]) && isdigit(parse[2])) {
+        bool more = parse[3] != '\0';
         parse[3] = '\0';
         numeric  = atoi(parse);
-        parse   += 4;
+        parse   += more ? 4 : 3;
     } else {
         command = parse;
         while (*parse && *parse != ' ')
             parse++;
-        *parse++ = '\0';
+        if (*parse)
+            *parse++ = '\0';
     }
 
     /* <params> ::= <space> [ ':' <trailing> | <middle> <params> ] */
-    for (size_t i = 0; i < sizeof(params)/sizeof(*params) - 1; ) {
+    while (count < sizeof(params)/sizeof(*params) - 1) {
         /* When starting from ':' it's the last parameter */
         if (*parse == ':') {
-            params[i++] = parse + 1;
+            params[count++] = parse + 1;
             break;
         }
 
@@ -742,7 +2407,9 @@ static void irc_parse(irc_t *irc, void *data) {
          *               space or NUL or CR or LF, the first of which
          *               cannot be <space>>
          */
-        params[i++] = parse;
+        if (!*parse)
+            break;
+        params[count++] = parse;
 
         /*
          * <trailing> ::= <Any possibly *empty*, sequence of octets not
@@ -758,147 +2425,173 @@ static void irc_parse(irc_t *irc, void *data) {
         *parse++ = '\0';
     }
 
-    /* Deal with server PING/PONG as early as possible */
-    if (command && !strncmp(command, "PING", end - command) && params[0]) {
-        sock_sendf(irc->sock, "PONG :%s\r\n", params[0]);
+    const irc_handler_t *handler = command ? irc_verb_find(command) : &irc_numerics[numeric];
+    if (!handler || !handler->handler || count < handler->params)
         return;
-    }
 
-    if (numeric) {
-        /*
-         * When the server sends the end of it's MOTD or it doesn't send a
-         * MOTD at all we consider this the syncronized state and join the
-         * channels we need to.
-         */
-        if ((numeric == RPL_ENDOFMOTD || numeric == ERR_NOMOTD))
-            irc_channels_join(irc);
+    /* Handlers which look at the source of a line need one */
+    if (!prefix)
+        prefix = "";
 
-        else if (numeric == RPL_WELCOME) {
-            irc->ready = true;
-            printf("    irc      => ready\n");
-            return;
-        } else if (numeric == RPL_TOPIC) {
-            irc_channel_t *channel = hashtable_find(irc->channels, params[1]);
-            if (!channel)
-                return;
-            /* Update the channel topic */
-            free(channel->topic);
-            channel->topic = strdup(params[2]);
-            return;
-        } else if (numeric == RPL_NAMREPLY) {
-            irc_channel_t *channel = hashtable_find(irc->channels, params[2]);
-            if (!channel)
-                return;
-            /* Update the names */
-            char *tokenize = strtok(params[3], " ");
-            while (tokenize) {
-                /* TODO: whois to get host */
-                irc_users_insert(irc, channel->channel, tokenize);
-                tokenize = strtok(NULL, " ");
-            }
-            return;
-        } else if (numeric == ERR_NICKNAMEINUSE) {
-            /* Change nickname by appending a tail */
-            string_t *tail = string_format("%s_", irc->nick);
-            free(irc->nick);
-            irc->nick = string_move(tail);
-            sock_sendf(irc->sock, "NICK %s\r\n", irc->nick);
-            return;
-        }
-        return;
-    }
+    handler->handler(irc, data, prefix, params);
+}
 
-    if (!strncmp(command, "PRIVMSG", end - command) && params[1]) {
-        irc_channel_t *channel = hashtable_find(irc->channels, params[0]);
-        irc_message_t *message = channel ? &channel->message : &irc->message;
+/*
+ * Everything the line framing has to look at is below 0x20: the newline and
+ * the formatting codes stripped from lines. Finding the next byte below 0x20
+ * is done a vector at a time, the rare hit which isn't interesting (e.g a
+ * tab) is skipped by the caller.
+ */
+static const bool irc_special[0x20] = {
+    ['\n']   = true,
+    ['\r']   = true,
+    ['\x02'] = true, /* bold      */
+    ['\x03'] = true, /* color     */
+    ['\x0f'] = true, /* reset     */
+    ['\x16'] = true, /* reverse   */
+    ['\x1f'] = true  /* underline */
+};
 
-        irc_message_update(message, prefix, params[1]);
+static char *irc_scan(char *data, const char *end) {
+#if defined(__AVX2__)
+    const __m256i limit32 = _mm256_set1_epi8(0x1F);
+    while (end - data >= 32) {
+        __m256i  load = _mm256_loadu_si256((const __m256i *)data);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(load, limit32), load));
+        if (mask)
+            return data + __builtin_ctz(mask);
+        data += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i limit16 = _mm_set1_epi8(0x1F);
+    while (end - data >= 16) {
+        __m128i  load = _mm_loadu_si128((const __m128i *)data);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(load, limit16), load));
+        if (mask)
+            return data + __builtin_ctz(mask);
+        data += 16;
+    }
+#endif
+    while (data < end && (unsigned char)*data >= 0x20)
+        data++;
+    return data;
+}
 
-        /* The bot ignores anyone who is -1 as well as itself */
-        if (access_ignore(irc, message->nick) || !strcmp(irc->nick, message->nick))
-            return;
+/*
+ * Strip formatting codes in place starting from the first one in the line,
+ * returns the new length of the line. Dealing with color control:
+ *
+ *  \x03X
+ *  \x03XY
+ *  \x03XY,X
+ *  \x03XY,XY
+ */
+static size_t irc_strip(char *line, char *from, const char *last) {
+    char *write = from;
+    char *read  = from;
+
+    while (read < last) {
+        char ch = *read++;
+        switch (ch) {
+            case '\r':
+            case '\x02':
+            case '\x0f':
+            case '\x16':
+            case '\x1f':
+                continue;
+
+            case '\x03':
+                /* X or XY skip */
+                if (read < last && isdigit(*read) && ++read < last && isdigit(*read))
+                    read++;
+                /* ,X or ,XY skip, otherwise keep the comma */
+                if (read + 1 < last && *read == ',' && isdigit(read[1])) {
+                    read += 2;
+                    if (read < last && isdigit(*read))
+                        read++;
+                }
+                continue;
+        }
+        *write++ = ch;
+    }
 
-        /* Trim trailing whitespace */
-        char *trail = message->content + strlen(message->content) - 1;
-        while (trail > message->content && isspace(*trail))
-            trail--;
-        trail[1] = '\0';
-
-        /* Did someone initiate a module? */
-        if (!strncmp(params[1], irc->pattern, strlen(irc->pattern))) {
-            /* Skip the pattern and strip the string */
-            char *skip  = params[1] + strlen(irc->pattern);
-            char *strip = strchr(skip, ' ');
-            if (strip)
-                *strip = '\0';
-
-            /* Check for the appropriate module for this command */
-            module_t *find = module_manager_command(irc->moduleman, skip);
-            if (!find) {
-                irc_write(irc, message->nick,
-                    "Sorry, there is no command named %s available. I do however, take requests if asked nicely.", skip);
-                return;
+    return write - line;
+}
+
+/*
+ * Lines are framed and parsed in place in the receive buffer. Only lines
+ * with formatting codes in them are touched before parsing and only what
+ * is left of a partial line is moved to the front for the next read.
+ */
+static void irc_process_buffer(irc_t *irc, void *data) {
+    irc_buffer_t *buffer = &irc->buffer;
+    char         *line   = buffer->data;
+    char         *end    = buffer->data + buffer->length;
+
+    for (;;) {
+        char *scan    = line;
+        char *strip   = NULL;
+        char *newline = NULL;
+
+        while ((scan = irc_scan(scan, end)) < end) {
+            if (*scan == '\n') {
+                newline = scan;
+                break;
             }
+            /* A carriage return ending the line doesn't need stripping */
+            if (!strip && irc_special[(unsigned char)*scan] && !(*scan == '\r' && scan + 1 < end && scan[1] == '\n'))
+                strip = scan;
+            scan++;
+        }
 
-            /* If the channel doesn't have the module we don't bother */
-            if (channel && !hashtable_find(channel->modules, skip))
-                return;
+        if (!newline)
+            break;
 
-            /* Skip the initial part of the module */
-            char *next = message->content + strlen(irc->pattern) + strlen(skip);
-            while (isspace(*next))
-                next++;
-
-            cmd_channel_push (
-                data,
-                cmd_entry_create (
-                    data,
-                    find,
-                    channel ? params[0] : message->nick,
-                    message->nick,
-                    next
-                )
-            );
+        /* The tail end of a line that was too long */
+        if (buffer->discard) {
+            buffer->discard = false;
+            line = newline + 1;
+            continue;
         }
-    } else if (!strncmp(command, "NOTICE", end - command) && params[1]) {
-        /*
-         * This is a special case to support Atheme's nick services.
-         * NickServ sends a NOTICE containing "This nickname is registered",
-         * we check for that and PRIVMSG NickServ to authenticate using
-         * the authentication syntax. NickServ will send a NOTICE when
-         * we're authenticated. For all other NOTICEs from NickServ we
-         * simply ignore them.
-         */
-        if (!strcmp(irc_target_nick(prefix), "NickServ") && irc->auth) {
-            if (strstr(params[1], "You are now identified")) {
-                printf("    irc      => authenticated\n");
-                memset(irc->auth, 0, strlen(irc->auth));
-            } else if (strstr(params[1], "This nickname is registered")) {
-                sock_sendf(irc->sock, "PRIVMSG NickServ :IDENTIFY %s %s\r\n", irc->nick, irc->auth);
-            }
-        }
-    } else if (!strncmp(command, "KILL", end - command)) {
-        irc_destroy(irc, SOCK_RESTART_NIL, NULL);
-    } else if (!strncmp(command, "JOIN", end - command)) {
-        if (access_shitlist(irc, prefix)) {
-            sock_sendf(irc->sock, "KICK %s :you are banned\r\n", params[0]);
-            /* TODO: ban */
-            return;
+
+        /* Or one which arrived whole but is still too long */
+        if (newline - line >= IRC_LINE_MAX) {
+            printf("    irc      => dropping line longer than %d bytes\n", IRC_LINE_MAX);
+            line = newline + 1;
+            continue;
         }
-        irc_users_insert(irc, params[0], prefix);
-    } else if (!strncmp(command, "PART", end - command)) {
-        irc_users_remove(irc, params[0], prefix);
-    } else if (!strncmp(command, "QUIT", end - command)) {
-        hashtable_foreach(irc->channels, prefix,
-            lambda void(irc_channel_t *channel, const char *nick)
-                => irc_users_remove(channel->instance, channel->channel, nick);
-        );
+
+        char *last = newline;
+        if (last > line && last[-1] == '\r')
+            last--;
+
+        size_t length = (strip && strip < last) ? irc_strip(line, strip, last) : (size_t)(last - line);
+        line[length] = '\0';
+        irc_parse(irc, data, line);
+
+        line = newline + 1;
     }
+
+    size_t partial = end - line;
+    if (buffer->discard || partial >= IRC_LINE_MAX) {
+        if (!buffer->discard)
+            printf("    irc      => dropping line longer than %d bytes\n", IRC_LINE_MAX);
+        buffer->discard = true;
+        partial         = 0;
+    }
+
+    memmove(buffer->data, line, partial);
+    buffer->length = partial;
 }
 
-void irc_process(irc_t *irc, void *data) {
+/*
+ * Returns false once the server closed the connection or KILLed us, the
+ * caller drops it and connects again.
+ */
+bool irc_process(irc_t *irc, void *data) {
     if (!irc->sock)
-        return;
+        return true;
 
     if (!irc->ready && !irc->identified) {
         /*
@@ -906,55 +2599,32 @@ void irc_process(irc_t *irc, void *data) {
          * ignored by the IRCd when the USER command comes directly from a
          * connected client for security reasons. We simply ignore sending
          * those fields.
+         *
+         * Capability negotiation is started first, which holds back the
+         * registration until CAP END. Servers without it just ignore it.
          */
-        sock_sendf(irc->sock, "NICK %s\r\nUSER %s localhost 0 :redorito\r\n", irc->nick, irc->nick);
+        sock_sendf(irc->sock, "CAP LS 302\r\nNICK %s\r\nUSER %s localhost 0 :redorito\r\n", irc->nick, irc->nick);
         irc->identified = true;
     }
 
-    char temp[256];
-    int read;
-    if ((read = sock_recv(irc->sock, temp, sizeof(temp) - 1)) <= 0)
-        return;
-
-    for (int i = 0; i < read; ++i) {
-        if (temp[i] == '\r')   continue;
-        if (temp[i] == '\x02') continue; /* bold      */
-        if (temp[i] == '\x1f') continue; /* underline */
-        if (temp[i] == '\x16') continue; /* reverse   */
-        if (temp[i] == '\x0f') continue; /* reset     */
+    /*
+     * Readiness is edge-triggered so the socket must be drained until it
+     * would block, otherwise we won't be woken up for what is left in it.
+     */
+    irc_buffer_t *buffer = &irc->buffer;
+    int           read   = -1;
+    while (!irc->killed && (read = sock_recv(irc->sock, buffer->data + buffer->length, sizeof(buffer->data) - buffer->length)) > 0) {
+        buffer->length += read;
+        irc_process_buffer(irc, data);
+    }
 
-        /* Dealing with color control:
-         *
-         *  \x03X
-         *  \x03XY
-         *  \x03XY,X
-         *  \x03XY,XY
-         */
-        if (temp[i] == '\x03' && ++i < read) {
-            /* X or XY skip */
-            if (isdigit(temp[i]) && ++i < read && isdigit(temp[i]))
-                i++;
-            /* ,X or ,XY skip */
-            if (i < read && temp[i] == ',') {
-                if (++i < read) {
-                    if (isdigit(temp[i])) {
-                        if (++i < read && isdigit(temp[i]))
-                            i++;
-                    } else i--; /* Keep comma */
-                } else i--; /* Keep comma */
-            }
-        }
+    irc_dispatch(irc, data);
+    if (read == 0 || irc->killed)
+        return false;
 
-        if (temp[i] == '\n') {
-            irc->buffer.data[irc->buffer.offset] = '\0';
-            irc_parse(irc, data);
-            irc->buffer.offset = 0;
-        } else {
-            irc->buffer.data[irc->buffer.offset++] = temp[i];
-            if (irc->buffer.offset > sizeof(irc->buffer.data) - 1)
-                abort();
-        }
-    }
+    /* Replies to what was read as well as output the socket had no room for */
+    sock_flush(irc->sock);
+    return true;
 }
 
 /* Exposed functionality for the module API */
@@ -966,6 +2636,22 @@ const char *irc_name(irc_t *irc) {
     return irc->name;
 }
 
+void irc_dispatch_stats(irc_t *irc, size_t *dispatched, size_t *skipped) {
+    *dispatched = irc->dispatched;
+    *skipped    = irc->skipped;
+}
+
+void irc_lag_stats(irc_t *irc, irc_lag_stats_t *stats) {
+    pthread_mutex_lock(&irc->lag.lock);
+    stats->samples = irc->lag.samples;
+    stats->missed  = irc->lag.missed;
+    stats->last    = irc->lag.last;
+    stats->p50     = irc_lag_percentile(&irc->lag, 0.50);
+    stats->p99     = irc_lag_percentile(&irc->lag, 0.99);
+    stats->max     = irc->lag.max;
+    pthread_mutex_unlock(&irc->lag.lock);
+}
+
 const char *irc_pattern(irc_t *irc, const char *newpattern) {
     if (newpattern) {
         free(irc->pattern);
@@ -974,20 +2660,34 @@ const char *irc_pattern(irc_t *irc, const char *newpattern) {
     return irc->pattern;
 }
 
-const char *irc_topic(irc_t *irc, const char *channel) {
-    irc_channel_t *chan = hashtable_find(irc->channels, channel);
-    return (chan) ? chan->topic : "(No topic)";
+/* A copy the caller frees, TOPIC and RPL_TOPIC replace the original */
+char *irc_topic(irc_t *irc, const char *channel) {
+    irc_shard_lock(irc->shard);
+    irc_channel_t *chan  = hashtable_find(irc->channels, channel);
+    char          *topic = strdup((chan && chan->topic) ? chan->topic : "(No topic)");
+    irc_shard_unlock(irc->shard);
+    return topic;
 }
 
+/*
+ * Names handed to modules are copies owned by the list, the event loop may
+ * free the originals as soon as the shard is unlocked.
+ */
 list_t *irc_users(irc_t *irc, const char *channel) {
+    irc_shard_lock(irc->shard);
     irc_channel_t *chan = hashtable_find(irc->channels, channel);
-    if (!chan) return NULL;
+    if (!chan) {
+        irc_shard_unlock(irc->shard);
+        return NULL;
+    }
 
     list_t *list = list_create();
-    hashtable_foreach(chan->users, list,
-        lambda void(irc_user_t *user, list_t *list)
-            => list_push(list, user->nick);
+    members_foreach(chan->users, list,
+        lambda void(member_t *member, list_t *list)
+            => list_push(list, strdup(member->user->nick));
     );
+    irc_shard_unlock(irc->shard);
+
     list_sort(list,
         lambda bool(const char *a, const char *b)
             => return strcmp(a, b) >= 0;
@@ -997,10 +2697,13 @@ list_t *irc_users(irc_t *irc, const char *channel) {
 
 list_t *irc_channels(irc_t *irc) {
     list_t *list = list_create();
+    irc_shard_lock(irc->shard);
     hashtable_foreach(irc->channels, list,
         lambda void(irc_channel_t *channel, list_t *list)
-            => list_push(list, channel->channel);
+            => list_push(list, strdup(channel->channel));
     );
+    irc_shard_unlock(irc->shard);
+
     list_sort(list,
         lambda bool(const char *a, const char *b)
             => return strcmp(a, b) >= 0;
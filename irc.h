@@ -2,39 +2,149 @@
 #define REDROID_IRC_HDR
 #include <time.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "sock.h"
 #include "list.h"
+#include "vector.h"
 #include "database.h"
 #include "config.h"
 #include "regexpr.h"
 #include "module.h"
 #include "moduleman.h"
 #include "hashtable.h"
+#include "wheel.h"
+#include "intern.h"
+#include "users.h"
+#include "members.h"
 
 #define RPL_WELCOME        1
+#define RPL_ISUPPORT       5
 #define RPL_TOPIC          332
 #define RPL_NAMREPLY       353
+#define RPL_ENDOFNAMES     366
+#define RPL_HOSTHIDDEN     396
 #define RPL_MOTD           372
 #define RPL_ENDOFMOTD      376
 
 #define ERR_NOMOTD         422
 #define ERR_NICKNAMEINUSE  433
 
-#define IRC_FLOOD_LINES    4 /* lines per IRC_FLOOD_INTERVAL */
-#define IRC_FLOOD_INTERVAL 1 /* seconds */
+#define RPL_LOGGEDIN       900
+#define RPL_SASLSUCCESS    903
+#define ERR_SASLFAIL       904
+#define ERR_SASLTOOLONG    905
+#define ERR_SASLABORTED    906
+#define ERR_SASLALREADY    907
+#define RPL_SASLMECHS      908
+
+#define IRC_PREFIXES       "~&@%+"     /* membership prefixes without PREFIX  */
+#define IRC_PREFIXES_MAX   8           /* prefixes kept as bits of a member   */
+
+#define IRC_BUFFER_SIZE    65536       /* receive buffer per connection       */
+#define IRC_LINE_MAX       (8191 + 512) /* IRCv3 message tags + message itself */
+
+#define IRC_QUEUE_QUANTUM  512 /* bytes a target may send per round   */
+#define IRC_TARGETS_MAX    64  /* targets of a line without TARGMAX limit */
+
+#define IRC_CONNECT_TIMEOUT 10000  /* ms the last address may take          */
+#define IRC_REGISTER_TIMEOUT 30000 /* ms until the server has to welcome us  */
+#define IRC_RECONNECT_MIN   5000   /* ms before retrying after all failed    */
+#define IRC_RECONNECT_MAX   300000 /* ms the retry delay doubles up to       */
+
+#define IRC_FLOOD_BURST    4   /* lines sent back to back                */
+#define IRC_FLOOD_RATE     250 /* milliseconds to earn a line back       */
+#define IRC_FLOOD_PENALTY  0   /* bytes which cost another line, 0 = off */
+
+#define IRC_PING_INTERVAL  60  /* seconds between lag probes                */
+#define IRC_PING_MISSED    3   /* unanswered probes before the link is dead */
+
+/*
+ * Round trip times are kept in microseconds in a log-linear histogram like
+ * HDR histograms do. Every power of two is split into IRC_LAG_SUB buckets
+ * so a percentile is off by less than 1/IRC_LAG_SUB, longer times than
+ * IRC_LAG_RANGE bits can hold are clamped.
+ */
+#define IRC_LAG_SUBBITS    4
+#define IRC_LAG_SUB        (1 << IRC_LAG_SUBBITS)
+#define IRC_LAG_RANGE      32
+#define IRC_LAG_BUCKETS    ((IRC_LAG_RANGE - IRC_LAG_SUBBITS + 1) * IRC_LAG_SUB)
 
 typedef struct irc_manager_s irc_manager_t;
+typedef struct irc_shard_s   irc_shard_t;
 
+/*
+ * Outgoing lines are limited by a token bucket of burst lines, a line is
+ * earned back every rate milliseconds. Like the ircd's own flood control
+ * long lines can cost more than one line. Rather than counting tokens the
+ * bucket keeps the time at which it will be full again.
+ */
 typedef struct {
-    char   data[513];
-    size_t offset;
-} irc_buffer_t;
+    uint64_t burst;
+    uint64_t rate;
+    uint64_t penalty;
+    uint64_t full;
+} irc_flood_t;
+
+/*
+ * PINGs carry the time they were sent, the PONG echoes it back. Only the
+ * time of the probe still waiting for its PONG is needed to find probes
+ * which went unanswered.
+ */
+typedef struct {
+    pthread_mutex_t lock;      /* modules read it from other threads */
+    uint32_t        counts[IRC_LAG_BUCKETS];
+    uint64_t        samples;
+    uint64_t        last;      /* latest round trip                  */
+    uint64_t        max;       /* longest round trip                 */
+    uint64_t        sent;      /* probe waiting for its PONG, 0 none */
+    size_t          missed;    /* probes in a row without a PONG     */
+    size_t          threshold; /* missed probes before the link is dead */
+    uint64_t        interval;  /* milliseconds between probes        */
+} irc_lag_t;
 
+/* What is reported of the round trip times, all in microseconds */
 typedef struct {
-    char *nick;
-    char *host;
-} irc_user_t;
+    size_t   samples;
+    size_t   missed;
+    uint64_t last;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t max;
+} irc_lag_stats_t;
+
+/* Outgoing lines are queued by priority class, then by target */
+typedef enum {
+    IRC_PRIORITY_CONTROL,     /* JOIN, PART, QUIT            */
+    IRC_PRIORITY_INTERACTIVE, /* replies to commands         */
+    IRC_PRIORITY_BACKGROUND,  /* output of interval modules  */
+    IRC_PRIORITY_COUNT
+} irc_priority_t;
+
+typedef struct {
+    hashtable_t *lanes;  /* map<irc_lane_t> by target        */
+    vector_t    *active; /* vector<irc_lane_t> in serving order */
+} irc_queue_t;
+
+typedef struct {
+    char   data[IRC_BUFFER_SIZE];
+    size_t length;  /* bytes received but not yet parsed */
+    bool   discard; /* dropping the rest of an over-long line */
+} irc_buffer_t;
+
+/* IRCv3 capabilities the bot makes use of */
+typedef enum {
+    IRC_CAP_MULTI_PREFIX      = 1 << 0,
+    IRC_CAP_USERHOST_IN_NAMES = 1 << 1,
+    IRC_CAP_EXTENDED_JOIN     = 1 << 2,
+    IRC_CAP_AWAY_NOTIFY       = 1 << 3,
+    IRC_CAP_ACCOUNT_NOTIFY    = 1 << 4,
+    IRC_CAP_SERVER_TIME       = 1 << 5,
+    IRC_CAP_SASL              = 1 << 6,
+    IRC_CAP_CHGHOST           = 1 << 7,
+    IRC_CAP_BATCH             = 1 << 8,
+    IRC_CAP_MULTILINE         = 1 << 9
+} irc_cap_t;
 
 typedef struct {
     char        *module;
@@ -42,38 +152,79 @@ typedef struct {
 } irc_module_t;
 
 typedef struct {
-    char *nick;
-    char *host;
-    char *content;
+    char   *nick;
+    char   *host;
+    char   *content;
+    time_t  time;
 } irc_message_t;
 
 typedef struct {
     char          *channel;
     char          *topic;
-    hashtable_t   *users;   /* map<irc_user_t>   */
+    members_t     *users;
     hashtable_t   *modules; /* map<irc_module_t> */
     irc_t         *instance;
     irc_message_t  message;
+    bool           dirty;   /* message not yet dispatched */
+    bool           joining; /* counted in irc->joining */
+    bool           joined;  /* names received after joining */
 } irc_channel_t;
 
 struct irc_s {
     char             *name;
     char             *nick;
+    char             *host;         /* own user@host, NULL until known */
+    size_t            prefixlen;    /* ":nick!user@host " in front of relayed lines */
     char             *pattern;
     char             *auth;
+    char             *sasl;         /* SASL mechanism                  */
+    char             *account;
+    char             *certificate;
     sock_t           *sock;
+    sock_connect_t   *connect;      /* addresses of the network        */
+    dns_query_t      *resolving;    /* lookup of the network in flight */
+    bool              ssl;
     hashtable_t      *channels;     /* map<irc_channel_t> */
-    list_t           *queue;
+    intern_t         *strings;      /* nicks and hosts of channel members */
+    users_t          *users;        /* channel members by nick         */
+    vector_t         *dirty;        /* vector<irc_channel_t> */
+    irc_queue_t       queue[IRC_PRIORITY_COUNT];
+    pthread_mutex_t   queuelock;
+    wheel_timer_t    *flush;
+    wheel_timer_t    *connecting;   /* next connection attempt         */
+    wheel_timer_t    *pinging;      /* next lag probe                  */
+    uint64_t          connectstart; /* wheel_now() of the first attempt */
+    uint64_t          handshaking;  /* wheel_now() the handshake began, 0 when done */
+    uint64_t          backoff;      /* ms until the next retry         */
     module_manager_t *moduleman;
     database_t       *database;
     regexpr_cache_t  *regexprcache;
     irc_manager_t    *manager;
+    irc_shard_t      *shard;
     irc_buffer_t      buffer;
     irc_message_t     message;
     bool              ready;
     bool              syncronized;
     bool              identified;
-    time_t            lastunqueue;
+    bool              loggedin;     /* to services on this connection  */
+    bool              killed;       /* KILLed, dropped after the read  */
+    unsigned int      caps;         /* irc_cap_t enabled               */
+    unsigned int      capsoffered;  /* irc_cap_t offered by the server */
+    time_t            time;         /* time of the line being parsed   */
+    size_t            targmax;      /* PRIVMSG targets per line (TARGMAX) */
+    size_t            joinmax;      /* JOIN targets per line (TARGMAX)    */
+    size_t            chanlimit;    /* channels we may be on (CHANLIMIT)  */
+    char              prefixes[IRC_PREFIXES_MAX + 1]; /* PREFIX symbols, highest first */
+    size_t            joining;      /* channels being joined             */
+    size_t            joined;       /* of those, joined so far           */
+    uint64_t          joinstart;    /* wheel_now() when joining started  */
+    size_t            multibytes;   /* draft/multiline max-bytes        */
+    size_t            multilines;   /* draft/multiline max-lines        */
+    size_t            batches;      /* batch references handed out      */
+    irc_flood_t       flood;
+    irc_lag_t         lag;
+    size_t            dispatched;   /* always module dispatches         */
+    size_t            skipped;      /* channel dispatches without news  */
 };
 
 typedef enum {
@@ -88,11 +239,15 @@ typedef struct irc_s irc_t;
 
 irc_t *irc_create(config_instance_t *config);
 void  irc_destroy(irc_t *irc, sock_restart_t *restart, char **name);
-void irc_process(irc_t *irc, void *data);
+bool irc_process(irc_t *irc, void *data);
 const char *irc_name(irc_t *irc);
 const char *irc_nick(irc_t *irc);
 
 bool irc_connect(irc_t *irc, const char *host, const char *port, bool ssl);
+bool irc_connected(irc_t *irc);
+int irc_handshake(irc_t *irc);
+void irc_disconnect(irc_t *irc);
+bool irc_ping(irc_t *irc);
 bool irc_reinstate(irc_t *irc, const char *host, const char *port, sock_restart_t *restart);
 
 list_t *irc_users(irc_t *irc, const char *chan);
@@ -117,7 +272,9 @@ void irc_action(irc_t *irc, const char *channel, const char *fmt, ...);
 void irc_unqueue(irc_t *irc);
 void irc_join(irc_t *irc, const char *channel);
 void irc_part(irc_t *irc, const char *channel);
-const char *irc_topic(irc_t *irc, const char *channel);
+char *irc_topic(irc_t *irc, const char *channel);
 const char *irc_pattern(irc_t *irc, const char *newpattern);
+void irc_dispatch_stats(irc_t *irc, size_t *dispatched, size_t *skipped);
+void irc_lag_stats(irc_t *irc, irc_lag_stats_t *stats);
 
 #endif
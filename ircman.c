@@ -1,14 +1,21 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
 
-#include <unistd.h> /* pipe, close, write, read */
-#include <fcntl.h>  /* fcntl, F_GETGL, F_SETFL */
-#include <poll.h>   /* poll, POLLIN, POLLOUT */
+#include <unistd.h>    /* pipe, close, write, read */
+#include <pthread.h>   /* pthread_create, pthread_join, pthread_mutex_t */
+#include <sys/epoll.h> /* epoll_create1, epoll_ctl, epoll_wait */
 
 #include "list.h"
 #include "ircman.h"
 #include "command.h"
-#include "access.h"
+#include "wheel.h"
+#include "dns.h"
+
+/* Maximum amount of readiness events to handle per wakeup */
+#define IRC_MANAGER_EVENTS 64
 
 typedef struct {
     irc_t **data;
@@ -16,13 +23,32 @@ typedef struct {
     size_t  reserved;
 } irc_instances_t;
 
-struct irc_manager_s {
+/*
+ * A shard is one event loop thread and the instances it owns. Everything an
+ * instance touches while processing (its socket, outbound queue and channel
+ * state) is only ever touched from the thread of the shard owning it, so
+ * a busy network only adds latency to the instances sharing its shard.
+ */
+struct irc_shard_s {
+    irc_manager_t   *manager;
     irc_instances_t *instances;
     cmd_channel_t   *commander;
-    struct pollfd   *polls;
+    wheel_t         *wheel;
+    dns_t           *dns;
+    pthread_mutex_t  mutex;
+    pthread_t        thread;
+    bool             threaded;
+    int              epollfd;
     int              wakefds[2];
 };
 
+struct irc_manager_s {
+    irc_shard_t   *shards;
+    size_t         count;
+    bool           staged;
+    volatile bool  quit;
+};
+
 static irc_instances_t *irc_instances_create(void) {
     irc_instances_t *instances = malloc(sizeof(*instances));
 
@@ -42,7 +68,24 @@ static list_t *irc_instances_destroy(irc_instances_t *instances, bool restart) {
             continue;
         }
 
-        if (restart) {
+        /*
+         * The TLS session state can't be handed to the new process, the
+         * socket would be in the middle of a stream nobody can decrypt.
+         * Secure instances are closed and connect again after the restart.
+         */
+        if (restart && instances->data[i]->ssl) {
+            irc_manager_restart_t *restdata = malloc(sizeof(*restdata));
+            char                  *restname = NULL;
+
+            irc_destroy(instances->data[i], NULL, &restname);
+
+            restdata->fd   = -1;
+            restdata->name = restname;
+            restdata->ssl  = true;
+            restdata->size = 0;
+            restdata->data = NULL;
+            list_push(list, restdata);
+        } else if (restart) {
             irc_manager_restart_t *restdata = malloc(sizeof(*restdata));
             char                  *restname = NULL;
             sock_restart_t         restinfo;
@@ -82,76 +125,546 @@ static irc_t *irc_instances_find(irc_instances_t *instances, const char *name) {
     return NULL;
 }
 
-static bool irc_manager_stage(irc_manager_t *manager) {
-    if (!(manager->polls = malloc(sizeof(struct pollfd) * (manager->instances->size + 1))))
-        return false;
+static bool irc_instances_remove(irc_instances_t *instances, irc_t *instance) {
+    for (size_t i = 0; i < instances->size; i++) {
+        if (instances->data[i] != instance)
+            continue;
+        /* Order of instances doesn't matter, move the last one in its place */
+        instances->data[i] = instances->data[--instances->size];
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Instances are registered edge-triggered with the instance itself as the
+ * event data. This way readiness is delivered per instance and nothing needs
+ * to be rebuilt when instances come and go. Being edge-triggered, writability
+ * is only reported after the kernel buffer was full, which is exactly when
+ * buffered output is left to flush.
+ */
+static bool irc_shard_watchfd(irc_shard_t *shard, irc_t *instance, int fd) {
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET,
+        .data.ptr = instance
+    };
+    return epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
 
-    if (pipe(manager->wakefds) == -1) {
-        free(manager->polls);
+/*
+ * Instances still connecting have no socket yet, their connection attempts
+ * are watched as they are started instead. The attempt which wins the race
+ * keeps its registration when it becomes the socket of the instance while
+ * the losing ones drop out of the set when they're closed.
+ */
+static bool irc_shard_watch(irc_shard_t *shard, irc_t *instance) {
+    if (!instance->sock)
+        return true;
+    return irc_shard_watchfd(shard, instance, sock_getfd(instance->sock));
+}
+
+static void irc_shard_unwatch(irc_shard_t *shard, irc_t *instance) {
+    if (!instance->sock)
+        return;
+    /* Kernels before 2.6.9 require a non-NULL event even for EPOLL_CTL_DEL */
+    struct epoll_event event;
+    epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, sock_getfd(instance->sock), &event);
+}
+
+static void irc_shard_create(irc_shard_t *shard, irc_manager_t *manager) {
+    shard->manager    = manager;
+    shard->instances  = irc_instances_create();
+    shard->commander  = cmd_channel_create();
+    shard->wheel      = wheel_create();
+    shard->dns        = NULL;
+    shard->threaded   = false;
+    shard->epollfd    = -1;
+    shard->wakefds[0] = -1;
+    shard->wakefds[1] = -1;
+
+    pthread_mutex_init(&shard->mutex, NULL);
+}
+
+static bool irc_shard_stage(irc_shard_t *shard) {
+    if ((shard->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
         return false;
-    }
 
-    /* Only the read end */
-    manager->polls[0].fd     = manager->wakefds[0];
-    manager->polls[0].events = POLLIN | POLLPRI;
+    if (pipe(shard->wakefds) == -1)
+        goto self_pipe_error_epoll;
 
     /*
      * The read and write ends of the pipe need to be non blocking otherwise
      * the signal handler could deadlock if we get N signals (where N is
      * the size of the pipe buffer) before poll gets called.
      */
-    int flags = fcntl(manager->wakefds[0], F_GETFL);
-    if (flags == -1)
+    if (!sock_nonblock(shard->wakefds[0]) || !sock_nonblock(shard->wakefds[1]))
         goto self_pipe_error;
-    flags |= O_NONBLOCK;
-    if (fcntl(manager->wakefds[0], F_SETFL, flags) == -1)
+
+    /* Only the read end, the wake pipe is the only event without an instance */
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLPRI,
+        .data.ptr = NULL
+    };
+    if (epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->wakefds[0], &event) == -1)
         goto self_pipe_error;
 
-    flags = fcntl(manager->wakefds[1], F_GETFL);
-    if (flags == -1)
+    /* Answers for the resolver are told apart by the resolver being the data */
+    if (!(shard->dns = dns_create(shard->wheel)))
         goto self_pipe_error;
-    flags |= O_NONBLOCK;
-    if (fcntl(manager->wakefds[1], F_SETFL, flags) == -1)
+    event.events   = EPOLLIN | EPOLLET;
+    event.data.ptr = shard->dns;
+    if (epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, dns_getfd(shard->dns), &event) == -1)
         goto self_pipe_error;
 
-    for (size_t i = 0; i < manager->instances->size; i++) {
-        manager->polls[1+i].fd     = sock_getfd(manager->instances->data[i]->sock);
-        manager->polls[1+i].events = POLLIN | POLLPRI;
-    }
+    for (size_t i = 0; i < shard->instances->size; i++)
+        if (!irc_shard_watch(shard, shard->instances->data[i]))
+            goto self_pipe_error;
+
+    /* A command timing out wakes the event loop to be stopped there */
+    cmd_channel_notify(shard->commander, shard->wakefds[1]);
 
     /* Begin the command message channel if it isn't already ready */
-    if (!cmd_channel_ready(manager->commander))
-        cmd_channel_begin(manager->commander);
+    if (!cmd_channel_ready(shard->commander))
+        cmd_channel_begin(shard->commander);
 
     return true;
 
 self_pipe_error:
-    free(manager->polls);
-    close(manager->wakefds[0]);
-    close(manager->wakefds[1]);
-    free(manager->polls);
+    dns_destroy(shard->dns);
+    shard->dns = NULL;
+    close(shard->wakefds[0]);
+    close(shard->wakefds[1]);
+    shard->wakefds[0] = -1;
+    shard->wakefds[1] = -1;
+
+self_pipe_error_epoll:
+    close(shard->epollfd);
+    shard->epollfd = -1;
 
     return false;
 }
 
-static void irc_manager_cleanup(irc_manager_t *manager) {
-    cmd_channel_destroy(manager->commander);
-    irc_instances_destroy(manager->instances, false);
+static void irc_shard_unstage(irc_shard_t *shard) {
+    dns_destroy(shard->dns);
+    if (shard->epollfd != -1)
+        close(shard->epollfd);
+    if (shard->wakefds[0] != -1)
+        close(shard->wakefds[0]);
+    if (shard->wakefds[1] != -1)
+        close(shard->wakefds[1]);
+}
 
-    free(manager->polls);
-    free(manager);
+static list_t *irc_shard_destroy(irc_shard_t *shard, bool restart) {
+    cmd_channel_destroy(shard->commander);
+    list_t *list = irc_instances_destroy(shard->instances, restart);
+    irc_shard_unstage(shard);
+    wheel_destroy(shard->wheel);
+    pthread_mutex_destroy(&shard->mutex);
+    return list;
+}
+
+cmd_channel_t *irc_shard_commander(irc_shard_t *shard) {
+    return shard->commander;
+}
+
+dns_t *irc_shard_resolver(irc_shard_t *shard) {
+    return shard->dns;
 }
 
-irc_manager_t *irc_manager_create(void) {
+void irc_shard_wake(irc_shard_t *shard) {
+    if (shard)
+        write(shard->wakefds[1], "wakeup", 6);
+}
+
+/*
+ * Module threads change an instance with its shard locked so they're
+ * serialized with the event loop. A command isn't stopped for timing out
+ * while it holds the lock, nothing would ever release it.
+ */
+void irc_shard_lock(irc_shard_t *shard) {
+    if (!shard)
+        return;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pthread_mutex_lock(&shard->mutex);
+}
+
+void irc_shard_unlock(irc_shard_t *shard) {
+    if (!shard)
+        return;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+typedef struct {
+    cmd_channel_t *commander;
+    module_t      *module;
+} irc_manager_foreach_t;
+
+/* Timer callbacks, both run on the event loop of the shard */
+static void irc_shard_flush(wheel_timer_t *timer, irc_t *instance) {
+    (void)timer;
+    irc_unqueue(instance);
+}
+
+/* Every address failed, start over again later */
+static void irc_shard_disconnected(irc_t *instance) {
+    sock_connect_reset(instance->connect);
+    printf("    irc      => %s cannot connect, retrying in %" PRIu64 "s\n", instance->name, instance->backoff / 1000);
+
+    wheel_timer_schedule(instance->connecting, instance->backoff);
+    instance->connectstart = 0;
+    instance->backoff      = (instance->backoff * 2 > IRC_RECONNECT_MAX)
+                                 ? IRC_RECONNECT_MAX
+                                 : instance->backoff * 2;
+}
+
+/*
+ * Starts the next connection attempt while the earlier ones are still in
+ * flight. Once all addresses were tried the last attempts are given until
+ * IRC_CONNECT_TIMEOUT to complete.
+ */
+static void irc_shard_attempt(irc_t *instance) {
+    int fd;
+    while ((fd = sock_connect_attempt(instance->connect)) != -1) {
+        if (irc_shard_watchfd(instance->shard, instance, fd)) {
+            wheel_timer_schedule(instance->connecting, SOCK_CONNECT_DELAY);
+            return;
+        }
+    }
+
+    uint64_t elapsed = wheel_now() - instance->connectstart;
+    if (sock_connect_poll(instance->connect) == SOCK_CONNECT_PENDING && elapsed < IRC_CONNECT_TIMEOUT) {
+        wheel_timer_schedule(instance->connecting, IRC_CONNECT_TIMEOUT - elapsed);
+        return;
+    }
+
+    irc_shard_disconnected(instance);
+}
+
+static void irc_shard_resolved(const dns_address_t *addresses, size_t count, irc_t *instance) {
+    instance->resolving = NULL;
+    if (count == 0) {
+        printf("    irc      => %s cannot resolve %s\n", instance->name, sock_connect_host(instance->connect));
+        irc_shard_disconnected(instance);
+        return;
+    }
+
+    sock_connect_resolved(instance->connect, addresses, count);
+    irc_shard_attempt(instance);
+}
+
+/*
+ * Every round of attempts starts with resolving the network again. With a
+ * connection the timer is the deadline of its handshake and registration
+ * instead.
+ */
+static void irc_shard_connect(wheel_timer_t *timer, irc_t *instance) {
+    (void)timer;
+    if (instance->sock) {
+        printf("    irc      => %s %s timed out\n", instance->name, instance->handshaking ? "handshake" : "registration");
+        irc_disconnect(instance);
+        irc_shard_disconnected(instance);
+        return;
+    }
+
+    if (instance->connectstart != 0) {
+        irc_shard_attempt(instance);
+        return;
+    }
+
+    instance->connectstart = wheel_now();
+    instance->resolving    = dns_resolve(instance->shard->dns, sock_connect_host(instance->connect),
+                                 (dns_callback_t)&irc_shard_resolved, instance);
+}
+
+/* A dead link is dropped and connected again right away */
+static void irc_shard_ping(wheel_timer_t *timer, irc_t *instance) {
+    wheel_timer_schedule(timer, instance->lag.interval);
+    if (irc_ping(instance))
+        return;
+
+    printf("    irc      => %s link is dead, %zu PINGs unanswered\n", instance->name, instance->lag.missed);
+    irc_disconnect(instance);
+    wheel_timer_schedule(instance->connecting, 0);
+}
+
+/*
+ * The server closed the link. Before registration that's a refusal which
+ * is retried later, a registered instance connects again right away.
+ */
+static void irc_shard_closed(irc_t *instance) {
+    bool ready = instance->ready;
+    printf("    irc      => %s connection closed\n", instance->name);
+
+    irc_disconnect(instance);
+    if (ready)
+        wheel_timer_schedule(instance->connecting, 0);
+    else
+        irc_shard_disconnected(instance);
+}
+
+/* Readiness of an instance with a connection which is still handshaking */
+static void irc_shard_handshake(irc_t *instance, cmd_channel_t *commander) {
+    switch (irc_handshake(instance)) {
+        case 0:
+            return;
+
+        case -1:
+            irc_disconnect(instance);
+            irc_shard_disconnected(instance);
+            return;
+    }
+
+    /* Registration and anything queued before the connection */
+    wheel_timer_schedule(instance->connecting, IRC_REGISTER_TIMEOUT);
+    if (!irc_process(instance, commander)) {
+        irc_shard_closed(instance);
+        return;
+    }
+    wheel_timer_schedule(instance->flush, 0);
+}
+
+/* Readiness of an instance which is still connecting */
+static void irc_shard_connecting(irc_t *instance, cmd_channel_t *commander) {
+    switch (sock_connect_poll(instance->connect)) {
+        case SOCK_CONNECT_PENDING:
+            return;
+
+        case SOCK_CONNECT_IDLE:
+            /* The attempts in flight failed, don't wait to try the next address */
+            if (instance->connectstart != 0 && !instance->resolving)
+                irc_shard_attempt(instance);
+            return;
+
+        case SOCK_CONNECT_ESTABLISHED:
+            if (!irc_connected(instance)) {
+                irc_shard_disconnected(instance);
+                return;
+            }
+            wheel_timer_schedule(instance->connecting, IRC_CONNECT_TIMEOUT);
+            irc_shard_handshake(instance, commander);
+            return;
+    }
+}
+
+static void irc_shard_interval(wheel_timer_t *timer, module_t *module) {
+    irc_t *instance = module->instance;
+
+    /* Not ready for commands yet, check back shortly */
+    if (!instance->syncronized) {
+        wheel_timer_schedule(timer, 1000);
+        return;
+    }
+
+    /* Interval modules run on all channels */
+    hashtable_foreach(instance->channels,
+        &((irc_manager_foreach_t) {
+            .commander = instance->shard->commander,
+            .module    = module
+        }),
+        lambda void(irc_channel_t *channel, irc_manager_foreach_t *foreach)
+            => cmd_channel_push(foreach->commander,
+                   cmd_entry_create(foreach->commander, foreach->module, channel->channel,
+                       channel->message.nick, channel->message.content));
+    );
+
+    wheel_timer_schedule(timer, (uint64_t)module->interval * 1000);
+}
+
+void irc_manager_schedule(irc_t *instance, module_t *module) {
+    irc_shard_t *shard = instance->shard;
+    if (!shard || !module)
+        return;
+
+    if (*module->match != '\0' || module->interval == 0) {
+        wheel_timer_destroy(module->timer);
+        module->timer = NULL;
+        return;
+    }
+
+    /* The first tick happens right away like it always has */
+    if (!module->timer)
+        module->timer = wheel_timer_create(shard->wheel, (wheel_callback_t)&irc_shard_interval, module);
+    wheel_timer_schedule(module->timer, 0);
+    irc_shard_wake(shard);
+}
+
+/*
+ * Lookups for modules go through the resolver of the shard owning the
+ * instance. The callback is called on the event loop of the shard, or right
+ * away with the shard locked when the answer is already known.
+ */
+bool irc_manager_resolve(irc_t *instance, const char *name, dns_callback_t callback, void *data) {
+    irc_shard_t *shard = instance->shard;
+    if (!shard || !shard->dns)
+        return false;
+
+    irc_shard_lock(shard);
+    dns_resolve(shard->dns, name, callback, data);
+    irc_shard_unlock(shard);
+
+    /* The retransmission timer may now be the earliest */
+    irc_shard_wake(shard);
+    return true;
+}
+
+/* Timers of an instance belong to the wheel of the shard owning it */
+static void irc_shard_schedule(irc_shard_t *shard, irc_t *instance) {
+    instance->flush = wheel_timer_create(shard->wheel, (wheel_callback_t)&irc_shard_flush, instance);
+    wheel_timer_schedule(instance->flush, 0);
+
+    /* Restarted instances kept their connection */
+    instance->connecting = wheel_timer_create(shard->wheel, (wheel_callback_t)&irc_shard_connect, instance);
+    if (!instance->sock)
+        wheel_timer_schedule(instance->connecting, 0);
+
+    instance->pinging = wheel_timer_create(shard->wheel, (wheel_callback_t)&irc_shard_ping, instance);
+    wheel_timer_schedule(instance->pinging, instance->lag.interval);
+
+    vector_foreach(instance->moduleman->modules, instance,
+        lambda void(module_t *module, irc_t *instance)
+            => irc_manager_schedule(instance, module);
+    );
+}
+
+static void irc_shard_unschedule(irc_t *instance) {
+    wheel_timer_destroy(instance->flush);
+    wheel_timer_destroy(instance->connecting);
+    wheel_timer_destroy(instance->pinging);
+    dns_cancel(instance->resolving);
+    instance->flush      = NULL;
+    instance->connecting = NULL;
+    instance->pinging    = NULL;
+    instance->resolving  = NULL;
+
+    vector_foreach(instance->moduleman->modules,
+        lambda void(module_t *module) {
+            wheel_timer_destroy(module->timer);
+            module->timer = NULL;
+        }
+    );
+}
+
+static void irc_shard_process(irc_shard_t *shard) {
+    struct epoll_event events[IRC_MANAGER_EVENTS];
+
+    /* Sleep until there is something to read or the next timer is due */
+    int wait = epoll_wait(shard->epollfd, events, IRC_MANAGER_EVENTS, wheel_timeout(shard->wheel));
+    /*
+     * A command which timed out is stopped here and not under the lock, the
+     * command thread may be waiting on it when it's joined.
+     */
+    cmd_channel_timeout(shard->commander);
+
+    if (wait == -1)
+        return;
+
+    /*
+     * The lock is only held while processing so other threads can find
+     * and broadcast to instances of this shard while it sleeps.
+     */
+    pthread_mutex_lock(&shard->mutex);
+
+    /* Only the instances which are ready are touched */
+    for (int i = 0; i < wait; i++) {
+        irc_t *instance = events[i].data.ptr;
+
+        /*
+         * If we don't drain the pipe then we'll continue to have an event
+         * on it
+         */
+        if (!instance) {
+            char buffer[64];
+            while (read(shard->wakefds[0], buffer, sizeof(buffer)) == sizeof(buffer))
+                ;
+            continue;
+        }
+
+        if ((void *)instance == (void *)shard->dns) {
+            dns_process(shard->dns);
+            continue;
+        }
+
+        if (!instance->sock)
+            irc_shard_connecting(instance, shard->commander);
+        else if (instance->handshaking)
+            irc_shard_handshake(instance, shard->commander);
+        else if (!irc_process(instance, shard->commander))
+            irc_shard_closed(instance);
+    }
+
+    /* Interval module ticks and flood queue flushes */
+    wheel_advance(shard->wheel);
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void *irc_shard_threader(void *data) {
+    irc_shard_t *shard = data;
+    while (!shard->manager->quit)
+        irc_shard_process(shard);
+    return NULL;
+}
+
+/*
+ * The first shard is always processed by whoever calls irc_manager_process,
+ * the rest get an event loop thread of their own.
+ */
+static bool irc_manager_stage(irc_manager_t *manager) {
+    for (size_t i = 0; i < manager->count; i++)
+        if (!irc_shard_stage(&manager->shards[i]))
+            return false;
+
+    for (size_t i = 1; i < manager->count; i++) {
+        irc_shard_t *shard = &manager->shards[i];
+        if (pthread_create(&shard->thread, NULL, &irc_shard_threader, shard) != 0)
+            return false;
+        shard->threaded = true;
+    }
+
+    printf("    shards   => %zu running\n", manager->count);
+    return manager->staged = true;
+}
+
+static void irc_manager_stop(irc_manager_t *manager) {
+    manager->quit = true;
+    irc_manager_wake(manager);
+
+    for (size_t i = 1; i < manager->count; i++) {
+        irc_shard_t *shard = &manager->shards[i];
+        if (!shard->threaded)
+            continue;
+        pthread_join(shard->thread, NULL);
+        shard->threaded = false;
+    }
+}
+
+irc_manager_t *irc_manager_create(size_t threads, const char *nameserver) {
+    /* The resolvers of the shards share their cache */
+    if (!dns_init(nameserver))
+        return NULL;
+
     irc_manager_t *man = malloc(sizeof(*man));
-    if (!man)
+    if (!man) {
+        dns_deinit();
         return NULL;
+    }
+
+    man->count  = threads ? threads : 1;
+    man->shards = malloc(sizeof(irc_shard_t) * man->count);
+    man->staged = false;
+    man->quit   = false;
 
-    man->instances  = irc_instances_create();
-    man->commander  = cmd_channel_create();
-    man->polls      = NULL;
-    man->wakefds[0] = -1;
-    man->wakefds[1] = -1;
+    for (size_t i = 0; i < man->count; i++)
+        irc_shard_create(&man->shards[i], man);
 
     return man;
 }
@@ -168,140 +681,139 @@ void irc_manager_broadcast(irc_manager_t *manager, const char *message, ...) {
     va_start(va, message);
     string_vcatf(string, message, va);
 
-    for (size_t i = 0; i < manager->instances->size; i++) {
-        irc_t *irc = manager->instances->data[i];
-        hashtable_foreach(irc->channels,
-            &((irc_manager_broadcast_t) {
-                .instance = irc,
-                .message  = string
-            }),
-            lambda void(irc_channel_t *channel, irc_manager_broadcast_t *caster)
-                => irc_write(caster->instance, channel->channel, string_contents(caster->message));
-        );
+    for (size_t i = 0; i < manager->count; i++) {
+        irc_shard_t *shard = &manager->shards[i];
+        irc_shard_lock(shard);
+        for (size_t j = 0; j < shard->instances->size; j++) {
+            irc_t *irc = shard->instances->data[j];
+            hashtable_foreach(irc->channels,
+                &((irc_manager_broadcast_t) {
+                    .instance = irc,
+                    .message  = string
+                }),
+                lambda void(irc_channel_t *channel, irc_manager_broadcast_t *caster)
+                    => irc_write(caster->instance, channel->channel, "%s", string_contents(caster->message));
+            );
+        }
+        irc_shard_unlock(shard);
+        irc_shard_wake(shard);
     }
 
     va_end(va);
     string_destroy(string);
 }
 
+/* Instances are visited with their shard locked */
+void irc_manager_foreach(irc_manager_t *manager, void *pass, void *callback) {
+    void (*visit)(irc_t *, void *) = callback;
+    for (size_t i = 0; i < manager->count; i++) {
+        irc_shard_t *shard = &manager->shards[i];
+        irc_shard_lock(shard);
+        for (size_t j = 0; j < shard->instances->size; j++)
+            visit(shard->instances->data[j], pass);
+        irc_shard_unlock(shard);
+    }
+}
+
 void irc_manager_wake(irc_manager_t *manager) {
-    write(manager->wakefds[1], "wakeup", 6);
+    for (size_t i = 0; i < manager->count; i++)
+        irc_shard_wake(&manager->shards[i]);
 }
 
 void irc_manager_destroy(irc_manager_t *manager) {
-    irc_manager_wake(manager);
-    irc_manager_cleanup(manager);
+    irc_manager_stop(manager);
+    for (size_t i = 0; i < manager->count; i++)
+        irc_shard_destroy(&manager->shards[i], false);
+
+    free(manager->shards);
+    free(manager);
+    dns_deinit();
 }
 
 list_t *irc_manager_restart(irc_manager_t *manager) {
-    irc_manager_wake(manager);
-    cmd_channel_destroy(manager->commander);
-    list_t *list = irc_instances_destroy(manager->instances, true);
-
-    if (manager->polls)
-        free(manager->polls);
+    irc_manager_stop(manager);
+
+    list_t *list = list_create();
+    for (size_t i = 0; i < manager->count; i++) {
+        list_t                *restart = irc_shard_destroy(&manager->shards[i], true);
+        irc_manager_restart_t *data;
+        while ((data = list_shift(restart)))
+            list_push(list, data);
+        list_destroy(restart);
+    }
 
+    free(manager->shards);
     free(manager);
+    dns_deinit();
     return list;
 }
 
-typedef struct {
-    irc_manager_t *manager;
-    module_t      *module;
-    irc_t         *instance;
-    cmd_entry_t *(*make)(cmd_channel_t *, const char *, module_t *, irc_message_t *);
-} irc_manager_foreach_t;
-
 void irc_manager_process(irc_manager_t *manager) {
-    if (!cmd_channel_ready(manager->commander)) {
+    if (!manager->staged) {
         if (!irc_manager_stage(manager))
             abort();
         return;
     }
 
-    /*
-     * Unqueue anything left and calculate the shortest poll timeout for interval
-     * modules.
-     */
-    unsigned int ts = ~0u;
-    for (size_t i = 0; i < manager->instances->size; i++) {
-        irc_t *instance = manager->instances->data[i];
-        irc_unqueue(instance);
-        unsigned int timeout = module_manager_timeout(instance->moduleman);
-        if (timeout < ts)
-            ts = timeout;
-    }
-
-    int wait = poll(manager->polls, manager->instances->size + 1, ts != ~0u ? (int)(ts * 1000) : -1);
-    if (wait == -1)
-        return;
+    irc_shard_process(&manager->shards[0]);
+}
 
-    /*
-     * If we don't drain the pipe then we'll continue to have an event
-     * on it
-     */
-    if (manager->polls[0].revents & POLLIN) {
-        char buffer[6];
-        read(manager->wakefds[0], buffer, sizeof(buffer));
+irc_t *irc_manager_find(irc_manager_t *manager, const char *name) {
+    for (size_t i = 0; i < manager->count; i++) {
+        irc_shard_t *shard = &manager->shards[i];
+        irc_shard_lock(shard);
+        irc_t *find = irc_instances_find(shard->instances, name);
+        irc_shard_unlock(shard);
+        if (find)
+            return find;
     }
+    return NULL;
+}
 
-    for (size_t i = 0; i < manager->instances->size; i++) {
-        irc_t *instance = manager->instances->data[i];
-        if (manager->polls[1+i].revents & (POLLIN | POLLOUT))
-            irc_process(instance, manager->commander);
+void irc_manager_add(irc_manager_t *manager, irc_t *instance) {
+    /* New instances go to the shard with the least amount of instances */
+    irc_shard_t *shard = &manager->shards[0];
+    for (size_t i = 1; i < manager->count; i++)
+        if (manager->shards[i].instances->size < shard->instances->size)
+            shard = &manager->shards[i];
 
-        if (!instance->syncronized)
-            continue;
+    irc_shard_lock(shard);
+    instance->manager = manager;
+    instance->shard   = shard;
+    irc_instances_push(shard->instances, instance);
+    irc_shard_schedule(shard, instance);
+
+    /* Instances added after staging are watched right away */
+    if (shard->epollfd != -1)
+        irc_shard_watch(shard, instance);
+    irc_shard_unlock(shard);
+}
 
-        list_foreach(instance->moduleman->modules,
-            &((irc_manager_foreach_t) {
-                .manager  = manager,
-                .instance = instance
-            }),
-            lambda void(module_t *module, irc_manager_foreach_t *foreach) {
-                if (*module->match != '\0')
-                    return;
-
-                cmd_entry_t *(*make)(cmd_channel_t *, const char *, module_t *, irc_message_t *) =
-                    lambda cmd_entry_t *(cmd_channel_t *channel, const char *chan, module_t *module, irc_message_t *message)
-                        => return cmd_entry_create(channel, module, chan, message->nick, message->content);;
-
-                foreach->module = module;
-                foreach->make   = make;
-
-                /* We must broadcast these on all channels */
-                hashtable_foreach(foreach->instance->channels, foreach,
-                    lambda void(irc_channel_t *channel, irc_manager_foreach_t *foreach) {
-                        if (access_ignore(channel->instance, channel->message.nick))
-                            return;
-                        if (foreach->module->interval == 0) {
-                            cmd_channel_push(foreach->manager->commander,
-                                foreach->make(foreach->manager->commander, channel->channel, foreach->module, &channel->message));
-                            /* Always modules need clearing, interval ones don't */
-                            irc_message_clear(&channel->message);
-                        } else if (difftime(time(0), foreach->module->lastinterval) >= foreach->module->interval) {
-                            foreach->module->lastinterval = time(0);
-                            cmd_channel_push(foreach->manager->commander,
-                                foreach->make(foreach->manager->commander, channel->channel, foreach->module, &channel->message));
-                        }
-                    }
-                );
-            }
-        );
+bool irc_manager_remove(irc_manager_t *manager, irc_t *instance) {
+    irc_shard_t *shard = instance->shard;
+    if (!shard || shard->manager != manager)
+        return false;
 
-        irc_message_clear(&instance->message);
+    irc_shard_lock(shard);
+    bool removed = irc_instances_remove(shard->instances, instance);
+    if (removed) {
+        irc_shard_unschedule(instance);
+        if (shard->epollfd != -1)
+            irc_shard_unwatch(shard, instance);
     }
-}
+    irc_shard_unlock(shard);
 
-irc_t *irc_manager_find(irc_manager_t *manager, const char *name) {
-    return irc_instances_find(manager->instances, name);
-}
+    if (!removed)
+        return false;
 
-void irc_manager_add(irc_manager_t *manager, irc_t *instance) {
-    instance->manager = manager;
-    irc_instances_push(manager->instances, instance);
+    instance->manager = NULL;
+    instance->shard   = NULL;
+    return true;
 }
 
 bool irc_manager_empty(irc_manager_t *manager) {
-    return manager->instances->size == 0;
+    for (size_t i = 0; i < manager->count; i++)
+        if (manager->shards[i].instances->size != 0)
+            return false;
+    return true;
 }
@@ -4,14 +4,17 @@
 #include <stddef.h>
 
 #include "list.h"
-typedef struct irc_s irc_t;
+#include "dns.h"
+typedef struct irc_s         irc_t;
+typedef struct module_s      module_t;
+typedef struct cmd_channel_s cmd_channel_t;
 /*
  * Type: irc_manager_restart_t
  *  Structure of information to hold restart state for a single IRC
  *  instance.
  */
 typedef struct {
-    int            fd;   /* Socket        */
+    int            fd;   /* Socket, -1 to connect again */
     char          *name; /* Instance name */
     bool           ssl;  /* SSL/TLS?      */
     size_t         size; /* Data size     */
@@ -19,15 +22,25 @@ typedef struct {
 } irc_manager_restart_t;
 
 typedef struct irc_manager_s irc_manager_t;
+typedef struct irc_shard_s   irc_shard_t;
 
-irc_manager_t *irc_manager_create(void);
+irc_manager_t *irc_manager_create(size_t threads, const char *nameserver);
 void irc_manager_destroy(irc_manager_t *manager);
 irc_t *irc_manager_find(irc_manager_t *manager, const char *name);
 void irc_manager_process(irc_manager_t *manager);
 void irc_manager_add(irc_manager_t *manager, irc_t *instance);
+bool irc_manager_remove(irc_manager_t *manager, irc_t *instance);
 bool irc_manager_empty(irc_manager_t *manager);
 list_t *irc_manager_restart(irc_manager_t *manager);
 void irc_manager_wake(irc_manager_t *manager);
 void irc_manager_broadcast(irc_manager_t *manager, const char *message, ...);
+void irc_manager_foreach(irc_manager_t *manager, void *pass, void *callback);
+void irc_manager_schedule(irc_t *instance, module_t *module);
+bool irc_manager_resolve(irc_t *instance, const char *name, dns_callback_t callback, void *data);
+void irc_shard_wake(irc_shard_t *shard);
+void irc_shard_lock(irc_shard_t *shard);
+void irc_shard_unlock(irc_shard_t *shard);
+cmd_channel_t *irc_shard_commander(irc_shard_t *shard);
+dns_t *irc_shard_resolver(irc_shard_t *shard);
 
 #endif
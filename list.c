@@ -142,7 +142,10 @@ void list_push(list_t *list, void *element) {
 void list_prepend(list_t *list, void *element) {
     list_node_t *node = list_node_create(element);
     node->next = list->head;
-    node->prev = list->tail;
+    if (list->head)
+        list->head->prev = node;
+    else
+        list->tail = node;
     list->head = node;
     list->atcache.headdirt++;
     list->length++;
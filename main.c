@@ -368,7 +368,10 @@ int main(int argc, char **argv) {
     signal_install();
     srand(time(0));
 
-    if (!(manager = irc_manager_create())) {
+    char *nameserver = config_nameserver("config.ini");
+    manager = irc_manager_create(config_threads("config.ini"), nameserver);
+    free(nameserver);
+    if (!manager) {
         fprintf(stderr, "failed creating irc manager\n");
         return EXIT_FAILURE;
     }
@@ -448,7 +451,6 @@ int main(int argc, char **argv) {
             read(tmpfd, &sock, sizeof(int)); /* Get socket */
 
             name = list_at(list, i);
-            printf("    Network %s on socket %d will be restored\n", string_contents(name), sock);
 
             /* Find configuration for that instance */
             config_instance_t *instance = config_instance_find(config, string_contents(name));
@@ -465,9 +467,24 @@ int main(int argc, char **argv) {
                     => irc_channels_add(instance, channel);
             );
 
+            /* Secure instances weren't carried over, they connect again */
+            if (sock == -1) {
+                printf("    Network %s will connect again\n", string_contents(name));
+                if (irc_connect(irc, instance->host, instance->port, instance->ssl)) {
+                    irc_manager_add(manager, irc);
+                } else {
+                    irc_destroy(irc, NULL, NULL);
+                    fprintf(stderr, "    irc      => cannot connect (ignoring instance)\n");
+                }
+                string_destroy(name);
+                continue;
+            }
+
+            printf("    Network %s on socket %d will be restored\n", string_contents(name), sock);
+
             /* Prepare the restart data */
             sock_restart_t restdata = {
-                .ssl  = instance->ssl,
+                .ssl  = false,
                 .fd   = sock,
             };
 
@@ -641,8 +658,11 @@ int main(int argc, char **argv) {
 
         list_foreach(fds, &data,
             lambda void(irc_manager_restart_t *e, restart_data_t *data) {
-                printf("    Network %s on socket %d stored (%s socket)\n",
-                    e->name, e->fd, e->ssl ? "secure" : "normal");
+                if (e->fd == -1)
+                    printf("    Network %s will connect again (secure socket)\n", e->name);
+                else
+                    printf("    Network %s on socket %d stored (%s socket)\n",
+                        e->name, e->fd, e->ssl ? "secure" : "normal");
 
                 write(data->fd, &e->fd, sizeof(int));
 
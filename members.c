@@ -0,0 +1,121 @@
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "members.h"
+#include "probe.h"
+
+/*
+ * Members are stored inline in a probe table, a slot is two words
+ * pointing at the user record shared with the other channels of the user.
+ * The hash of the nick is kept in the slot so a probe only follows the
+ * record when the hashes match.
+ */
+struct members_s {
+    probe_t           table;
+    users_t          *users;
+    pthread_rwlock_t  lock;     /* lookups from module threads read along */
+};
+
+members_t *members_create(users_t *users) {
+    members_t *members = malloc(sizeof(*members));
+    probe_init(&members->table, sizeof(member_t));
+    members->users = users;
+    pthread_rwlock_init(&members->lock, NULL);
+    return members;
+}
+
+static void members_release(members_t *members) {
+    for (size_t i = 0; i < members->table.size; i++) {
+        member_t *member = (member_t *)probe_at(&members->table, i);
+        if (member->user)
+            users_release(members->users, members, member->user);
+    }
+    probe_release(&members->table);
+}
+
+void members_destroy(members_t *members) {
+    if (!members)
+        return;
+    members_release(members);
+    pthread_rwlock_destroy(&members->lock);
+    free(members);
+}
+
+void members_clear(members_t *members) {
+    pthread_rwlock_wrlock(&members->lock);
+    members_release(members);
+    pthread_rwlock_unlock(&members->lock);
+}
+
+void members_reserve(members_t *members, size_t count) {
+    pthread_rwlock_wrlock(&members->lock);
+    probe_reserve(&members->table, members->table.count + count);
+    pthread_rwlock_unlock(&members->lock);
+}
+
+member_t *members_find(members_t *members, const char *nick) {
+    pthread_rwlock_rdlock(&members->lock);
+    member_t *member = (member_t *)probe_find(&members->table, intern_hash(nick), &users_match, nick);
+    pthread_rwlock_unlock(&members->lock);
+    return member;
+}
+
+member_t *members_insert(members_t *members, const char *nick, const char *host) {
+    uint32_t hash = intern_hash(nick);
+
+    pthread_rwlock_wrlock(&members->lock);
+    member_t *member = (member_t *)probe_claim(&members->table, hash, &users_match, nick);
+    if (!member->user)
+        member->user = users_acquire(members->users, members, nick, hash, host);
+    pthread_rwlock_unlock(&members->lock);
+    return member;
+}
+
+bool members_remove(members_t *members, const char *nick) {
+    pthread_rwlock_wrlock(&members->lock);
+    member_t *member = (member_t *)probe_find(&members->table, intern_hash(nick), &users_match, nick);
+    if (!member) {
+        pthread_rwlock_unlock(&members->lock);
+        return false;
+    }
+
+    user_t *user = member->user;
+    probe_vacate(&members->table, (probe_slot_t *)member);
+    users_release(members->users, members, user);
+    pthread_rwlock_unlock(&members->lock);
+    return true;
+}
+
+uint8_t members_unlink(members_t *members, user_t *user) {
+    pthread_rwlock_wrlock(&members->lock);
+    member_t *member = (member_t *)probe_find(&members->table, user->hash, &users_match, user->nick);
+    uint8_t   modes  = member->modes;
+    probe_vacate(&members->table, (probe_slot_t *)member);
+    pthread_rwlock_unlock(&members->lock);
+    return modes;
+}
+
+void members_link(members_t *members, user_t *user, uint8_t modes) {
+    pthread_rwlock_wrlock(&members->lock);
+    member_t *member = (member_t *)probe_claim(&members->table, user->hash, &users_match, user->nick);
+    member->user  = user;
+    member->modes = modes;
+    pthread_rwlock_unlock(&members->lock);
+}
+
+size_t members_count(members_t *members) {
+    return members->table.count;
+}
+
+void members_foreach(members_t *members, void *pass, void *callback) {
+    void (*visit)(member_t *, void *) = callback;
+
+    pthread_rwlock_rdlock(&members->lock);
+    for (size_t i = 0; i < members->table.size; i++) {
+        member_t *member = (member_t *)probe_at(&members->table, i);
+        if (member->user)
+            visit(member, pass);
+    }
+    pthread_rwlock_unlock(&members->lock);
+}
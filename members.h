@@ -0,0 +1,136 @@
+#ifndef REDROID_MEMBERS_HDR
+#define REDROID_MEMBERS_HDR
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "users.h"
+
+/*
+ * Type: member_t
+ *  A member of a channel. What is known about the user is in their record
+ *  in the registry of the table, shared by every channel they're in.
+ *  Pointers to members are only valid until the table is changed.
+ */
+typedef struct {
+    user_t   *user;  /* NULL marks an empty slot       */
+    uint32_t  hash;  /* of the nick                    */
+    uint8_t   modes; /* channel prefixes as bits       */
+} member_t;         /* starts like a probe_slot_t     */
+
+/*
+ * Function: members_create
+ *  Create an empty member table.
+ *
+ * Parameters:
+ *  users   - The registry of the users of members
+ */
+members_t *members_create(users_t *users);
+
+/*
+ * Function: members_destroy
+ *  Destroy a member table, releasing the users of its members.
+ *
+ * Parameters:
+ *  members - The table to destroy
+ */
+void members_destroy(members_t *members);
+
+/*
+ * Function: members_clear
+ *  Remove every member.
+ *
+ * Parameters:
+ *  members - The table
+ */
+void members_clear(members_t *members);
+
+/*
+ * Function: members_reserve
+ *  Make room for more members at once, so a burst of insertions like the
+ *  names of a channel doesn't grow the table several times.
+ *
+ * Parameters:
+ *  members - The table
+ *  count   - The amount of members about to be inserted
+ */
+void members_reserve(members_t *members, size_t count);
+
+/*
+ * Function: members_find
+ *  Find a member by nick.
+ *
+ * Parameters:
+ *  members - The table
+ *  nick    - The nick of the member
+ *
+ * Returns:
+ *  The member or NULL if there is no member with that nick.
+ */
+member_t *members_find(members_t *members, const char *nick);
+
+/*
+ * Function: members_insert
+ *  Find a member by nick, adding it when there is none.
+ *
+ * Parameters:
+ *  members - The table
+ *  nick    - The nick of the member
+ *  host    - The user@host of a member which is added
+ *
+ * Returns:
+ *  The member.
+ */
+member_t *members_insert(members_t *members, const char *nick, const char *host);
+
+/*
+ * Function: members_remove
+ *  Remove a member by nick.
+ *
+ * Parameters:
+ *  members - The table
+ *  nick    - The nick of the member
+ *
+ * Returns:
+ *  True if there was such a member, false otherwise.
+ */
+bool members_remove(members_t *members, const char *nick);
+
+/*
+ * Function: members_unlink
+ *  Used by the registry. Take the member of a user out of the table
+ *  without releasing the user, so it can be put back under a new nick.
+ *
+ * Returns:
+ *  The modes of the member.
+ */
+uint8_t members_unlink(members_t *members, user_t *user);
+
+/*
+ * Function: members_link
+ *  Used by the registry. Put back a member taken out with
+ *  <members_unlink>.
+ */
+void members_link(members_t *members, user_t *user, uint8_t modes);
+
+/*
+ * Function: members_count
+ *  Get the amount of members.
+ *
+ * Parameters:
+ *  members - The table
+ */
+size_t members_count(members_t *members);
+
+/*
+ * Function: members_foreach
+ *  Call a function for every member, the table must not be changed by it.
+ *
+ * Parameters:
+ *  members     - The table
+ *  pass        - Passed as the second argument of the callback
+ *  callback    - Function taking the form void(member_t *, T *)
+ */
+void members_foreach(members_t *members, void *pass, void *callback);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Benchmark of hashtable_t against the list of buckets it used to be.
+ *
+ * The old table is kept here as it was: an array of list_t chains with one
+ * allocation per entry and a copy of every key, searched with list_search.
+ * It never grew so it's measured at the sizes it was created with around
+ * the code (32 and 256 buckets) as well as with as many buckets as keys.
+ *
+ * For the new table the load, probe lengths and slowest single insert after
+ * inserting every key are shown as well.
+ *
+ * Build with `make hashbench' and run misc/hashbench [iterations].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "../hashtable.h"
+#include "../list.h"
+
+typedef struct {
+    list_t        **table;
+    size_t          size;
+    pthread_mutex_t mutex;
+} chained_t;
+
+typedef struct {
+    char *key;
+    void *value;
+} chained_entry_t;
+
+static size_t chained_hash(const char *string) {
+    size_t hash = 0;
+    int    ch   = 0;
+
+    while ((ch = *string++))
+        hash = ch + (hash << 6) + (hash << 16) - hash;
+
+    return hash;
+}
+
+static bool chained_compare(const void *a, const void *b) {
+    return !strcmp(((const chained_entry_t *)a)->key, ((const chained_entry_t *)b)->key);
+}
+
+static chained_t *chained_create(size_t size) {
+    chained_t *chained = malloc(sizeof(*chained));
+    chained->size  = size;
+    chained->table = malloc(sizeof(list_t *) * size);
+    for (size_t i = 0; i < size; i++)
+        chained->table[i] = list_create();
+    pthread_mutex_init(&chained->mutex, NULL);
+    return chained;
+}
+
+static void chained_destroy(chained_t *chained) {
+    for (size_t i = 0; i < chained->size; i++) {
+        chained_entry_t *entry;
+        while ((entry = list_pop(chained->table[i]))) {
+            free(entry->key);
+            free(entry);
+        }
+        list_destroy(chained->table[i]);
+    }
+    free(chained->table);
+    pthread_mutex_destroy(&chained->mutex);
+    free(chained);
+}
+
+static void chained_insert(chained_t *chained, const char *key, void *value) {
+    chained_entry_t *entry = malloc(sizeof(*entry));
+    entry->key   = strdup(key);
+    entry->value = value;
+
+    pthread_mutex_lock(&chained->mutex);
+    list_push(chained->table[chained_hash(key) & (chained->size - 1)], entry);
+    pthread_mutex_unlock(&chained->mutex);
+}
+
+static void *chained_find(chained_t *chained, const char *key) {
+    chained_entry_t pass = { .key = (char *)key };
+
+    pthread_mutex_lock(&chained->mutex);
+    chained_entry_t *find = list_search(chained->table[chained_hash(key) & (chained->size - 1)], &pass, &chained_compare);
+    pthread_mutex_unlock(&chained->mutex);
+    return find ? find->value : NULL;
+}
+
+static bool chained_remove(chained_t *chained, const char *key) {
+    chained_entry_t pass  = { .key = (char *)key };
+    list_t         *chain = chained->table[chained_hash(key) & (chained->size - 1)];
+
+    pthread_mutex_lock(&chained->mutex);
+    chained_entry_t *find = list_search(chain, &pass, &chained_compare);
+    if (find) {
+        list_erase(chain, find);
+        free(find->key);
+        free(find);
+    }
+    pthread_mutex_unlock(&chained->mutex);
+    return find;
+}
+
+/* Nicks are short enough to be kept inline, channel names with a topic aren't */
+static char **bench_keys(size_t count, const char *prefix) {
+    char **keys = malloc(sizeof(char *) * count);
+    for (size_t i = 0; i < count; i++) {
+        char buffer[64];
+        if (i & 1)
+            snprintf(buffer, sizeof(buffer), "#%s-channel-%zu", prefix, i);
+        else
+            snprintf(buffer, sizeof(buffer), "%s%zu", prefix, i);
+        keys[i] = strdup(buffer);
+    }
+    return keys;
+}
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+typedef struct {
+    double insert;
+    double hit;
+    double miss;
+    double remove;
+} bench_result_t;
+
+static volatile size_t bench_sink;
+
+/* Nanoseconds per operation, the best of a number of rounds */
+#define BENCH_ROUND(RESULT, CREATE, INSERT, FIND, REMOVE, DESTROY)            \
+    do {                                                                      \
+        double start = bench_now();                                           \
+        CREATE;                                                               \
+        for (size_t i = 0; i < count; i++)                                    \
+            INSERT(keys[i], keys[i]);                                         \
+        double inserted = bench_now();                                        \
+        for (size_t i = 0; i < count; i++)                                    \
+            bench_sink += (FIND(keys[i]) != NULL);                            \
+        double hits = bench_now();                                            \
+        for (size_t i = 0; i < count; i++)                                    \
+            bench_sink += (FIND(misses[i]) != NULL);                          \
+        double missed = bench_now();                                          \
+        for (size_t i = 0; i < count; i++)                                    \
+            bench_sink += REMOVE(keys[i]);                                    \
+        double removed = bench_now();                                         \
+        DESTROY;                                                              \
+        bench_min(&(RESULT).insert, (inserted - start)   / count);            \
+        bench_min(&(RESULT).hit,    (hits     - inserted) / count);           \
+        bench_min(&(RESULT).miss,   (missed   - hits)     / count);           \
+        bench_min(&(RESULT).remove, (removed  - missed)   / count);           \
+    } while (0)
+
+static void bench_min(double *best, double value) {
+    if (*best == 0 || value < *best)
+        *best = value;
+}
+
+static void bench_print(const char *name, size_t count, bench_result_t *result) {
+    printf("%-24s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, count,
+        result->insert, result->hit, result->miss, result->remove);
+}
+
+static void bench_chained(size_t count, size_t buckets, size_t rounds, char **keys, char **misses) {
+    bench_result_t result = { 0 };
+    chained_t     *chained;
+
+    for (size_t round = 0; round < rounds; round++) {
+        #define INSERT(K, V) chained_insert(chained, (K), (V))
+        #define FIND(K)      chained_find(chained, (K))
+        #define REMOVE(K)    chained_remove(chained, (K))
+        BENCH_ROUND(result, chained = chained_create(buckets), INSERT, FIND, REMOVE, chained_destroy(chained));
+        #undef INSERT
+        #undef FIND
+        #undef REMOVE
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "chained (%zu buckets)", buckets);
+    bench_print(name, count, &result);
+}
+
+static void bench_hashtable(size_t count, size_t rounds, char **keys, char **misses) {
+    bench_result_t result = { 0 };
+    hashtable_t   *hashtable;
+
+    for (size_t round = 0; round < rounds; round++) {
+        #define INSERT(K, V) hashtable_insert(hashtable, (K), (V))
+        #define FIND(K)      hashtable_find(hashtable, (K))
+        #define REMOVE(K)    hashtable_remove(hashtable, (K))
+        BENCH_ROUND(result, hashtable = hashtable_create(32), INSERT, FIND, REMOVE, hashtable_destroy(hashtable));
+        #undef INSERT
+        #undef FIND
+        #undef REMOVE
+    }
+
+    bench_print("hashtable", count, &result);
+
+    /* The slowest single insert shows the cost of growing */
+    double            worst = 0;
+    hashtable_stats_t stats;
+    hashtable = hashtable_create(32);
+    for (size_t i = 0; i < count; i++) {
+        double start = bench_now();
+        hashtable_insert(hashtable, keys[i], keys[i]);
+        double took = bench_now() - start;
+        if (took > worst)
+            worst = took;
+    }
+    hashtable_stats(hashtable, &stats);
+    hashtable_destroy(hashtable);
+
+    printf("%-24s load %.2f, probes %.2f (max %zu), %zu resizes, slowest insert %.1fus\n", "",
+        stats.load, stats.probemean, stats.probemax, stats.resizes, worst / 1000);
+}
+
+int main(int argc, char **argv) {
+    static const size_t counts[] = { 32, 256, 4096, 65536 };
+    size_t rounds = (argc > 1) ? strtoul(argv[1], NULL, 10) : 5;
+
+    printf("%-24s %8s %10s %10s %10s %10s\n", "ns/op", "keys", "insert", "hit", "miss", "remove");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+        size_t count  = counts[i];
+        char **keys   = bench_keys(count, "nick");
+        char **misses = bench_keys(count, "gone");
+
+        bench_chained(count, 32, rounds, keys, misses);
+        bench_chained(count, 256, rounds, keys, misses);
+        if (count > 256)
+            bench_chained(count, count, rounds, keys, misses);
+        bench_hashtable(count, rounds, keys, misses);
+        printf("\n");
+
+        for (size_t j = 0; j < count; j++) {
+            free(keys[j]);
+            free(misses[j]);
+        }
+        free(keys);
+        free(misses);
+    }
+    return 0;
+}
@@ -3,11 +3,11 @@
 #include <limits.h>
 #include <stdio.h>
 
-#include <pthread.h>
 #include <dlfcn.h>
 #include <elf.h>
 
 #include "module.h"
+#include "ircman.h"
 
 /* A simplified GC because we only enter this from one thread */
 typedef struct {
@@ -28,14 +28,44 @@ static void module_mem_node_destroy(module_mem_node_t *node) {
     free(node);
 }
 
+/* The memory of one invocation is released, the vector is kept for the next */
 void module_mem_destroy(module_t *module) {
-    list_foreach(module->memory, &module_mem_node_destroy);
-    list_destroy(module->memory);
+    vector_foreach(module->memory, &module_mem_node_destroy);
+    vector_clear(module->memory);
 }
 
 void module_mem_push(module_t *module, void *data, void (*callback)(void *)) {
     module_mem_node_t *node = module_mem_node_create(data, callback);
-    list_push(module->memory, node);
+    vector_push(module->memory, node);
+}
+
+/*
+ * Memory held across invocations, like the lookups a module has in flight.
+ * It's kept with the shard locked since it's dropped by the event loop once
+ * done with. Whatever is still held when the module goes away is released
+ * as it would otherwise call back into code which isn't there anymore.
+ */
+void module_mem_hold(module_t *module, void *data, void (*callback)(void *)) {
+    module_mem_node_t *node = module_mem_node_create(data, callback);
+    vector_push(module->held, node);
+}
+
+void module_mem_drop(module_t *module, void *data) {
+    module_mem_node_t *node = vector_search(module->held, data,
+        lambda bool(module_mem_node_t *node, void *data)
+            => return node->data == data;
+    );
+    if (!node)
+        return;
+    vector_erase(module->held, node);
+    free(node);
+}
+
+void module_mem_release(module_t *module) {
+    irc_shard_lock(module->instance->shard);
+    vector_foreach(module->held, &module_mem_node_destroy);
+    vector_clear(module->held);
+    irc_shard_unlock(module->instance->shard);
 }
 
 static bool module_load(module_t *module) {
@@ -65,8 +95,7 @@ static bool module_load(module_t *module) {
 
     int *interval = dlsym(module->handle, "module_interval");
 
-    module->interval     = (interval) ? *interval : 0;
-    module->lastinterval = 0;
+    module->interval = (interval) ? *interval : 0;
 
     return true;
 }
@@ -160,6 +189,7 @@ module_t *module_open(const char *file, module_manager_t *manager, string_t **er
 
     module->file     = strdup(file);
     module->instance = manager->instance;
+    module->timer    = NULL;
 
     if (!module_load(module)) {
         if (!module)
@@ -173,18 +203,25 @@ module_t *module_open(const char *file, module_manager_t *manager, string_t **er
         return NULL;
     }
 
-    module->random = mt_create();
-    list_push(manager->modules, module);
+    module->random  = mt_create();
+    module->memory  = vector_create();
+    module->held    = vector_create();
+    module->reloads = 0;
+    vector_push(manager->modules, module);
     return module;
 }
 
 bool module_reload(module_t *module, module_manager_t *manager) {
+    /* Commands left over from before can't call back into the new code */
+    module_mem_release(module);
+    module->reloads++;
+
     if (module->close)
         module->close(module->instance);
     dlclose(module->handle);
 
     /* Save old address for unloaded module */
-    list_push(manager->unloaded, module->handle);
+    vector_push(manager->unloaded, module->handle);
 
     if (!(module->handle = dlopen(module->file, RTLD_LAZY)))
         goto module_reload_error;
@@ -204,6 +241,8 @@ module_reload_error:
 }
 
 void module_close(module_t *module, module_manager_t *manager) {
+    wheel_timer_destroy(module->timer);
+    module_mem_release(module);
     if (module->close)
         module->close(module->instance);
     if (module->handle)
@@ -211,36 +250,23 @@ void module_close(module_t *module, module_manager_t *manager) {
     free(module->file);
 
     /* Save old address for unloaded module */
-    list_push(manager->unloaded, module);
+    vector_push(manager->unloaded, module);
     mt_destroy(module->random);
+    vector_destroy(module->memory);
+    vector_destroy(module->held);
     free(module);
 }
 
-typedef struct {
-    pthread_mutex_t mutex;
-    module_t       *handle;
-} module_get_t;
-
-static module_get_t *module_singleton(void) {
-    static module_get_t get = {
-        .mutex  = PTHREAD_MUTEX_INITIALIZER,
-        .handle = NULL
-    };
-    return &get;
-}
+/*
+ * Every event loop has a command channel of its own running modules, the
+ * module being run is therefore per thread.
+ */
+static _Thread_local module_t *module_singleton = NULL;
 
 void module_singleton_set(module_t *module) {
-    module_get_t *get = module_singleton();
-    pthread_mutex_lock(&get->mutex);
-    get->handle = module;
-    pthread_mutex_unlock(&get->mutex);
+    module_singleton = module;
 }
 
 module_t *module_singleton_get(void) {
-    module_get_t *get = module_singleton();
-    module_t *mod = NULL;
-    pthread_mutex_lock(&get->mutex);
-    mod = get->handle;
-    pthread_mutex_unlock(&get->mutex);
-    return mod;
+    return module_singleton;
 }
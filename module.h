@@ -5,6 +5,8 @@
 #include "string.h"
 #include "irc.h"
 #include "mt.h"
+#include "wheel.h"
+#include "vector.h"
 
 typedef struct module_s         module_t;
 typedef struct module_manager_s module_manager_t;
@@ -14,13 +16,15 @@ struct module_s {
     const char   *name;
     const char   *match;
     int           interval;
-    time_t        lastinterval;
+    wheel_timer_t *timer;
     char         *file;
     void        (*enter)(irc_t *irc, const char *channel, const char *user, const char *message);
     void        (*close)(irc_t *irc);
     irc_t        *instance;
-    list_t       *memory;
+    vector_t     *memory;
+    vector_t     *held;     /* memory outliving an invocation */
     mt_t         *random;
+    size_t        reloads;
 };
 
 /* module */
@@ -31,6 +35,9 @@ void module_close(module_t *module, module_manager_t *manager);
 /* module memory manager */
 void module_mem_push(module_t *module, void *data, void (*cleanup)(void *));
 void module_mem_destroy(module_t *module);
+void module_mem_hold(module_t *module, void *data, void (*cleanup)(void *));
+void module_mem_drop(module_t *module, void *data);
+void module_mem_release(module_t *module);
 
 /* singleton */
 void module_singleton_set(module_t *module);
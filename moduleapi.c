@@ -13,6 +13,9 @@
 #include "module.h"
 #include "access.h"
 #include "irc.h"
+#include "ircman.h"
+#include "command.h"
+#include "dns.h"
 
 void redroid_restart(irc_t *irc, const char *channel, const char *user);
 void redroid_shutdown(irc_t *irc, const char *channel, const char *user);
@@ -22,13 +25,12 @@ const char *redroid_buildinfo(void);
 
 /* api runtime */
 static hashtable_t *module_api_irc_modules_config_copy(irc_t *irc, const char *mname, const char *cname) {
+    irc_shard_lock(irc->shard);
     irc_channel_t *channel = hashtable_find(irc->channels, cname);
-    if (!channel)
-        return NULL;
-    irc_module_t *module = hashtable_find(channel->modules, mname);
-    if (!module)
-        return NULL;
-    return hashtable_copy(module->kvs, &strdup);
+    irc_module_t  *module  = channel ? hashtable_find(channel->modules, mname) : NULL;
+    hashtable_t   *kvs     = module ? hashtable_copy(module->kvs, &strdup) : NULL;
+    irc_shard_unlock(irc->shard);
+    return kvs;
 }
 
 static void module_api_irc_modules_config_destroy(hashtable_t *kvs) {
@@ -36,13 +38,13 @@ static void module_api_irc_modules_config_destroy(hashtable_t *kvs) {
     hashtable_destroy(kvs);
 }
 
-static list_t* module_api_strnsplit_impl(char *str, const char *delim, size_t count) {
-    list_t *list = list_create();
+static vector_t* module_api_strnsplit_impl(char *str, const char *delim, size_t count) {
+    vector_t *list = vector_create();
     char *saveptr;
     char *end = str + strlen(str);
     char *tok = strtok_r(str, delim, &saveptr);
     while (tok) {
-        list_push(list, tok);
+        vector_push(list, tok);
         if (!--count) {
             tok += strlen(tok);
             if (tok == end)
@@ -50,7 +52,7 @@ static list_t* module_api_strnsplit_impl(char *str, const char *delim, size_t co
             for (++tok; *tok && strchr(delim, *tok);)
                 ++tok;
             if (*tok)
-                list_push(list, tok);
+                vector_push(list, tok);
             return list;
         }
         tok = strtok_r(NULL, delim, &saveptr);
@@ -93,12 +95,12 @@ static svn_entry_t *module_api_svnlog_read_entry(FILE *handle) {
     }
 
     /* split revision marker "rev | author | date | changes" */
-    char   *copy  = strdup(&line[1]);
-    list_t *split = module_api_strnsplit_impl(copy, " |", 2);
-    list_pop(split); /* drop "date | changes" */
+    char     *copy  = strdup(&line[1]);
+    vector_t *split = module_api_strnsplit_impl(copy, " |", 2);
+    vector_pop(split); /* drop "date | changes" */
 
-    entry->revision = string_create(list_shift(split));
-    entry->author   = string_create(list_shift(split));
+    entry->revision = string_create(vector_shift(split));
+    entry->author   = string_create(vector_shift(split));
 
     /* now parse it */
     string_t *message = string_construct();
@@ -110,7 +112,7 @@ static svn_entry_t *module_api_svnlog_read_entry(FILE *handle) {
         /* seperator marks end of message */
         if (*line == '-') {
             entry->message = message;
-            list_destroy(split);
+            vector_destroy(split);
             free(copy);
             free(line);
             return entry;
@@ -125,7 +127,7 @@ static svn_entry_t *module_api_svnlog_read_entry(FILE *handle) {
     }
 
     string_destroy(message);
-    list_destroy(split);
+    vector_destroy(split);
     free(copy);
     free(entry);
     free(line);
@@ -183,7 +185,8 @@ static void module_api_strdur_step(strdur_context_t *ctx, unsigned long long dur
         string_catf(ctx->str, "%llu%c", divide, ch);
 }
 
-static void module_api_dns_destroy(list_t *data) {
+/* Lists owning the strings in them */
+static void module_api_strings_destroy(list_t *data) {
     list_foreach(data, lambda void(char *data) => free(data););
     list_destroy(data);
 }
@@ -192,6 +195,8 @@ static void module_api_dns_destroy(list_t *data) {
 
 #define module_mem_push(MODULE, DATA, FREEFUNC) \
     module_mem_push((MODULE), (DATA), ((void (*)(void *))(FREEFUNC)))
+#define module_mem_hold(MODULE, DATA, FREEFUNC) \
+    module_mem_hold((MODULE), (DATA), ((void (*)(void *))(FREEFUNC)))
 
 /* list */
 list_t *module_api_list_create(void) {
@@ -234,6 +239,51 @@ void *module_api_list_search_impl(list_t *list, const void *pass, bool (*predica
     return list_search_impl(list, pass, predicate);
 }
 
+/* vector */
+vector_t *module_api_vector_create(void) {
+    module_t *module = module_singleton_get();
+    vector_t *vector = vector_create();
+    if (vector)
+        module_mem_push(module, vector, &vector_destroy);
+    return vector;
+}
+
+void *module_api_vector_pop(vector_t *vector) {
+    return vector_pop(vector);
+}
+
+void *module_api_vector_shift(vector_t *vector) {
+    return vector_shift(vector);
+}
+
+size_t module_api_vector_length(vector_t *vector) {
+    return vector_length(vector);
+}
+
+void *module_api_vector_at(vector_t *vector, size_t index) {
+    return vector_at(vector, index);
+}
+
+void module_api_vector_push(vector_t *vector, void *element) {
+    return vector_push(vector, element);
+}
+
+void module_api_vector_prepend(vector_t *vector, void *element) {
+    return vector_prepend(vector, element);
+}
+
+void module_api_vector_sort_impl(vector_t *vector, bool (*predicate)(const void *, const void *)) {
+    return vector_sort_impl(vector, predicate);
+}
+
+void module_api_vector_foreach_impl(vector_t *vector, void *pass, void (*callback)(void *, void *)) {
+    return vector_foreach_impl(vector, pass, callback);
+}
+
+void *module_api_vector_search_impl(vector_t *vector, const void *pass, bool (*predicate)(const void *, const void *)) {
+    return vector_search_impl(vector, pass, predicate);
+}
+
 /* string */
 string_t *module_api_string_create(const char *input) {
     module_t *module = module_singleton_get();
@@ -333,7 +383,7 @@ list_t *module_api_irc_modules_enabled(irc_t *irc, const char *channel) {
     module_t *module = module_singleton_get();
     list_t *list = irc_modules_enabled(irc, channel);
     if (list)
-        module_mem_push(module, list, &list_destroy);
+        module_mem_push(module, list, &module_api_strings_destroy);
     return list;
 }
 
@@ -349,7 +399,7 @@ list_t *module_api_irc_users(irc_t *irc, const char *channel) {
     module_t *module = module_singleton_get();
     list_t *users = irc_users(irc, channel);
     if (users)
-        module_mem_push(module, users, &list_destroy);
+        module_mem_push(module, users, &module_api_strings_destroy);
     return users;
 }
 
@@ -357,7 +407,7 @@ list_t *module_api_irc_channels(irc_t *irc) {
     module_t *module = module_singleton_get();
     list_t *channels = irc_channels(irc);
     if (channels)
-        module_mem_push(module, channels, &list_destroy);
+        module_mem_push(module, channels, &module_api_strings_destroy);
     return channels;
 }
 
@@ -366,13 +416,24 @@ const char *module_api_irc_nick(irc_t *irc) {
 }
 
 const char *module_api_irc_topic(irc_t *irc, const char *channel) {
-    return irc_topic(irc, channel);
+    module_t *module = module_singleton_get();
+    char     *topic  = irc_topic(irc, channel);
+    module_mem_push(module, topic, &free);
+    return topic;
 }
 
 const char *module_api_irc_pattern(irc_t *irc, const char *newpattern) {
     return irc_pattern(irc, newpattern);
 }
 
+void module_api_irc_dispatch_stats(irc_t *irc, size_t *dispatched, size_t *skipped) {
+    irc_dispatch_stats(irc, dispatched, skipped);
+}
+
+void module_api_irc_lag_stats(irc_t *irc, irc_lag_stats_t *stats) {
+    irc_lag_stats(irc, stats);
+}
+
 module_status_t module_api_irc_modules_add(irc_t *irc, const char *file) {
     return irc_modules_add(irc, file);
 }
@@ -516,10 +577,10 @@ access_t module_api_access_change(irc_t *irc, const char *target, const char *in
 }
 
 /* misc */
-list_t *module_api_strsplit(const char *str_, const char *delim) {
+vector_t *module_api_strsplit(const char *str_, const char *delim) {
     module_t *module = module_singleton_get();
-    list_t *list = list_create();
-    module_mem_push(module, list, &list_destroy);
+    vector_t *list = vector_create();
+    module_mem_push(module, list, &vector_destroy);
 
     if (str_ && *str_) {
         char *str = strdup(str_);
@@ -527,24 +588,24 @@ list_t *module_api_strsplit(const char *str_, const char *delim) {
         char *saveptr;
         char *tok = strtok_r(str, delim, &saveptr);
         while (tok) {
-            list_push(list, tok);
+            vector_push(list, tok);
             tok = strtok_r(NULL, delim, &saveptr);
         }
     }
     return list;
 }
 
-list_t *module_api_strnsplit(const char *str_, const char *delim, size_t count) {
+vector_t *module_api_strnsplit(const char *str_, const char *delim, size_t count) {
     module_t *module = module_singleton_get();
-    list_t *list;
+    vector_t *list;
     if (str_ && *str_) {
         char *str = strdup(str_);
         module_mem_push(module, str, &free);
         list = module_api_strnsplit_impl(str, delim, count);
     }
     else
-        list = list_create();
-    module_mem_push(module, list, &list_destroy);
+        list = vector_create();
+    module_mem_push(module, list, &vector_destroy);
     return list;
 }
 
@@ -581,43 +642,115 @@ const char *module_api_strdur(unsigned long long duration) {
     return move;
 }
 
-list_t *module_api_dns(const char *url) {
-    module_t *module = module_singleton_get();
-
-    struct addrinfo *result;
-    struct addrinfo hints = {
-        .ai_family   = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM
-    };
-
-    int status;
-    if ((status = getaddrinfo(url, NULL, &hints, &result)) != 0)
+static list_t *module_api_dns_list(const dns_address_t *addresses, size_t count) {
+    if (count == 0)
         return NULL;
 
     list_t *list = list_create();
-
-    char ipbuffer[INET6_ADDRSTRLEN];
-    for (struct addrinfo *p = result; p; p = p->ai_next) {
-        void *address;
-        if (p->ai_family == AF_INET) {
-            struct sockaddr_in *ipv4 = (struct sockaddr_in*)p->ai_addr;
-            address = &ipv4->sin_addr;
-        } else {
-            struct sockaddr_in6 *ipv6 = (struct sockaddr_in6*)p->ai_addr;
-            address = &ipv6->sin6_addr;
-        }
-        inet_ntop(p->ai_family, address, ipbuffer, sizeof(ipbuffer));
+    char    ipbuffer[INET6_ADDRSTRLEN];
+    for (size_t i = 0; i < count; i++) {
+        const void *address = (addresses[i].family == AF_INET6)
+                                  ? (const void *)&addresses[i].ipv6
+                                  : (const void *)&addresses[i].ipv4;
+        inet_ntop(addresses[i].family, address, ipbuffer, sizeof(ipbuffer));
         list_push(list, strdup(ipbuffer));
     }
-    freeaddrinfo(result);
+    return list;
+}
 
-    if (list_length(list)) {
-        list_t *copy = list_copy(list);
-        module_mem_push(module, list, &module_api_dns_destroy);
-        module_mem_push(module, copy, &list_destroy);
-        return copy;
+/* Lookups only warming the cache for the next call of dns */
+static void module_api_dns_ignore(const dns_address_t *addresses, size_t count, void *data) {
+    (void)addresses;
+    (void)count;
+    (void)data;
+}
+
+/*
+ * Never waits for the nameservers, that would hold up the command thread.
+ * Unknown names are looked up in the background instead.
+ */
+list_t *module_api_dns(const char *url) {
+    module_t      *module = module_singleton_get();
+    dns_address_t *addresses;
+    size_t         count;
+
+    if (!dns_cached(url, &addresses, &count)) {
+        irc_manager_resolve(module->instance, url, &module_api_dns_ignore, NULL);
+        return NULL;
     }
 
-    list_destroy(list);
-    return NULL;
+    list_t *list = module_api_dns_list(addresses, count);
+    free(addresses);
+    if (!list)
+        return NULL;
+
+    list_t *copy = list_copy(list);
+    module_mem_push(module, list, &module_api_strings_destroy);
+    module_mem_push(module, copy, &list_destroy);
+    return copy;
+}
+
+typedef struct {
+    module_t       *module;
+    string_t       *channel;
+    string_t       *user;
+    cmd_resolved_t  callback;
+    dns_query_t    *query;
+} module_api_dns_t;
+
+static void module_api_dns_destroy(module_api_dns_t *lookup) {
+    string_destroy(lookup->channel);
+    if (lookup->user)
+        string_destroy(lookup->user);
+    free(lookup);
+}
+
+/* The module went away before the lookup was done, called with the shard locked */
+static void module_api_dns_cancel(module_api_dns_t *lookup) {
+    dns_cancel(lookup->query);
+    module_api_dns_destroy(lookup);
+}
+
+/* Runs on the event loop of the shard, the answer goes back to the command thread */
+static void module_api_dns_resolved(const dns_address_t *addresses, size_t count, module_api_dns_t *lookup) {
+    irc_t *irc = lookup->module->instance;
+
+    module_mem_drop(lookup->module, lookup);
+    cmd_channel_push(irc_shard_commander(irc->shard),
+        cmd_entry_resolved(irc_shard_commander(irc->shard), lookup->module,
+            string_contents(lookup->channel), string_contents(lookup->user),
+            lookup->callback, module_api_dns_list(addresses, count)));
+
+    module_api_dns_destroy(lookup);
+}
+
+/*
+ * The lookup is held by the module while in flight so it's cancelled if the
+ * module is closed or reloaded before the answer comes in.
+ */
+bool module_api_dns_async(const char *url, const char *channel, const char *user, cmd_resolved_t callback) {
+    module_t    *module = module_singleton_get();
+    irc_shard_t *shard  = module->instance->shard;
+    if (!shard || !irc_shard_resolver(shard))
+        return false;
+
+    module_api_dns_t *lookup = malloc(sizeof(*lookup));
+
+    lookup->module   = module;
+    lookup->channel  = string_create(channel);
+    lookup->user     = user ? string_create(user) : NULL;
+    lookup->callback = callback;
+    lookup->query    = NULL;
+
+    /* Known names complete right away, the lookup is gone then */
+    irc_shard_lock(shard);
+    module_mem_hold(module, lookup, &module_api_dns_cancel);
+    dns_query_t *query = dns_resolve(irc_shard_resolver(shard), url, (dns_callback_t)&module_api_dns_resolved, lookup);
+    if (query)
+        lookup->query = query;
+    irc_shard_unlock(shard);
+
+    /* The retransmission timer may now be the earliest */
+    irc_shard_wake(shard);
+    return true;
 }
@@ -73,10 +73,10 @@ static void access_user(irc_t *irc, const char *channel, const char *target, con
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t     *list        = strnsplit(message, " ", 3);
-    const char *method      = list_shift(list);
-    const char *target      = list_shift(list);
-    const char *targetlevel = list_shift(list);
+    vector_t   *list        = strnsplit(message, " ", 3);
+    const char *method      = vector_shift(list);
+    const char *target      = vector_shift(list);
+    const char *targetlevel = vector_shift(list);
 
     if (!method || !strcmp(method, "-help"))
         return access_help(irc, channel, user);
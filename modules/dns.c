@@ -8,16 +8,7 @@ typedef struct {
     const char *user;
 } pass_t;
 
-void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    (void)irc;
-    (void)channel;
-    (void)user;
-    (void)message;
-
-    irc_write(irc, channel, "%s: Please wait, resolving: %s", user, message);
-
-    list_t *result = dns(message);
-
+static void resolved(irc_t *irc, const char *channel, const char *user, list_t *result) {
     if (result) {
         pass_t pass = {
             .irc     = irc,
@@ -30,6 +21,16 @@ void module_enter(irc_t *irc, const char *channel, const char *user, const char
                 => irc_write(pass->irc, pass->channel, "%s: %s", pass->user, resolved);
         );
     } else {
-        irc_write(irc, channel, "%s: domain name resolution failed (%s)", user, message);
+        irc_write(irc, channel, "%s: domain name resolution failed", user);
     }
 }
+
+void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
+    if (!message)
+        return;
+
+    irc_write(irc, channel, "%s: Please wait, resolving: %s", user, message);
+
+    if (!dns_async(message, channel, user, &resolved))
+        irc_write(irc, channel, "%s: domain name resolution failed (%s)", user, message);
+}
@@ -75,9 +75,9 @@ static void family_stats(irc_t *irc, const char *channel, const char *user) {
     irc_write(irc, channel, "%s: family stats -> %d members -> requested %d times", user, count, request);
 }
 
-static void family_add_replace(irc_t *irc, const char *channel, const char *user, list_t *list, bool replace) {
-    const char *member = list_shift(list);
-    const char *status = list_shift(list);
+static void family_add_replace(irc_t *irc, const char *channel, const char *user, vector_t *list, bool replace) {
+    const char *member = vector_shift(list);
+    const char *status = vector_shift(list);
 
     if (!member || !status)
         return family_help(irc, channel, user);
@@ -108,9 +108,9 @@ static void family_add_replace(irc_t *irc, const char *channel, const char *user
         user, (replace) ? "replaced" : "added", member, status);
 }
 
-static void family_concat(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    const char *member = list_shift(list);
-    const char *status = list_shift(list);
+static void family_concat(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    const char *member = vector_shift(list);
+    const char *status = vector_shift(list);
 
     if (!member || !status)
         return family_help(irc, channel, user);
@@ -135,8 +135,8 @@ static void family_concat(irc_t *irc, const char *channel, const char *user, lis
 
 }
 
-static void family_forget(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *message = list_shift(list);
+static void family_forget(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *message = vector_shift(list);
     char *strip   = strchr(message, ' ');
     if (strip)
         *strip = '\0';
@@ -159,8 +159,8 @@ void module_enter(irc_t *irc, const char *channel, const char *user, const char
     if (!message)
         return family_entry_random(irc, channel, user);
 
-    list_t     *list   = strnsplit(message, " ", 2);
-    const char *method = list_shift(list);
+    vector_t   *list   = strnsplit(message, " ", 2);
+    const char *method = vector_shift(list);
 
     if (!strcmp(method, "-help"))    return family_help(irc, channel, user);
     if (!strcmp(method, "-add"))     return family_add_replace(irc, channel, user, list, false);
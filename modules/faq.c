@@ -50,8 +50,8 @@ static void faq_entry(irc_t *irc, const char *channel, const char *user, const c
     irc_write(irc, channel, "%s: %s = %s", user, faq, content);
 }
 
-static void faq_stats(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    const char *who = list_shift(list);
+static void faq_stats(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    const char *who = vector_shift(list);
     if (!who) {
         int count   = faq_length();
         int request = database_request_count(irc, "FAQ");
@@ -60,9 +60,9 @@ static void faq_stats(irc_t *irc, const char *channel, const char *user, list_t
     }
 }
 
-static void faq_add(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *faq     = list_shift(list);
-    char *content = list_shift(list);
+static void faq_add(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *faq     = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!faq || !content)
         return;
@@ -79,17 +79,17 @@ static void faq_add(irc_t *irc, const char *channel, const char *user, list_t *l
     irc_write(irc, channel, "%s: Ok, added faq: %s = %s", user, faq, content);
 }
 
-static void faq_concat(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *faq     = list_shift(list);
-    char *content = list_shift(list);
+static void faq_concat(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *faq     = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!faq || !content)
         return;
 
     if (!faq_find(faq)) {
         /* put them back and add it instead */
-        list_push(list, content);
-        list_push(list, faq);
+        vector_push(list, content);
+        vector_push(list, faq);
         return faq_add(irc, channel, user, list);
     }
 
@@ -113,8 +113,8 @@ static void faq_concat(irc_t *irc, const char *channel, const char *user, list_t
     irc_write(irc, channel, "%s: Ok updated FAQ: %s = %s", user, faq, string_contents(string));
 }
 
-static void faq_forget(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *faq = list_shift(list);
+static void faq_forget(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *faq = vector_shift(list);
     if (!faq)
         return;
 
@@ -130,8 +130,8 @@ static void faq_forget(irc_t *irc, const char *channel, const char *user, list_t
     irc_write(irc, channel, "%s: Ok, removed - \"%s\" from FAQs", user, faq);
 }
 
-static void faq_author(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *faq = list_shift(list);
+static void faq_author(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *faq = vector_shift(list);
     if (!faq)
         return;
 
@@ -154,8 +154,8 @@ static void faq_author(irc_t *irc, const char *channel, const char *user, list_t
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t     *list   = strnsplit(message, " ", 2);
-    const char *method = list_shift(list);
+    vector_t   *list   = strnsplit(message, " ", 2);
+    const char *method = vector_shift(list);
 
     if (!strcmp(method, "-help"))    return faq_help(irc, channel, user);
     if (!strcmp(method, "-add"))     return faq_add(irc, channel, user, list);
@@ -230,6 +230,178 @@ MODULE_API void *list_search_impl(list_t *list, const void *pass, bool (*predica
 
 /** @} */
 
+/** @defgroup Vector
+ *
+ * A sequence kept in one growable array, for when elements are shifted off
+ * the head or indexed often.
+ *
+ * @{
+ */
+
+/**
+ * @brief A vector.
+ *
+ * An opaque type for representing a vector.
+ */
+typedef struct vector_s vector_t;
+
+/**
+ * @brief Create a vector.
+ *
+ * Creates an empty vector.
+ *
+ * @returns
+ * A new empty vector.
+ */
+MODULE_API vector_t *vector_create(void) {
+    return MODULE_API_CALL(vector_create)();
+}
+
+/**
+ * @brief Pop element off vector.
+ *
+ * Pops an element off the tail of the vector.
+ *
+ * @param vector        The vector to pop element off of.
+ *
+ * @returns
+ * The value at the tail of the vector or NULL if it's empty.
+ */
+MODULE_API void *vector_pop(vector_t *vector) {
+    return MODULE_API_CALL(vector_pop)(vector);
+}
+
+/**
+ * @brief Shift element off vector.
+ *
+ * Shifts an element off the head of the vector.
+ *
+ * @param vector        The vector to shift element off of.
+ *
+ * @returns
+ * The value at the head of the vector or NULL if it's empty.
+ */
+MODULE_API void *vector_shift(vector_t *vector) {
+    return MODULE_API_CALL(vector_shift)(vector);
+}
+
+/**
+ * @brief Get the length of a vector.
+ *
+ * Get the amount of elements the vector contains.
+ *
+ * @param vector        The vector to get the length of.
+ *
+ * @returns
+ * The amount of elements the vector contains.
+ */
+MODULE_API size_t vector_length(vector_t *vector) {
+    return MODULE_API_CALL(vector_length)(vector);
+}
+
+/**
+ * @brief Get an element at an index in the vector.
+ *
+ * Get the *index'th* element from the head of the vector in constant time.
+ *
+ * @param vector        The vector to get an element from.
+ * @param index         The index of the element in the vector.
+ *
+ * @returns
+ * The element at *index* in the vector or NULL otherwise.
+ */
+MODULE_API void *vector_at(vector_t *vector, size_t index) {
+    return MODULE_API_CALL(vector_at)(vector, index);
+}
+
+/**
+ * @brief Push an element on the vector.
+ *
+ * Appends an element to the vector.
+ *
+ * @param vector        The vector to append to.
+ * @param element       The element to append.
+ */
+MODULE_API void vector_push(vector_t *vector, void *element) {
+    return MODULE_API_CALL(vector_push)(vector, element);
+}
+
+/**
+ * @brief Prepend an element to the vector.
+ *
+ * Puts an element in front of the head of the vector.
+ *
+ * @param vector        The vector to prepend to.
+ * @param element       The element to prepend.
+ */
+MODULE_API void vector_prepend(vector_t *vector, void *element) {
+    return MODULE_API_CALL(vector_prepend)(vector, element);
+}
+
+#ifdef DOXYGEN_SHOULD_SKIP_THIS
+/**
+ * @brief Sort a vector
+ *
+ * Sorts a vector using a predicate the same way as #list_sort, elements
+ * which compare equal keep their order.
+ *
+ * @param vector        The vector to sort.
+ * @param predicate     The predicate (comparison function) callback to sort the vector.
+ *
+ */
+void vector_sort(vector_t *vector, T predicate);
+
+/**
+ * @brief Iterate over a vector with a callback.
+ *
+ * Iterates over a vector with a callback the same way as #list_foreach.
+ *
+ * @param vector        The vector to iterate through.
+ * @param pass          Something to pass as the second argument for the callback.
+ * @param callback      The callback function to execute on each iteration.
+ *
+ */
+void vector_foreach(vector_t *vector, void *pass, T callback);
+
+/**
+ * @brief Search for something in a vector.
+ *
+ * Searches for something in a vector using a predicate callback the same
+ * way as #list_search.
+ *
+ * @param vector        The vector to search in.
+ * @param pass          Something to pass as the second argument for the predicate.
+ * @param predicate     The predicate function to execute when searching.
+ *
+ * @returns
+ * The value in the vector when found, NULL otherwise.
+ */
+void *vector_search(vector_t *vector, const void *pass, T predicate);
+#else
+MODULE_API void vector_sort_impl(vector_t *vector, bool (*predicate)(const void *, const void *)) {
+    return MODULE_API_CALL(vector_sort_impl)(vector, predicate);
+}
+
+MODULE_API void vector_foreach_impl(vector_t *vector, void *pass, void (*callback)(void *, void *)) {
+    return MODULE_API_CALL(vector_foreach_impl)(vector, pass, callback);
+}
+
+MODULE_API void *vector_search_impl(vector_t *vector, const void *pass, bool (*predicate)(const void *, const void *)) {
+    return MODULE_API_CALL(vector_search_impl)(vector, pass, predicate);
+}
+
+#define vector_sort(VECTOR, PREDICATE) \
+    vector_sort_impl((VECTOR), ((bool (*)(const void *, const void *))(PREDICATE)))
+
+#define vector_foreach(VECTOR, PASS, CALLBACK) \
+    vector_foreach_impl((VECTOR), (PASS), ((void (*)(void *, void *))(CALLBACK)))
+
+#define vector_search(VECTOR, PASS, PREDICATE) \
+    vector_search_impl((VECTOR), (PASS), ((bool (*)(const void *, const void *))(PREDICATE)))
+#endif /*! DOXYGEN_SHOULD_SKIP_THIS */
+
+/** @} */
+
 /**
  * @defgroup String
  *
@@ -436,7 +608,8 @@ typedef struct hashtable_s hashtable_t;
 /**
  * @brief Create a hashtable.
  *
- * @param size          The number of buckets to use for this hashtable.
+ * @param size          The number of elements expected, the hashtable grows
+ *                      past it as needed.
  *
  * @returns
  * A new hashtable.
@@ -678,6 +851,49 @@ MODULE_API const char *irc_pattern(irc_t *irc, const char *newpattern) {
     return MODULE_API_CALL(irc_pattern)(irc, newpattern);
 }
 
+/**
+ * @brief Query always module dispatch statistics.
+ *
+ * Always modules are only dispatched for channels which received a new
+ * message. This reports how many dispatches happened and how many were
+ * skipped for channels without one.
+ *
+ * @param irc           Instance.
+ * @param dispatched    Where to store the amount of dispatches.
+ * @param skipped       Where to store the amount of skipped dispatches.
+ */
+MODULE_API void irc_dispatch_stats(irc_t *irc, size_t *dispatched, size_t *skipped) {
+    return MODULE_API_CALL(irc_dispatch_stats)(irc, dispatched, skipped);
+}
+
+/**
+ * @brief Connection lag statistics.
+ *
+ * The bot sends the server a PING every so often and measures how long
+ * the PONG takes. Times are in microseconds.
+ */
+typedef struct {
+    size_t             samples; /**< PONGs received. */
+    size_t             missed;  /**< PINGs in a row which are still unanswered. */
+    unsigned long long last;    /**< Latest round trip. */
+    unsigned long long p50;     /**< Median round trip. */
+    unsigned long long p99;     /**< 99th percentile round trip. */
+    unsigned long long max;     /**< Longest round trip. */
+} irc_lag_stats_t;
+
+/**
+ * @brief Query connection lag statistics.
+ *
+ * Reports the round trip times to the server, percentiles are accurate to
+ * within about 6%.
+ *
+ * @param irc           Instance.
+ * @param stats         Where to store the statistics.
+ */
+MODULE_API void irc_lag_stats(irc_t *irc, irc_lag_stats_t *stats) {
+    return MODULE_API_CALL(irc_lag_stats)(irc, stats);
+}
+
 /**
  * @brief Module operation status codes.
  *
@@ -1240,31 +1456,31 @@ typedef struct {
 } svn_entry_t;
 
 /**
- * @brief Split a string by delimiter into a list.
+ * @brief Split a string by delimiter into a vector.
  *
  * @param string            The string to split.
  * @param delimiter         The delimiter to split the string by.
  *
  * @returns
- * A list of `const char *' strings split by that delimiter.
+ * A vector of `const char *' strings split by that delimiter.
  */
-MODULE_API list_t *strsplit(const char *string, const char *delimiter) {
+MODULE_API vector_t *strsplit(const char *string, const char *delimiter) {
     return MODULE_API_CALL(strsplit)(string, delimiter);
 }
 
 /**
- * @brief Split a string by delimiter into a list with a limit.
+ * @brief Split a string by delimiter into a vector with a limit.
  *
  * @param string            The string to split.
  * @param delimiter         The delimiter to split the string by.
  * @param count             An upper limit for splits.
  *
  * @returns
- * A list of `const char *' strings split by that delimiter. If the upper limit
- * was met the last element in the list may contain strings still containing the
+ * A vector of `const char *' strings split by that delimiter. If the upper limit
+ * was met the last element in the vector may contain strings still containing the
  * delimiter.
  */
-MODULE_API list_t *strnsplit(const char *string, const char *delimiter, size_t count) {
+MODULE_API vector_t *strnsplit(const char *string, const char *delimiter, size_t count) {
     return MODULE_API_CALL(strnsplit)(string, delimiter, count);
 }
 
@@ -1298,17 +1514,53 @@ MODULE_API const char *strdur(unsigned long long dur) {
 /**
  * @brief DNS Resolve
  *
- * Resolve a domain name.
+ * Resolve a domain name without waiting for the nameservers. Only names
+ * which are already known (address literals, the hosts file and recent
+ * answers) are resolved right away, anything else is looked up in the
+ * background so a later call may succeed. Use #dns_async to be told when
+ * the answer arrives.
  *
  * @param url               The URL
  *
  * @returns
- * A list of `const char *' strings containing the resolved ip-addresses.
+ * A list of `const char *' strings containing the resolved ip-addresses or
+ * NULL when the name isn't known (yet).
  */
 MODULE_API list_t *dns(const char *url) {
     return MODULE_API_CALL(dns)(url);
 }
 
+/**
+ * @brief Asynchronous DNS Resolve callback.
+ *
+ * @param irc               The IRC instance the lookup was made on.
+ * @param channel           The channel given to #dns_async.
+ * @param user              The user given to #dns_async.
+ * @param addresses         A list of `const char *' strings containing the
+ *                          resolved ip-addresses or NULL when the name could
+ *                          not be resolved.
+ */
+typedef void (*dns_callback_t)(irc_t *irc, const char *channel, const char *user, list_t *addresses);
+
+/**
+ * @brief Asynchronous DNS Resolve
+ *
+ * Resolve a domain name in the background. Once the answer arrives the
+ * callback is invoked like a command of its own, given the channel and
+ * user the lookup was made for.
+ *
+ * @param url               The URL
+ * @param channel           The channel passed on to the callback
+ * @param user              The user passed on to the callback
+ * @param callback          Called once the answer arrives.
+ *
+ * @returns
+ * True if the lookup was started, false otherwise.
+ */
+MODULE_API bool dns_async(const char *url, const char *channel, const char *user, dns_callback_t callback) {
+    return MODULE_API_CALL(dns_async)(url, channel, user, callback);
+}
+
 /** @} */
 
 #endif
@@ -31,9 +31,9 @@ static void lmgtfy_help(irc_t *irc, const char *channel, const char *user) {
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t *split  = strnsplit(message, " ", 1);
-    char   *method = list_shift(split);
-    char   *what   = list_shift(split);
+    vector_t *split  = strnsplit(message, " ", 1);
+    char     *method = vector_shift(split);
+    char     *what   = vector_shift(split);
 
     if (!method || !strcmp(method, "-help"))
         return lmgtfy_help(irc, channel, user);
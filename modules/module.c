@@ -210,9 +210,9 @@ void module_enter(irc_t *irc, const char *channel, const char *user, const char
     if (!access_check(irc, user, ACCESS))
         return irc_write(irc, channel, "%s: You need access level %d", user, ACCESS);
 
-    list_t     *split  = strnsplit(message, " ", 2);
-    const char *method = list_shift(split);
-    const char *module = list_shift(split);
+    vector_t   *split  = strnsplit(message, " ", 2);
+    const char *method = vector_shift(split);
+    const char *module = vector_shift(split);
 
     if (!strcmp(method, "-load"))         return mod_load(irc, channel, user, module);
     if (!strcmp(method, "-reload"))       return mod_reload(irc, channel, user, module);
@@ -37,9 +37,9 @@ static bool obit_select_find(const char *thing, const char *content) {
     return false;
 }
 
-static void obit_add(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *thing   = list_shift(list);
-    char *content = list_shift(list);
+static void obit_add(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *thing   = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!obit_type(thing))
         return obit_help(irc, channel, user);
@@ -57,9 +57,9 @@ static void obit_add(irc_t *irc, const char *channel, const char *user, list_t *
     irc_write(irc, channel, "%s: Ok, added %s to %s list", user, content, thing);
 }
 
-static void obit_forget(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *thing   = list_shift(list);
-    char *content = list_shift(list);
+static void obit_forget(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *thing   = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!obit_type(thing))
         return obit_help(irc, channel, user);
@@ -143,8 +143,8 @@ static void obit_random(irc_t *irc, const char *channel, const char *user, const
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t *list   = strnsplit(message, " ", 2);
-    char   *method = list_shift(list);
+    vector_t *list   = strnsplit(message, " ", 2);
+    char     *method = vector_shift(list);
 
     if (method && !strcmp(method, "-help"))
         return obit_help(irc, channel, user);
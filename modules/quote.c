@@ -110,8 +110,8 @@ static void quote_entry(irc_t *irc, const char *channel, const char *user, const
     irc_write(irc, channel, "%s: <%s> %s", user, quotenick, quotemessage);
 }
 
-static void quote_stats(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    const char *who = list_shift(list);
+static void quote_stats(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    const char *who = vector_shift(list);
     if (!who) {
         int count   = quote_length();
         int request = database_request_count(irc, "QUOTES");
@@ -130,9 +130,9 @@ static void quote_stats(irc_t *irc, const char *channel, const char *user, list_
         irc_write(irc, channel, "%s: you have %d %s", user, count, plural);
 }
 
-static void quote_add(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *quotenick    = list_shift(list);
-    char *quotemessage = list_shift(list);
+static void quote_add(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *quotenick    = vector_shift(list);
+    char *quotemessage = vector_shift(list);
 
     if (!quotenick || !quotemessage)
         return;
@@ -153,9 +153,9 @@ static void quote_add(irc_t *irc, const char *channel, const char *user, list_t
     irc_write(irc, channel, "%s: Ok, added quote: <%s> %s", user, quotenick, quotemessage);
 }
 
-static void quote_forget(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *quotenick    = list_shift(list);
-    char *quotemessage = list_shift(list);
+static void quote_forget(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *quotenick    = vector_shift(list);
+    char *quotemessage = vector_shift(list);
 
     if (!quotenick || !quotemessage)
         return;
@@ -184,9 +184,9 @@ static void quote_forget(irc_t *irc, const char *channel, const char *user, list
     );
 }
 
-static void quote_reauthor(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *from = list_shift(list);
-    char *to   = list_shift(list);
+static void quote_reauthor(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *from = vector_shift(list);
+    char *to   = vector_shift(list);
 
     if (!from || !to)
         return quote_help(irc, channel, user);
@@ -213,8 +213,8 @@ void module_enter(irc_t *irc, const char *channel, const char *user, const char
     if (!message)
         return quote_entry_random(irc, channel, user);
 
-    list_t     *list   = strnsplit(message, " ", 2);
-    const char *method = list_shift(list);
+    vector_t   *list   = strnsplit(message, " ", 2);
+    const char *method = vector_shift(list);
 
     if (!strcmp(method, "-help"))     return quote_help(irc, channel, user);
     if (!strcmp(method, "-add"))      return quote_add(irc, channel, user, list);
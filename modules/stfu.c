@@ -36,9 +36,9 @@ static bool stfu_select_find(const char *thing, const char *content) {
     return false;
 }
 
-static void stfu_add(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *thing   = list_shift(list);
-    char *content = list_shift(list);
+static void stfu_add(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *thing   = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!stfu_type(thing))
         return stfu_help(irc, channel, user);
@@ -56,9 +56,9 @@ static void stfu_add(irc_t *irc, const char *channel, const char *user, list_t *
     irc_write(irc, channel, "%s: Ok, added %s to %s list", user, content, thing);
 }
 
-static void stfu_forget(irc_t *irc, const char *channel, const char *user, list_t *list) {
-    char *thing   = list_shift(list);
-    char *content = list_shift(list);
+static void stfu_forget(irc_t *irc, const char *channel, const char *user, vector_t *list) {
+    char *thing   = vector_shift(list);
+    char *content = vector_shift(list);
 
     if (!stfu_type(thing))
         return stfu_help(irc, channel, user);
@@ -132,8 +132,8 @@ static void stfu_random(irc_t *irc, const char *channel, const char *user, const
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t *list   = strnsplit(message, " ", 2);
-    char   *method = list_shift(list);
+    vector_t *list   = strnsplit(message, " ", 2);
+    char     *method = vector_shift(list);
 
     if (!method || !strcmp(method, "-help"))
         return stfu_help(irc, channel, user);
@@ -41,7 +41,7 @@ static void system_test_large_payload(irc_t *irc, const char *channel, const cha
 static void system_help(irc_t *irc, const char *channel, const char *user) {
     irc_write(irc, channel,
         "%s: system <-shutdown|-restart|-recompile|-daemonize|-test-timeout|-test-crash|"
-        "-topic|-version|-part-all|-users|-channels>|<-join|-part> <channel>|"
+        "-topic|-version|-part-all|-users|-channels|-dispatch|-lag>|<-join|-part> <channel>|"
         "<-pattern> <pattern>",
         user
     );
@@ -108,6 +108,23 @@ static void system_channels(irc_t *irc, const char *channel, const char *user) {
     irc_write(irc, channel, "%s: %s", user, string_contents(string));
 }
 
+static void system_dispatch(irc_t *irc, const char *channel, const char *user) {
+    size_t dispatched = 0;
+    size_t skipped    = 0;
+    irc_dispatch_stats(irc, &dispatched, &skipped);
+    irc_write(irc, channel, "%s: always modules dispatched %zu times, %zu dispatches skipped", user, dispatched, skipped);
+}
+
+static void system_lag(irc_t *irc, const char *channel, const char *user) {
+    irc_lag_stats_t stats;
+    irc_lag_stats(irc, &stats);
+    if (!stats.samples)
+        return irc_write(irc, channel, "%s: no lag measured yet", user);
+
+    irc_write(irc, channel, "%s: lag %.1fms (p50 %.1fms, p99 %.1fms, max %.1fms) over %zu PINGs, %zu unanswered",
+        user, stats.last / 1000.0, stats.p50 / 1000.0, stats.p99 / 1000.0, stats.max / 1000.0, stats.samples, stats.missed);
+}
+
 static void system_topic(irc_t *irc, const char *channel, const char *user) {
     irc_write(irc, channel, "%s: %s", user, irc_topic(irc, channel));
 }
@@ -122,8 +139,8 @@ static void system_pattern(irc_t *irc, const char *channel, const char *user, co
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t     *list   = strnsplit(message, " ", 2);
-    const char *method = list_shift(list);
+    vector_t   *list   = strnsplit(message, " ", 2);
+    const char *method = vector_shift(list);
 
     /* Block it by access */
     if (!access_check(irc, user, ACCESS))
@@ -139,15 +156,17 @@ void module_enter(irc_t *irc, const char *channel, const char *user, const char
     if (!strcmp(method, "-test-timeout"))       return system_test_timeout();
     if (!strcmp(method, "-test-crash"))         return system_test_crash();
     if (!strcmp(method, "-test-large-payload")) return system_test_large_payload(irc, channel, user);
-    if (!strcmp(method, "-join"))               return system_join(irc, channel, user, list_shift(list));
-    if (!strcmp(method, "-part"))               return system_part(irc, channel, user, list_shift(list));
+    if (!strcmp(method, "-join"))               return system_join(irc, channel, user, vector_shift(list));
+    if (!strcmp(method, "-part"))               return system_part(irc, channel, user, vector_shift(list));
     if (!strcmp(method, "-part-all"))           return system_part_all(irc, channel, user);
     if (!strcmp(method, "-version"))            return system_version(irc, channel, user);
     if (!strcmp(method, "-users"))              return system_users(irc, channel, user);
     if (!strcmp(method, "-channels"))           return system_channels(irc, channel, user);
     if (!strcmp(method, "-topic"))              return system_topic(irc, channel, user);
-    if (!strcmp(method, "-pattern"))            return system_pattern(irc, channel, user, list_shift(list));
-    if (!strcmp(method, "-echo"))               return irc_write(irc, channel, list_shift(list));
+    if (!strcmp(method, "-dispatch"))           return system_dispatch(irc, channel, user);
+    if (!strcmp(method, "-lag"))                return system_lag(irc, channel, user);
+    if (!strcmp(method, "-pattern"))            return system_pattern(irc, channel, user, vector_shift(list));
+    if (!strcmp(method, "-echo"))               return irc_write(irc, channel, vector_shift(list));
 
 
     return system_help(irc, channel, user);
@@ -76,9 +76,9 @@ static bool tipjar_decrement(irc_t *irc, const char *channel, const char *target
 }
 
 void module_enter(irc_t *irc, const char *channel, const char *user, const char *message) {
-    list_t     *list   = strnsplit(message, " ", 2);
-    const char *first  = list_shift(list);
-    const char *second = list_shift(list);
+    vector_t   *list   = strnsplit(message, " ", 2);
+    const char *first  = vector_shift(list);
+    const char *second = vector_shift(list);
 
     if (!access_range(irc, user, 4))
         return irc_write(irc, user, "You need level 4 or higher");
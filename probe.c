@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "probe.h"
+
+#define PROBE_MIN 8
+
+void probe_init(probe_t *probe, size_t width) {
+    probe->slots = NULL;
+    probe->width = width;
+    probe->size  = 0;
+    probe->count = 0;
+}
+
+void probe_release(probe_t *probe) {
+    free(probe->slots);
+    probe->slots = NULL;
+    probe->size  = 0;
+    probe->count = 0;
+}
+
+void probe_reserve(probe_t *probe, size_t count) {
+    size_t size = probe->size ? probe->size : PROBE_MIN;
+    while (probe_crowded(count, size))
+        size *= 2;
+    if (size == probe->size)
+        return;
+
+    probe_t grown = *probe;
+    grown.slots = calloc(size, probe->width);
+    grown.size  = size;
+
+    for (size_t i = 0; i < probe->size; i++) {
+        probe_slot_t *slot = probe_at(probe, i);
+        if (!slot->entry)
+            continue;
+        size_t index = slot->hash & (size - 1);
+        while (probe_at(&grown, index)->entry)
+            index = (index + 1) & (size - 1);
+        memcpy(probe_at(&grown, index), slot, probe->width);
+    }
+
+    free(probe->slots);
+    *probe = grown;
+}
+
+/* The slot holding a key or the empty slot where it would go */
+static probe_slot_t *probe_slot(probe_t *probe, uint32_t hash, probe_match_t match, const void *key) {
+    size_t mask = probe->size - 1;
+    size_t index = hash & mask;
+    for (;;) {
+        probe_slot_t *slot = probe_at(probe, index);
+        if (!slot->entry || (slot->hash == hash && match(slot->entry, key)))
+            return slot;
+        index = (index + 1) & mask;
+    }
+}
+
+probe_slot_t *probe_find(probe_t *probe, uint32_t hash, probe_match_t match, const void *key) {
+    if (!probe->count)
+        return NULL;
+    probe_slot_t *slot = probe_slot(probe, hash, match, key);
+    return slot->entry ? slot : NULL;
+}
+
+probe_slot_t *probe_claim(probe_t *probe, uint32_t hash, probe_match_t match, const void *key) {
+    probe_reserve(probe, probe->count + 1);
+    probe_slot_t *slot = probe_slot(probe, hash, match, key);
+    if (!slot->entry) {
+        memset(slot, 0, probe->width);
+        slot->hash = hash;
+        probe->count++;
+    }
+    return slot;
+}
+
+void probe_vacate(probe_t *probe, probe_slot_t *slot) {
+    size_t mask = probe->size - 1;
+    size_t hole = ((unsigned char *)slot - probe->slots) / probe->width;
+
+    for (size_t next = (hole + 1) & mask; probe_at(probe, next)->entry; next = (next + 1) & mask) {
+        if (probe_shifts(mask, probe_at(probe, next)->hash & mask, hole, next)) {
+            memcpy(probe_at(probe, hole), probe_at(probe, next), probe->width);
+            hole = next;
+        }
+    }
+
+    memset(probe_at(probe, hole), 0, probe->width);
+    probe->count--;
+}
@@ -0,0 +1,133 @@
+#ifndef REDROID_PROBE_HDR
+#define REDROID_PROBE_HDR
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Type: probe_slot_t
+ *  The start of every slot of an open addressed table. A slot may carry
+ *  more after it, the table is told how wide its slots are.
+ */
+typedef struct {
+    void     *entry; /* NULL marks an empty slot */
+    uint32_t  hash;  /* of the key of the entry  */
+} probe_slot_t;
+
+/*
+ * Type: probe_t
+ *  An open addressed table with linear probing. Removal shifts the slots
+ *  after a hole back rather than leaving tombstones. The table does no
+ *  locking, it belongs to the structure embedding it.
+ */
+typedef struct {
+    unsigned char *slots;
+    size_t         width; /* bytes per slot                               */
+    size_t         size;  /* power of two, zero before the first slot     */
+    size_t         count;
+} probe_t;
+
+typedef bool (*probe_match_t)(const void *entry, const void *key);
+
+/*
+ * Function: probe_init
+ *  Initialize an empty table, no memory is allocated until the first
+ *  slot is claimed.
+ *
+ * Parameters:
+ *  probe   - The table
+ *  width   - The size of a slot, at least that of <probe_slot_t>
+ */
+void probe_init(probe_t *probe, size_t width);
+
+/*
+ * Function: probe_release
+ *  Free the slots of a table, leaving it empty. The entries are left to
+ *  the owner, it can visit them with <probe_at> beforehand.
+ *
+ * Parameters:
+ *  probe   - The table
+ */
+void probe_release(probe_t *probe);
+
+/*
+ * Function: probe_reserve
+ *  Make room for an amount of entries in total.
+ *
+ * Parameters:
+ *  probe   - The table
+ *  count   - The amount of entries the table has to hold
+ */
+void probe_reserve(probe_t *probe, size_t count);
+
+/*
+ * Function: probe_find
+ *  Find the slot of a key.
+ *
+ * Parameters:
+ *  probe   - The table
+ *  hash    - The hash of the key
+ *  match   - Called with the entry of each slot with the same hash
+ *  key     - Passed as the second argument of match
+ *
+ * Returns:
+ *  The slot or NULL if no entry matches.
+ */
+probe_slot_t *probe_find(probe_t *probe, uint32_t hash, probe_match_t match, const void *key);
+
+/*
+ * Function: probe_claim
+ *  Find the slot of a key, claiming an empty one when there is none. A
+ *  claimed slot has its hash set and the rest zeroed, the caller must set
+ *  its entry.
+ *
+ * Parameters:
+ *  probe   - The table
+ *  hash    - The hash of the key
+ *  match   - Called with the entry of each slot with the same hash
+ *  key     - Passed as the second argument of match
+ *
+ * Returns:
+ *  The slot, its entry is NULL when it was claimed.
+ */
+probe_slot_t *probe_claim(probe_t *probe, uint32_t hash, probe_match_t match, const void *key);
+
+/*
+ * Function: probe_vacate
+ *  Empty a slot. Pointers to other slots are invalid afterwards.
+ *
+ * Parameters:
+ *  probe   - The table
+ *  slot    - A slot returned by <probe_find> or <probe_claim>
+ */
+void probe_vacate(probe_t *probe, probe_slot_t *slot);
+
+/*
+ * Function: probe_at
+ *  Get a slot by index, for visiting every slot up to the size of the
+ *  table. Slots with a NULL entry are empty.
+ */
+static inline probe_slot_t *probe_at(const probe_t *probe, size_t index) {
+    return (probe_slot_t *)(probe->slots + index * probe->width);
+}
+
+/*
+ * Function: probe_crowded
+ *  Whether a table of a size holding an amount of entries has to grow,
+ *  tables are kept at most three quarters full.
+ */
+static inline bool probe_crowded(size_t count, size_t size) {
+    return count * 4 > size * 3;
+}
+
+/*
+ * Function: probe_shifts
+ *  Whether the slot at next, whose entry hashes to home, has to move back
+ *  into a hole before it. Otherwise a probe from home would stop at the
+ *  hole and miss it.
+ */
+static inline bool probe_shifts(size_t mask, size_t home, size_t hole, size_t next) {
+    return ((next - home) & mask) >= ((next - hole) & mask);
+}
+
+#endif
@@ -10,10 +10,14 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "sock.h"
 #include "ssl.h"
 
+#define SOCK_OUTPUT_SIZE 4096 /* initial size of the output buffer */
+#define SOCK_OUTPUT_LINE 512  /* room reserved before formatting into it */
+
 bool sock_nonblock(int fd) {
     int flags = fcntl(fd, F_GETFL);
     if (flags == -1)
@@ -64,91 +68,24 @@ sock_listen_error:
     return -1;
 }
 
-static int sock_connection(const char *host, const char *port, char **resolved) {
-    int status;
-    int sock;
-
-    struct addrinfo *result;
-    struct addrinfo  hints = {
-        .ai_family   = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM
-    };
-
-    if ((status = getaddrinfo(host, port, &hints, &result)) < 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-        return -1;
-    }
-
-    if ((sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0) {
-        fprintf(stderr, "failed to get socket: %s:%s\n", host, port);
-        goto sock_get_error;
-    }
-
-    /* make the socket non blocking for connect */
-    if (!sock_nonblock(sock))
-        goto sock_get_error;
-
-    /* Try all of them until it succeeds */
-    bool failed = false;
-    for (struct addrinfo *current = result; current; current = current->ai_next) {
-        char ipbuffer[INET6_ADDRSTRLEN];
-        void *addr = NULL;
-        if (current->ai_family == AF_INET) {
-            struct sockaddr_in *ipv4 = (struct sockaddr_in*)current->ai_addr;
-            addr = &(ipv4->sin_addr);
-        } else {
-            struct sockaddr_in6 *ipv6 = (struct sockaddr_in6*)current->ai_addr;
-            addr = &(ipv6->sin6_addr);
-        }
-
-        /* The socket needs to also change for this */
-        close(sock);
-        if ((sock = socket(current->ai_family, current->ai_socktype, current->ai_protocol)) < 0)
-            goto sock_get_error;
-        if (!sock_nonblock(sock))
-            goto sock_get_error;
-
-        inet_ntop(current->ai_family, addr, ipbuffer, sizeof(ipbuffer));
-        if (connect(sock, current->ai_addr, current->ai_addrlen) != 0 && errno != EINPROGRESS) {
-            if (current->ai_next)
-                fprintf(stderr, "failed to connect: %s:%s (trying next address in list)\n", host, ipbuffer);
-            else
-                fprintf(stderr, "failed to connect: %s:%s %s\n", host, ipbuffer, strerror(errno));
-            failed = true;
-        } else {
-            result    = current;
-            failed    = false;
-            *resolved = strdup(ipbuffer);
-            break;
-        }
-    }
-    if (failed)
-        goto sock_get_error;
-
-    freeaddrinfo(result);
-    return sock;
-
-sock_get_error:
-    freeaddrinfo(result);
-    return -1;
-}
-
 /* standard non SSL sockets */
 typedef struct {
     int fd;
 } sock_ctx_t;
 
 static int sock_standard_recv(sock_ctx_t *ctx, char *buffer, size_t size) {
-    int ret;
-    if ((ret = recv(ctx->fd, buffer, size, 0)) <= 0)
-        return -1;
+    ssize_t ret;
+    while ((ret = recv(ctx->fd, buffer, size, 0)) == -1 && errno == EINTR)
+        ;
+    if (ret == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? -1 : 0;
     return ret;
 }
 
 static int sock_standard_send(sock_ctx_t *ctx, const char *data, size_t size) {
-    int ret;
-    if ((ret = send(ctx->fd, data, size, 0)) <= 0)
-        return -1;
+    ssize_t ret;
+    if ((ret = send(ctx->fd, data, size, MSG_NOSIGNAL)) == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
     return ret;
 }
 
@@ -164,6 +101,7 @@ static bool sock_standard_destroy(sock_ctx_t *ctx, sock_restart_t *restart) {
     }
 
     bool succeed = (shutdown(ctx->fd, SHUT_RDWR) == 0);
+    close(ctx->fd);
     free(ctx);
     return succeed;
 }
@@ -172,19 +110,66 @@ static int sock_standard_getfd(const sock_ctx_t *ctx) {
     return ctx->fd;
 }
 
+/* buffered output */
+static sock_t *sock_output_create(sock_t *socket) {
+    if (!socket)
+        return NULL;
+
+    socket->output.data   = NULL;
+    socket->output.size   = 0;
+    socket->output.length = 0;
+    socket->output.offset = 0;
+    pthread_mutex_init(&socket->output.lock, NULL);
+    return socket;
+}
+
+static void sock_output_destroy(sock_output_t *output) {
+    pthread_mutex_destroy(&output->lock);
+    free(output->data);
+}
+
+/*
+ * Make room for at least size more bytes at the end of the output buffer
+ * and return where they go. Bytes already written are dropped from the
+ * front first so the buffer only grows when that isn't enough.
+ */
+static char *sock_output_reserve(sock_output_t *output, size_t size) {
+    if (output->offset && output->length + size > output->size) {
+        memmove(output->data, output->data + output->offset, output->length - output->offset);
+        output->length -= output->offset;
+        output->offset  = 0;
+    }
+
+    if (output->length + size > output->size) {
+        size_t resize = output->size ? output->size : SOCK_OUTPUT_SIZE;
+        while (resize < output->length + size)
+            resize <<= 1;
+
+        char *data = realloc(output->data, resize);
+        if (!data)
+            return NULL;
+
+        output->data = data;
+        output->size = resize;
+    }
+
+    return output->data + output->length;
+}
+
 static sock_t *sock_standard_create(int fd, bool listen, const char *host, bool nonblocking) {
     sock_t     *socket = malloc(sizeof(*socket));
     sock_ctx_t *data   = malloc(sizeof(*data));
 
-    data->fd        = fd;
-    socket->data    = data;
-    socket->getfd   = (sock_getfd_func)&sock_standard_getfd;
-    socket->send    = (sock_send_func)&sock_standard_send;
-    socket->recv    = (sock_recv_func)&sock_standard_recv;
-    socket->destroy = (sock_destroy_func)&sock_standard_destroy;
-    socket->ssl     = false;
-    socket->listen  = listen;
-    socket->host    = strdup(host);
+    data->fd          = fd;
+    socket->data      = data;
+    socket->getfd     = (sock_getfd_func)&sock_standard_getfd;
+    socket->send      = (sock_send_func)&sock_standard_send;
+    socket->recv      = (sock_recv_func)&sock_standard_recv;
+    socket->destroy   = (sock_destroy_func)&sock_standard_destroy;
+    socket->handshake = NULL;
+    socket->ssl       = false;
+    socket->listen    = listen;
+    socket->host      = strdup(host);
 
     if (nonblocking && !sock_nonblock(fd)) {
         free(socket->host);
@@ -193,19 +178,21 @@ static sock_t *sock_standard_create(int fd, bool listen, const char *host, bool
         return NULL;
     }
 
-    return socket;
+    return sock_output_create(socket);
 }
 
 /* exposed interface */
 sock_t *sock_create(const char *host, const char *port, sock_restart_t *restart) {
     bool listen = !strcmp(host, "::listen");
 
-    /* Listen servers can be restarted as well */
+    /*
+     * Listen servers can be restarted as well. Secure connections never
+     * are, their TLS session can't be carried across.
+     */
     if (restart->fd != -1) {
-#ifdef HAS_SSL
         if (restart->ssl)
-            return ssl_create(restart->fd, restart);
-#endif
+            return NULL;
+
         /*
          * We'll need to re-resolve the peer name as the restart file
          * doesn't contain that information.
@@ -229,64 +216,340 @@ sock_t *sock_create(const char *host, const char *port, sock_restart_t *restart)
     }
 
     /*
-     * Listen sockets act a little different than connection sockets.
-     * We make those discinctions here.
+     * Listen sockets act a little different than connection sockets, those
+     * are established asynchronously with sock_connect_create.
      */
-    int fd = -1;
-    if (listen) {
-        fd = sock_listen(port);
-        if (fd == -1)
-            return NULL;
+    if (!listen)
+        return NULL;
+
+    int fd = sock_listen(port);
+    if (fd == -1)
+        return NULL;
+
+    /* Listen servers cannot SSL */
+    return sock_standard_create(fd, true, host, true);
+}
+
+/*
+ * Connection establishment (Happy Eyeballs, RFC 8305). The addresses of a
+ * host are ordered to alternate between address families, starting with the
+ * family of the first address returned by the resolver. The caller starts an
+ * attempt every SOCK_CONNECT_DELAY milliseconds while earlier ones are still
+ * in flight, the first one to complete wins and all others are abandoned.
+ */
+struct sock_connect_s {
+    char                    *host;
+    unsigned short           port;
+    struct sockaddr_storage *candidates;
+    int                     *fds;      /* in flight per candidate, -1 if not */
+    size_t                   count;
+    size_t                   next;     /* candidate the next attempt is made to */
+    size_t                   winner;
+};
+
+static socklen_t sock_connect_length(const struct sockaddr_storage *address) {
+    return (address->ss_family == AF_INET6)
+               ? sizeof(struct sockaddr_in6)
+               : sizeof(struct sockaddr_in);
+}
 
-        /* Listen servers cannot SSL */
-        return sock_standard_create(fd, true, host, true);
+static const char *sock_connect_address(const struct sockaddr_storage *address) {
+    static _Thread_local char buffer[INET6_ADDRSTRLEN];
+    if (getnameinfo((const struct sockaddr *)address, sock_connect_length(address), buffer, sizeof(buffer), NULL, 0, NI_NUMERICHOST) != 0)
+        return "unknown";
+    return buffer;
+}
+
+static void sock_connect_candidate(sock_connect_t *connection, const dns_address_t *address) {
+    struct sockaddr_storage *candidate = &connection->candidates[connection->count++];
+    memset(candidate, 0, sizeof(*candidate));
+
+    if (address->family == AF_INET6) {
+        struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)candidate;
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port   = htons(connection->port);
+        ipv6->sin6_addr   = address->ipv6;
+    } else {
+        struct sockaddr_in *ipv4 = (struct sockaddr_in *)candidate;
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port   = htons(connection->port);
+        ipv4->sin_addr   = address->ipv4;
     }
+}
 
-    char *resolved = NULL;
-    fd = sock_connection(host, port, &resolved);
-    if (fd == -1) {
-        free(resolved);
+/* Nothing is resolved here, the addresses are handed in with sock_connect_resolved */
+sock_connect_t *sock_connect_create(const char *host, const char *port) {
+    char         *end;
+    unsigned long number = strtoul(port, &end, 10);
+    if (*end || number == 0 || number > 65535) {
+        fprintf(stderr, "invalid port: %s:%s\n", host, port);
         return NULL;
     }
 
+    sock_connect_t *connection = malloc(sizeof(*connection));
+    connection->host       = strdup(host);
+    connection->port       = number;
+    connection->candidates = NULL;
+    connection->fds        = NULL;
+    connection->count      = 0;
+    connection->next       = 0;
+    connection->winner     = 0;
+
+    return connection;
+}
+
+const char *sock_connect_host(const sock_connect_t *connection) {
+    return connection->host;
+}
+
+void sock_connect_resolved(sock_connect_t *connection, const dns_address_t *addresses, size_t count) {
+    sock_connect_reset(connection);
+    connection->count  = 0;
+    connection->winner = 0;
+    if (count == 0)
+        return;
+
+    connection->candidates = realloc(connection->candidates, sizeof(struct sockaddr_storage) * count);
+    connection->fds        = realloc(connection->fds, sizeof(int) * count);
+
+    /* Interleave the families, the first family keeps going first */
+    int    first = addresses[0].family;
+    size_t same  = 0;
+    size_t other = 0;
+    for (;;) {
+        while (same < count && addresses[same].family != first)
+            same++;
+        while (other < count && addresses[other].family == first)
+            other++;
+        if (same == count && other == count)
+            break;
+        if (same < count)
+            sock_connect_candidate(connection, &addresses[same++]);
+        if (other < count)
+            sock_connect_candidate(connection, &addresses[other++]);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        connection->fds[i] = -1;
+
+    connection->winner = count;
+}
+
+int sock_connect_attempt(sock_connect_t *connection) {
+    while (connection->next < connection->count) {
+        size_t                   index   = connection->next++;
+        struct sockaddr_storage *address = &connection->candidates[index];
+        int                      fd;
+
+        if ((fd = socket(address->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+            continue;
+
+        if (!sock_nonblock(fd) || (connect(fd, (struct sockaddr *)address, sock_connect_length(address)) != 0 && errno != EINPROGRESS)) {
+            fprintf(stderr, "failed to connect: %s:%s %s\n", connection->host, sock_connect_address(address), strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        return connection->fds[index] = fd;
+    }
+    return -1;
+}
+
+sock_connect_status_t sock_connect_poll(sock_connect_t *connection) {
+    if (connection->count == 0)
+        return SOCK_CONNECT_IDLE;
+
+    struct pollfd polls[connection->count];
+    size_t        count = 0;
+
+    for (size_t i = 0; i < connection->next; i++)
+        if (connection->fds[i] != -1)
+            polls[count++] = (struct pollfd) { .fd = connection->fds[i], .events = POLLOUT };
+
+    if (count && poll(polls, count, 0) == -1)
+        return SOCK_CONNECT_PENDING;
+
+    /* Completion is only known for sure after asking for the error */
+    for (size_t i = 0, j = 0; i < connection->next && connection->winner == connection->count; i++) {
+        if (connection->fds[i] == -1 || !polls[j++].revents)
+            continue;
+
+        int error = 0;
+        if (getsockopt(connection->fds[i], SOL_SOCKET, SO_ERROR, &error, &(socklen_t){ sizeof(error) }) == -1)
+            error = errno;
+
+        if (error == 0) {
+            connection->winner = i;
+            break;
+        }
+
+        fprintf(stderr, "failed to connect: %s:%s %s\n", connection->host, sock_connect_address(&connection->candidates[i]), strerror(error));
+        close(connection->fds[i]);
+        connection->fds[i] = -1;
+    }
+
+    if (connection->winner != connection->count) {
+        for (size_t i = 0; i < connection->next; i++) {
+            if (i == connection->winner || connection->fds[i] == -1)
+                continue;
+            close(connection->fds[i]);
+            connection->fds[i] = -1;
+        }
+        return SOCK_CONNECT_ESTABLISHED;
+    }
+
+    for (size_t i = 0; i < connection->next; i++)
+        if (connection->fds[i] != -1)
+            return SOCK_CONNECT_PENDING;
+
+    return SOCK_CONNECT_IDLE;
+}
+
+sock_t *sock_connect_finish(sock_connect_t *connection, sock_restart_t *restart) {
+    if (connection->winner == connection->count)
+        return NULL;
+
+    int         fd       = connection->fds[connection->winner];
+    const char *resolved = sock_connect_address(&connection->candidates[connection->winner]);
+
+    connection->fds[connection->winner] = -1;
+    sock_connect_reset(connection);
+
 #ifdef HAS_SSL
     sock_t *sock = restart->ssl
-                       ? ssl_create(fd, restart)
-                       : sock_standard_create(fd, false, resolved, true);
+                       ? sock_output_create(ssl_create(fd, connection->host, restart))
+                       : sock_standard_create(fd, false, resolved, false);
 #else
-    sock_t *sock = sock_standard_create(fd, false, resolved, true);
+    (void)restart;
+    sock_t *sock = sock_standard_create(fd, false, resolved, false);
 #endif
-    free(resolved);
+    if (!sock)
+        close(fd);
     return sock;
 }
 
+void sock_connect_reset(sock_connect_t *connection) {
+    for (size_t i = 0; i < connection->count; i++) {
+        if (connection->fds[i] != -1)
+            close(connection->fds[i]);
+        connection->fds[i] = -1;
+    }
+    connection->next   = 0;
+    connection->winner = connection->count;
+}
+
+void sock_connect_destroy(sock_connect_t *connection) {
+    if (!connection)
+        return;
+
+    sock_connect_reset(connection);
+    free(connection->candidates);
+    free(connection->fds);
+    free(connection->host);
+    free(connection);
+}
+
+/*
+ * Lines are only formatted into the output buffer here, nothing is written
+ * until sock_flush. That way everything produced in one go leaves in a
+ * single write.
+ */
 int sock_sendf(sock_t *socket, const char *fmt, ...) {
-    char    buffer[4096];
-    size_t  length;
-    va_list args;
+    sock_output_t *output = &socket->output;
+    char          *tail;
+    int            length;
+    va_list        args;
 
     if (!*fmt)
         return 0;
 
+    pthread_mutex_lock(&output->lock);
+    if (!(tail = sock_output_reserve(output, SOCK_OUTPUT_LINE)))
+        goto sock_sendf_error;
+
     va_start(args, fmt);
-    length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    length = vsnprintf(tail, output->size - output->length, fmt, args);
     va_end(args);
 
-    if (length > sizeof(buffer))
-        abort();
+    if (length < 0)
+        goto sock_sendf_error;
 
-    if (socket->send(socket->data, buffer, length) <= 0)
-        return -1;
+    /* Didn't fit, format it again with enough room */
+    if ((size_t)length >= output->size - output->length) {
+        if (!(tail = sock_output_reserve(output, length + 1)))
+            goto sock_sendf_error;
+
+        va_start(args, fmt);
+        vsnprintf(tail, length + 1, fmt, args);
+        va_end(args);
+    }
 
+    output->length += length;
+    pthread_mutex_unlock(&output->lock);
     return length;
-}
 
-int sock_recv(sock_t *socket, char *buffer, size_t buffersize) {
-    return socket->recv(socket->data, buffer, buffersize);
+sock_sendf_error:
+    pthread_mutex_unlock(&output->lock);
+    return -1;
 }
 
 int sock_send(sock_t *socket, const char *message, size_t size) {
-    return socket->send(socket->data, message, size);
+    sock_output_t *output = &socket->output;
+    char          *tail;
+
+    pthread_mutex_lock(&output->lock);
+    if (!(tail = sock_output_reserve(output, size))) {
+        pthread_mutex_unlock(&output->lock);
+        return -1;
+    }
+    memcpy(tail, message, size);
+    output->length += size;
+    pthread_mutex_unlock(&output->lock);
+
+    return size;
+}
+
+/*
+ * Write out as much of the output buffer as the kernel takes. What is left
+ * stays buffered from the exact byte it stopped at, the owner flushes again
+ * once the socket is writable. Returns how many bytes are still pending or
+ * -1 on errors.
+ */
+int sock_flush(sock_t *socket) {
+    sock_output_t *output  = &socket->output;
+    int            pending = -1;
+
+    pthread_mutex_lock(&output->lock);
+    while (output->offset < output->length) {
+        int wrote = socket->send(socket->data, output->data + output->offset, output->length - output->offset);
+        if (wrote == -1)
+            goto sock_flush_error;
+        if (wrote == 0)
+            break;
+        output->offset += wrote;
+    }
+
+    pending = output->length - output->offset;
+    if (!pending)
+        output->length = output->offset = 0;
+
+sock_flush_error:
+    pthread_mutex_unlock(&output->lock);
+    return pending;
+}
+
+/*
+ * Sockets with a handshake (TLS) are connected before it completes. Returns
+ * 1 once it did, 0 while it waits for the socket and -1 when it failed.
+ */
+int sock_handshake(sock_t *socket) {
+    if (!socket->handshake)
+        return 1;
+    return socket->handshake(socket->data);
+}
+
+int sock_recv(sock_t *socket, char *buffer, size_t buffersize) {
+    return socket->recv(socket->data, buffer, buffersize);
 }
 
 int sock_getfd(const sock_t *socket) {
@@ -317,6 +580,8 @@ bool sock_destroy(sock_t *socket, sock_restart_t *restart) {
         return false;
 
     bool succeed = false;
+    sock_flush(socket);
+    sock_output_destroy(&socket->output);
     socket->destroy(socket->data, restart);
     free(socket->host);
     free(socket);
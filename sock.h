@@ -2,35 +2,79 @@
 #define REDROID_SOCK_HDR
 #include <stddef.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#include "dns.h"
 
 typedef struct {
     unsigned char    *data;
     size_t            size;
     int               fd;
     bool              ssl;
+    const char       *certificate; /* TLS client certificate and key (PEM) */
 } sock_restart_t;
 
 #define SOCK_RESTART_NIL &((sock_restart_t) { .fd = -1 })
 
+/*
+ * Send functions return how much was written, zero when the kernel buffer
+ * is full and -1 on errors.
+ */
 typedef int (*sock_send_func)(void *, const char *, size_t);
+
+/*
+ * Receive functions return how much was read, zero once the connection was
+ * closed or failed and -1 when there is nothing to read right now.
+ */
 typedef int (*sock_recv_func)(void *, char *, size_t);
 typedef int (*sock_getfd_func)(const void *);
 typedef bool (*sock_destroy_func)(void *, sock_restart_t *restart);
+typedef int (*sock_handshake_func)(void *);
 
 typedef struct {
-    void             *data;
-    sock_send_func    send;
-    sock_recv_func    recv;
-    sock_getfd_func   getfd;
-    sock_destroy_func destroy;
-    bool              ssl;
-    bool              listen;
-    char             *host;
+    char             *data;
+    size_t            size;
+    size_t            length;
+    size_t            offset;   /* bytes of data already written */
+    pthread_mutex_t   lock;
+} sock_output_t;
+
+typedef struct {
+    void               *data;
+    sock_output_t       output;
+    sock_send_func      send;
+    sock_recv_func      recv;
+    sock_getfd_func     getfd;
+    sock_destroy_func   destroy;
+    sock_handshake_func handshake; /* NULL for sockets without one */
+    bool                ssl;
+    bool                listen;
+    char               *host;
 } sock_t;
 
+typedef struct sock_connect_s sock_connect_t;
+
+typedef enum {
+    SOCK_CONNECT_PENDING,     /* attempts are in flight                */
+    SOCK_CONNECT_ESTABLISHED, /* an attempt won, see sock_connect_finish */
+    SOCK_CONNECT_IDLE         /* no attempts in flight                 */
+} sock_connect_status_t;
+
+#define SOCK_CONNECT_DELAY 250 /* ms before racing the next address */
+
 sock_t *sock_create(const char *host, const char *port, sock_restart_t *restart);
+sock_connect_t *sock_connect_create(const char *host, const char *port);
+const char *sock_connect_host(const sock_connect_t *connect);
+void sock_connect_resolved(sock_connect_t *connect, const dns_address_t *addresses, size_t count);
+int sock_connect_attempt(sock_connect_t *connect);
+sock_connect_status_t sock_connect_poll(sock_connect_t *connect);
+sock_t *sock_connect_finish(sock_connect_t *connect, sock_restart_t *restart);
+void sock_connect_reset(sock_connect_t *connect);
+void sock_connect_destroy(sock_connect_t *connect);
 int sock_send(sock_t *socket, const char *message, size_t size);
 int sock_sendf(sock_t *socket, const char *format, ...);
+int sock_flush(sock_t *socket);
+int sock_handshake(sock_t *socket);
 sock_t *sock_accept(sock_t *socket);
 int sock_recv(sock_t *socket, char *buffer, size_t buffersize);
 bool sock_destroy(sock_t *socket, sock_restart_t *restart);
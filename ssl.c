@@ -2,22 +2,98 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
+#include <pthread.h>
+#include <arpa/inet.h> /* inet_pton */
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
 #include "sock.h"
+#include "hashtable.h"
 
 #define CAFILE "/etc/ssl/certs/ca-certificates.crt"
 
+/*
+ * Sessions are created and destroyed on the event loops of all shards, the
+ * count of them which keeps GnuTLS initialized is guarded by ssl_lock like
+ * the session cache is.
+ */
 static int ssl_instances = 0;
 
+/*
+ * Resumption data of the last session with every host. It outlives the
+ * connections so a reconnect only needs an abbreviated handshake, without
+ * the certificate chain being sent and verified again.
+ */
+typedef struct {
+    unsigned char *data;
+    size_t         size;
+} ssl_session_t;
+
+static hashtable_t     *ssl_sessions = NULL;
+static pthread_mutex_t  ssl_lock     = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct {
     int                              fd;
+    char                            *host;    /* server name, NULL if unknown */
     gnutls_session_t                 session;
     gnutls_certificate_credentials_t xcred;
+    bool                             pending; /* record interrupted by a full kernel buffer */
+    bool                             established;
 } ssl_t;
 
+static void ssl_session_store(ssl_t *ssl) {
+    gnutls_datum_t data;
+    if (!ssl->host || gnutls_session_get_data2(ssl->session, &data) != GNUTLS_E_SUCCESS)
+        return;
+
+    ssl_session_t *session = malloc(sizeof(*session));
+    session->data = malloc(data.size);
+    session->size = data.size;
+    memcpy(session->data, data.data, data.size);
+    gnutls_free(data.data);
+
+    pthread_mutex_lock(&ssl_lock);
+    if (!ssl_sessions)
+        ssl_sessions = hashtable_create(16);
+
+    ssl_session_t *old = hashtable_find(ssl_sessions, ssl->host);
+    if (old) {
+        hashtable_remove(ssl_sessions, ssl->host);
+        free(old->data);
+        free(old);
+    }
+    hashtable_insert(ssl_sessions, ssl->host, session);
+    pthread_mutex_unlock(&ssl_lock);
+}
+
+static void ssl_session_resume(ssl_t *ssl) {
+    if (!ssl->host)
+        return;
+
+    pthread_mutex_lock(&ssl_lock);
+    ssl_session_t *session = ssl_sessions ? hashtable_find(ssl_sessions, ssl->host) : NULL;
+    if (session)
+        gnutls_session_set_data(ssl->session, session->data, session->size);
+    pthread_mutex_unlock(&ssl_lock);
+}
+
+/* TLS 1.3 tickets arrive after the handshake, whenever the server sends them */
+static int ssl_session_ticket(gnutls_session_t session, unsigned int type, unsigned int when, unsigned int incoming, const gnutls_datum_t *message) {
+    (void)type;
+    (void)when;
+    (void)incoming;
+    (void)message;
+
+    ssl_t *ssl = gnutls_session_get_ptr(session);
+    if (ssl->established)
+        ssl_session_store(ssl);
+    return 0;
+}
+
 static const char *ssl_certificate_serial(const void *bin, size_t size) {
     static char memory[110];
     char *ptr = memory;
@@ -29,7 +105,8 @@ static const char *ssl_certificate_serial(const void *bin, size_t size) {
 }
 
 static int ssl_certificate_check(gnutls_session_t session) {
-    const char    *hostname = gnutls_session_get_ptr(session);
+    const ssl_t   *ssl      = gnutls_session_get_ptr(session);
+    const char    *hostname = ssl->host;
     unsigned int   status   = 0;
     int            verify   = gnutls_certificate_verify_peers3(session, hostname, &status);
 
@@ -87,17 +164,37 @@ static int ssl_certificate_check(gnutls_session_t session) {
     return 0;
 }
 
-static ssl_t *ssl_ctx_create(int fd) {
+static void ssl_global_init(void) {
+    pthread_mutex_lock(&ssl_lock);
     if (ssl_instances++ == 0) {
         printf("    ssl      => initialized\n");
         gnutls_global_init();
     }
+    pthread_mutex_unlock(&ssl_lock);
+}
+
+static void ssl_global_deinit(void) {
+    pthread_mutex_lock(&ssl_lock);
+    if (--ssl_instances == 0) {
+        gnutls_global_deinit();
+        printf("    ssl      => deinitialized\n");
+    }
+    pthread_mutex_unlock(&ssl_lock);
+}
+
+static ssl_t *ssl_ctx_create(int fd, const char *host, const char *certificate) {
+    ssl_global_init();
 
     ssl_t *ssl = malloc(sizeof(*ssl));
-    if (!ssl)
+    if (!ssl) {
+        ssl_global_deinit();
         return NULL;
+    }
 
-    ssl->fd = fd;
+    ssl->fd          = fd;
+    ssl->host        = host ? strdup(host) : NULL;
+    ssl->pending     = false;
+    ssl->established = false;
     if (gnutls_certificate_allocate_credentials(&ssl->xcred) != GNUTLS_E_SUCCESS)
         goto ssl_ctx_error;
 
@@ -106,6 +203,12 @@ static ssl_t *ssl_ctx_create(int fd) {
 
     gnutls_certificate_set_verify_function(ssl->xcred, ssl_certificate_check);
 
+    /* Client certificates are used for SASL EXTERNAL */
+    if (certificate && gnutls_certificate_set_x509_key_file(ssl->xcred, certificate, certificate, GNUTLS_X509_FMT_PEM) != GNUTLS_E_SUCCESS) {
+        fprintf(stderr, "    ssl      => failed loading certificate %s\n", certificate);
+        goto ssl_ctx_error;
+    }
+
     if (gnutls_init(&ssl->session, GNUTLS_CLIENT) != GNUTLS_E_SUCCESS)
         goto ssl_ctx_error;
 
@@ -115,26 +218,20 @@ static ssl_t *ssl_ctx_create(int fd) {
     if (gnutls_credentials_set(ssl->session, GNUTLS_CRD_CERTIFICATE, ssl->xcred) != GNUTLS_E_SUCCESS)
         goto ssl_ctx_error_session;
 
+    /* Server names are sent for virtual hosting, addresses must not be */
+    struct in6_addr address;
+    if (ssl->host && inet_pton(AF_INET, ssl->host, &address) != 1 && inet_pton(AF_INET6, ssl->host, &address) != 1)
+        gnutls_server_name_set(ssl->session, GNUTLS_NAME_DNS, ssl->host, strlen(ssl->host));
+
+    gnutls_session_set_ptr(ssl->session, ssl);
+    gnutls_handshake_set_hook_function(ssl->session, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET, GNUTLS_HOOK_POST, &ssl_session_ticket);
+    ssl_session_resume(ssl);
+
     gnutls_transport_set_int(ssl->session, fd);
     gnutls_handshake_set_timeout(ssl->session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 
-    /* Do handshake now */
+    /* The handshake is driven by the event loop, see ssl_handshake */
     printf("    ssl      => performing handshake\n");
-    int handshake;
-    do {
-        handshake = gnutls_handshake(ssl->session);
-    } while (handshake < 0 && gnutls_error_is_fatal(handshake) == 0);
-
-    if (handshake < 0) {
-        fprintf(stderr, "    ssl      => handshake failed\n");
-        gnutls_perror(handshake);
-        goto ssl_ctx_error_session;
-    } else {
-        char *session = gnutls_session_get_desc(ssl->session);
-        printf("    ssl      => connected via %s\n", session);
-        gnutls_free(session);
-    }
-
     return ssl;
 
 ssl_ctx_error_session:
@@ -142,70 +239,136 @@ ssl_ctx_error_session:
 
 ssl_ctx_error:
     gnutls_certificate_free_credentials(ssl->xcred);
+    free(ssl->host);
     free(ssl);
+    ssl_global_deinit();
     return NULL;
 }
 
-static bool ssl_destroy(ssl_t *ssl, sock_restart_t *restart) {
-    (void)restart;
+/*
+ * Continues the handshake as far as the socket allows. GnuTLS returns
+ * GNUTLS_E_AGAIN once the socket would block, after which readiness of it
+ * means the handshake can make progress again.
+ */
+static int ssl_handshake(ssl_t *ssl) {
+    if (ssl->established)
+        return 1;
 
-    int bye;
+    int handshake;
     do {
-        bye = gnutls_bye(ssl->session, GNUTLS_SHUT_RDWR);
-    } while (bye == GNUTLS_E_AGAIN);
+        handshake = gnutls_handshake(ssl->session);
+    } while (handshake < 0 && handshake != GNUTLS_E_AGAIN && gnutls_error_is_fatal(handshake) == 0);
+
+    if (handshake == GNUTLS_E_AGAIN)
+        return 0;
+
+    if (handshake < 0) {
+        fprintf(stderr, "    ssl      => handshake failed: %s\n", gnutls_strerror(handshake));
+        return -1;
+    }
+
+    ssl->established = true;
+
+    char *session = gnutls_session_get_desc(ssl->session);
+    printf("    ssl      => connected via %s%s\n", session,
+        gnutls_session_is_resumed(ssl->session) ? " (resumed)" : "");
+    gnutls_free(session);
+
+    /* Earlier versions have the resumption data once the handshake is done */
+    if (gnutls_protocol_get_version(ssl->session) != GNUTLS_TLS1_3)
+        ssl_session_store(ssl);
+
+    return 1;
+}
+
+static bool ssl_destroy(ssl_t *ssl, sock_restart_t *restart) {
+    /* Don't wait on the peer's close_notify, the socket is non-blocking */
+    if (ssl->established) {
+        int bye;
+        do {
+            bye = gnutls_bye(ssl->session, GNUTLS_SHUT_WR);
+        } while (bye == GNUTLS_E_INTERRUPTED);
+    }
+
+    if (!restart)
+        close(ssl->fd);
 
     gnutls_deinit(ssl->session);
     gnutls_certificate_free_credentials(ssl->xcred);
+    free(ssl->host);
     free(ssl);
 
-    if (--ssl_instances == 0) {
-        gnutls_global_deinit();
-        printf("    ssl      => deinitialized\n");
-    }
-
+    ssl_global_deinit();
     return true;
 }
 
 static int ssl_recv(ssl_t *ssl, char *buffer, size_t size) {
-    int ret = gnutls_record_recv(ssl->session, buffer, size);
+    /*
+     * Post-handshake messages like session tickets are consumed without
+     * producing data, GnuTLS then reports GNUTLS_E_AGAIN even though the
+     * socket may hold more. Only stop once the socket itself would block.
+     */
+    int ret;
+    do {
+        errno = 0;
+        ret   = gnutls_record_recv(ssl->session, buffer, size);
+    } while ((ret == GNUTLS_E_AGAIN && errno != EAGAIN && errno != EWOULDBLOCK) || ret == GNUTLS_E_INTERRUPTED);
+
     if (ret == 0) {
         printf("    ssl      => peer has closed connection\n");
         return 0;
     } else if (ret < 0 && gnutls_error_is_fatal(ret) == 0) {
         /* Non fatal error */
-        return 0;
+        return -1;
     } else if (ret < 0) {
         /* Fatal error */
         fprintf(stderr, "    ssl      => %s\n", gnutls_strerror(ret));
-        return -1;
+        return 0;
     }
     return ret;
 }
 
 static int ssl_send(ssl_t *ssl, const char *message, size_t size) {
-    return gnutls_record_send(ssl->session, message, size);
+    /*
+     * An interrupted record is already encrypted and buffered by GnuTLS,
+     * it has to be resumed without data before anything new is sent.
+     */
+    int ret = ssl->pending
+                  ? gnutls_record_send(ssl->session, NULL, 0)
+                  : gnutls_record_send(ssl->session, message, size);
+
+    ssl->pending = (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+    if (ssl->pending)
+        return 0;
+
+    if (ret < 0) {
+        fprintf(stderr, "    ssl      => %s\n", gnutls_strerror(ret));
+        return -1;
+    }
+    return ret;
 }
 
 static int ssl_getfd(const ssl_t *ssl) {
     return ssl->fd;
 }
 
-sock_t *ssl_create(int fd, sock_restart_t *restart) {
-    (void)restart;
-
-    ssl_t *ssl = ssl_ctx_create(fd);
+sock_t *ssl_create(int fd, const char *host, sock_restart_t *restart) {
+    ssl_t *ssl = ssl_ctx_create(fd, host, restart->certificate);
     if (!ssl) {
         fprintf(stderr, "    ssl      => failed creating context\n");
         return NULL;
     }
 
     sock_t *sock = malloc(sizeof(*sock));
-    sock->data    = ssl;
-    sock->getfd   = (sock_getfd_func)&ssl_getfd;
-    sock->recv    = (sock_recv_func)&ssl_recv;
-    sock->send    = (sock_send_func)&ssl_send;
-    sock->destroy = (sock_destroy_func)&ssl_destroy;
-    sock->ssl     = true;
+    sock->data      = ssl;
+    sock->getfd     = (sock_getfd_func)&ssl_getfd;
+    sock->recv      = (sock_recv_func)&ssl_recv;
+    sock->send      = (sock_send_func)&ssl_send;
+    sock->destroy   = (sock_destroy_func)&ssl_destroy;
+    sock->handshake = (sock_handshake_func)&ssl_handshake;
+    sock->ssl       = true;
+    sock->listen    = false;
+    sock->host      = NULL;
 
     return sock;
 }
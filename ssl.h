@@ -2,6 +2,6 @@
 #define REDROID_SSL_HDR
 #include "sock.h"
 
-sock_t *ssl_create(int fd, sock_restart_t *restart);
+sock_t *ssl_create(int fd, const char *host, sock_restart_t *restart);
 
 #endif
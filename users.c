@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "users.h"
+#include "members.h"
+#include "probe.h"
+
+/*
+ * The registry is a probe table of user records, like the intern pool. A
+ * record knows the member tables it is in so changes to a user touch only
+ * the channels they are in, not every channel of the instance.
+ */
+struct users_s {
+    probe_t   table;
+    intern_t *intern;
+};
+
+users_t *users_create(intern_t *intern) {
+    users_t *users = malloc(sizeof(*users));
+    probe_init(&users->table, sizeof(probe_slot_t));
+    users->intern = intern;
+    return users;
+}
+
+static void users_free(users_t *users, user_t *user) {
+    intern_put(users->intern, user->nick);
+    intern_put(users->intern, user->host);
+    intern_put(users->intern, user->account);
+    free(user->memberships);
+    free(user);
+}
+
+void users_destroy(users_t *users) {
+    if (!users)
+        return;
+    for (size_t i = 0; i < users->table.size; i++)
+        if (probe_at(&users->table, i)->entry)
+            users_free(users, probe_at(&users->table, i)->entry);
+    probe_release(&users->table);
+    free(users);
+}
+
+bool users_match(const void *user, const void *nick) {
+    return !strcmp(((const user_t *)user)->nick, nick);
+}
+
+static bool users_same(const void *user, const void *find) {
+    return user == find;
+}
+
+static user_t *users_lookup(users_t *users, const char *nick, uint32_t hash) {
+    probe_slot_t *slot = probe_find(&users->table, hash, &users_match, nick);
+    return slot ? slot->entry : NULL;
+}
+
+static void users_unlink(users_t *users, user_t *user) {
+    probe_vacate(&users->table, probe_find(&users->table, user->hash, &users_same, user));
+}
+
+static void users_link(users_t *users, user_t *user) {
+    probe_claim(&users->table, user->hash, &users_same, user)->entry = user;
+}
+
+user_t *users_find(users_t *users, const char *nick) {
+    return users_lookup(users, nick, intern_hash(nick));
+}
+
+user_t *users_acquire(users_t *users, members_t *members, const char *nick, uint32_t hash, const char *host) {
+    user_t *user = users_lookup(users, nick, hash);
+    if (!user) {
+        user = malloc(sizeof(*user));
+        user->nick        = intern_get(users->intern, nick);
+        user->host        = intern_get(users->intern, host);
+        user->account     = NULL;
+        user->hash        = hash;
+        user->away        = false;
+        user->memberships = NULL;
+        user->count       = 0;
+        user->capacity    = 0;
+        users_link(users, user);
+    }
+
+    if (user->count == user->capacity) {
+        user->capacity    = user->capacity ? user->capacity * 2 : 4;
+        user->memberships = realloc(user->memberships, user->capacity * sizeof(*user->memberships));
+    }
+    user->memberships[user->count++] = members;
+    return user;
+}
+
+void users_release(users_t *users, members_t *members, user_t *user) {
+    /* Order of memberships doesn't matter, the last one fills the gap */
+    for (size_t i = 0; i < user->count; i++) {
+        if (user->memberships[i] == members) {
+            user->memberships[i] = user->memberships[--user->count];
+            break;
+        }
+    }
+
+    if (user->count)
+        return;
+
+    users_unlink(users, user);
+    users_free(users, user);
+}
+
+void users_remove(users_t *users, user_t *user) {
+    (void)users;
+    /* The record is freed with its last membership */
+    for (size_t i = user->count; i--; )
+        members_remove(user->memberships[i], user->nick);
+}
+
+void users_rename(users_t *users, user_t *user, const char *nick) {
+    if (!strcmp(user->nick, nick))
+        return;
+
+    /* Whoever we still think has the nick has long left */
+    uint32_t hash  = intern_hash(nick);
+    user_t  *stale = users_lookup(users, nick, hash);
+    if (stale)
+        users_remove(users, stale);
+
+    /*
+     * Members are found by the hash of the nick, so they are taken out
+     * of the member tables under the old one and put back in under the
+     * new one.
+     */
+    uint8_t *modes = malloc(user->count);
+    for (size_t i = 0; i < user->count; i++)
+        modes[i] = members_unlink(user->memberships[i], user);
+
+    users_unlink(users, user);
+    intern_put(users->intern, user->nick);
+    user->nick = intern_get(users->intern, nick);
+    user->hash = hash;
+    users_link(users, user);
+
+    for (size_t i = 0; i < user->count; i++)
+        members_link(user->memberships[i], user, modes[i]);
+    free(modes);
+}
+
+void users_host(users_t *users, user_t *user, const char *host) {
+    if (!strcmp(user->host, host))
+        return;
+    intern_put(users->intern, user->host);
+    user->host = intern_get(users->intern, host);
+}
+
+void users_account(users_t *users, user_t *user, const char *account) {
+    intern_put(users->intern, user->account);
+    user->account = account ? intern_get(users->intern, account) : NULL;
+}
+
+size_t users_size(const users_t *users) {
+    return users->table.count;
+}
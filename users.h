@@ -0,0 +1,134 @@
+#ifndef REDROID_USERS_HDR
+#define REDROID_USERS_HDR
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "intern.h"
+
+typedef struct users_s   users_t;
+typedef struct members_s members_t;
+
+/*
+ * Type: user_t
+ *  A user seen on one or more channels. There is one record per nick
+ *  shared by the member tables of every channel the user is in, it lives
+ *  for as long as the user is in at least one of them.
+ */
+typedef struct {
+    const char  *nick;        /* interned                         */
+    const char  *host;        /* interned user@host, empty until known */
+    const char  *account;     /* interned, NULL when not logged in */
+    uint32_t     hash;        /* of the nick                      */
+    bool         away;
+    members_t  **memberships; /* member tables the user is in     */
+    size_t       count;
+    size_t       capacity;
+} user_t;
+
+/*
+ * Function: users_create
+ *  Create an empty user registry.
+ *
+ * Parameters:
+ *  intern  - The pool the strings of users are interned in
+ */
+users_t *users_create(intern_t *intern);
+
+/*
+ * Function: users_destroy
+ *  Destroy a user registry, the member tables referencing its users must
+ *  be destroyed first.
+ *
+ * Parameters:
+ *  users   - The registry to destroy
+ */
+void users_destroy(users_t *users);
+
+/*
+ * Function: users_find
+ *  Find a user by nick.
+ *
+ * Parameters:
+ *  users   - The registry
+ *  nick    - The nick of the user
+ *
+ * Returns:
+ *  The user or NULL if no channel has a member with that nick.
+ */
+user_t *users_find(users_t *users, const char *nick);
+
+/*
+ * Function: users_remove
+ *  Remove a user from every channel they're in, like for a QUIT. The
+ *  user record is gone afterwards.
+ *
+ * Parameters:
+ *  users   - The registry
+ *  user    - The user
+ */
+void users_remove(users_t *users, user_t *user);
+
+/*
+ * Function: users_rename
+ *  Change the nick of a user in every channel they're in.
+ *
+ * Parameters:
+ *  users   - The registry
+ *  user    - The user
+ *  nick    - The new nick
+ */
+void users_rename(users_t *users, user_t *user, const char *nick);
+
+/*
+ * Function: users_host
+ *  Change the user@host of a user.
+ *
+ * Parameters:
+ *  users   - The registry
+ *  user    - The user
+ *  host    - The new user@host
+ */
+void users_host(users_t *users, user_t *user, const char *host);
+
+/*
+ * Function: users_account
+ *  Change the account of a user.
+ *
+ * Parameters:
+ *  users   - The registry
+ *  user    - The user
+ *  account - The account or NULL when not logged in
+ */
+void users_account(users_t *users, user_t *user, const char *account);
+
+/*
+ * Function: users_size
+ *  Get the amount of distinct users.
+ *
+ * Parameters:
+ *  users   - The registry
+ */
+size_t users_size(const users_t *users);
+
+/*
+ * Function: users_acquire
+ *  Used by member tables. Find or create the user with a nick and record
+ *  the membership of the table.
+ */
+user_t *users_acquire(users_t *users, members_t *members, const char *nick, uint32_t hash, const char *host);
+
+/*
+ * Function: users_release
+ *  Used by member tables. Drop the membership of the table, the user is
+ *  freed with their last membership.
+ */
+void users_release(users_t *users, members_t *members, user_t *user);
+
+/*
+ * Function: users_match
+ *  Used by member tables. Probe match of a user against a nick.
+ */
+bool users_match(const void *user, const void *nick);
+
+#endif
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vector.h"
+
+/*
+ * The elements live in a ring of pointers whose capacity is a power of
+ * two, so both ends can be pushed to and shifted from without moving
+ * anything. The ring is allocated with the first element.
+ */
+#define VECTOR_MIN 8
+
+struct vector_s {
+    void  **data;
+    size_t  capacity;
+    size_t  head;
+    size_t  length;
+};
+
+static inline size_t vector_slot(const vector_t *vector, size_t index) {
+    return (vector->head + index) & (vector->capacity - 1);
+}
+
+/* Unwrap the ring into a larger one starting at zero */
+static void vector_resize(vector_t *vector, size_t capacity) {
+    void **data = malloc(sizeof(void *) * capacity);
+    size_t tail = vector->capacity - vector->head;
+
+    if (vector->length <= tail)
+        memcpy(data, &vector->data[vector->head], sizeof(void *) * vector->length);
+    else {
+        memcpy(data, &vector->data[vector->head], sizeof(void *) * tail);
+        memcpy(&data[tail], vector->data, sizeof(void *) * (vector->length - tail));
+    }
+
+    free(vector->data);
+    vector->data     = data;
+    vector->capacity = capacity;
+    vector->head     = 0;
+}
+
+static void vector_reserve(vector_t *vector) {
+    if (vector->length < vector->capacity)
+        return;
+    if (!vector->capacity) {
+        vector->data     = malloc(sizeof(void *) * VECTOR_MIN);
+        vector->capacity = VECTOR_MIN;
+        return;
+    }
+    vector_resize(vector, vector->capacity * 2);
+}
+
+vector_t *vector_create(void) {
+    vector_t *vector = malloc(sizeof(*vector));
+
+    vector->data     = NULL;
+    vector->capacity = 0;
+    vector->head     = 0;
+    vector->length   = 0;
+
+    return vector;
+}
+
+void vector_destroy(vector_t *vector) {
+    if (!vector)
+        return;
+    free(vector->data);
+    free(vector);
+}
+
+void vector_push(vector_t *vector, void *element) {
+    vector_reserve(vector);
+    vector->data[vector_slot(vector, vector->length++)] = element;
+}
+
+void vector_prepend(vector_t *vector, void *element) {
+    vector_reserve(vector);
+    vector->head = (vector->head - 1) & (vector->capacity - 1);
+    vector->data[vector->head] = element;
+    vector->length++;
+}
+
+void *vector_pop(vector_t *vector) {
+    if (!vector->length)
+        return NULL;
+    return vector->data[vector_slot(vector, --vector->length)];
+}
+
+void *vector_shift(vector_t *vector) {
+    if (!vector->length)
+        return NULL;
+
+    void *element = vector->data[vector->head];
+    vector->head = vector_slot(vector, 1);
+    vector->length--;
+    return element;
+}
+
+void *vector_at(vector_t *vector, size_t index) {
+    if (index >= vector->length)
+        return NULL;
+    return vector->data[vector_slot(vector, index)];
+}
+
+vector_t *vector_copy(vector_t *vector) {
+    vector_t *copy = vector_create();
+    if (!vector->length)
+        return copy;
+
+    copy->capacity = vector->capacity;
+    copy->data     = malloc(sizeof(void *) * copy->capacity);
+    copy->length   = vector->length;
+    for (size_t i = 0; i < vector->length; i++)
+        copy->data[i] = vector->data[vector_slot(vector, i)];
+    return copy;
+}
+
+bool vector_erase(vector_t *vector, void *element) {
+    for (size_t i = 0; i < vector->length; i++) {
+        if (vector->data[vector_slot(vector, i)] != element)
+            continue;
+
+        /* Close the gap from whichever end is nearer */
+        if (i < vector->length / 2) {
+            for (size_t j = i; j > 0; j--)
+                vector->data[vector_slot(vector, j)] = vector->data[vector_slot(vector, j - 1)];
+            vector->head = vector_slot(vector, 1);
+        } else {
+            for (size_t j = i + 1; j < vector->length; j++)
+                vector->data[vector_slot(vector, j - 1)] = vector->data[vector_slot(vector, j)];
+        }
+        vector->length--;
+        return true;
+    }
+    return false;
+}
+
+bool vector_find(vector_t *vector, const void *element) {
+    for (size_t i = 0; i < vector->length; i++)
+        if (vector->data[vector_slot(vector, i)] == element)
+            return true;
+    return false;
+}
+
+void *vector_search_impl(vector_t *vector, const void *pass, bool (*predicate)(const void *, const void *)) {
+    for (size_t i = 0; i < vector->length; i++) {
+        void *element = vector->data[vector_slot(vector, i)];
+        if (predicate(element, pass))
+            return element;
+    }
+    return NULL;
+}
+
+size_t vector_length(vector_t *vector) {
+    return (vector) ? vector->length : 0;
+}
+
+void vector_clear(vector_t *vector) {
+    vector->head   = 0;
+    vector->length = 0;
+}
+
+void vector_foreach_impl(vector_t *vector, void *pass, void (*callback)(void *, void *)) {
+    for (size_t i = 0; i < vector->length; i++)
+        callback(vector->data[vector_slot(vector, i)], pass);
+}
+
+/* Bottom up merge sort, taking from the right only when it must go first */
+void vector_sort_impl(vector_t *vector, bool (*predicate)(const void *, const void *)) {
+    size_t length = vector->length;
+    if (length < 2)
+        return;
+
+    if (vector->head + length > vector->capacity)
+        vector_resize(vector, vector->capacity);
+
+    void **source = &vector->data[vector->head];
+    void **target = malloc(sizeof(void *) * length);
+    void **buffer = target;
+
+    for (size_t width = 1; width < length; width *= 2) {
+        for (size_t begin = 0; begin < length; begin += width * 2) {
+            size_t middle = (begin + width < length) ? begin + width : length;
+            size_t end    = (middle + width < length) ? middle + width : length;
+            size_t a      = begin;
+            size_t b      = middle;
+            for (size_t i = begin; i < end; i++) {
+                if (a < middle && (b >= end || !predicate(source[a], source[b])))
+                    target[i] = source[a++];
+                else
+                    target[i] = source[b++];
+            }
+        }
+        void **swap = source;
+        source = target;
+        target = swap;
+    }
+
+    if (source != &vector->data[vector->head])
+        memcpy(&vector->data[vector->head], source, sizeof(void *) * length);
+    free(buffer);
+}
@@ -0,0 +1,213 @@
+#ifndef REDROID_VECTOR_HDR
+#define REDROID_VECTOR_HDR
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "default.h"
+
+/*
+ * Type: vector_t
+ *  A sequence with the same surface as list_t kept in one growable ring
+ *  of pointers. Pushing and shifting at either end is O(1) amortized and
+ *  indexing is always O(1), only growing allocates. Prefer it over list_t
+ *  for queues and short lived sequences that are shifted from.
+ */
+typedef struct vector_s vector_t;
+
+/*
+ * Function: vector_create
+ *  Create a vector
+ *
+ * Returns:
+ *  A vector
+ */
+vector_t *vector_create(void);
+
+/*
+ * Function: vector_destroy
+ *  Destroy a vector
+ *
+ * Parameters:
+ *  vector  - The vector to destroy
+ */
+void vector_destroy(vector_t *vector);
+
+/*
+ * Function: vector_push
+ *  Push an element onto the vector's tail end.
+ *
+ * Parameters:
+ *  vector  - The vector to put the element into.
+ *  element - The element to put in the vector.
+ */
+void vector_push(vector_t *vector, void *element);
+
+/*
+ * Function: vector_prepend
+ *  Push an element onto the vector's head end.
+ *
+ * Parameters:
+ *  vector  - The vector to put the element into.
+ *  element - The element to put in the vector.
+ */
+void vector_prepend(vector_t *vector, void *element);
+
+/*
+ * Function: vector_pop
+ *  Pop an element off the vector's tail end.
+ *
+ * Parameters:
+ *  vector  - The vector to pop the element off of.
+ *
+ * Returns:
+ *  The element or NULL if the vector is empty.
+ */
+void *vector_pop(vector_t *vector);
+
+/*
+ * Function: vector_shift
+ *  Pop an element off the vector's head end.
+ *
+ * Parameters:
+ *  vector  - The vector to pop the element off of.
+ *
+ * Returns:
+ *  The element or NULL if the vector is empty.
+ */
+void *vector_shift(vector_t *vector);
+
+/*
+ * Function: vector_at
+ *  Get an element at an index from the head.
+ *
+ * Parameters:
+ *  vector  - The vector to get the element of
+ *  index   - The index.
+ *
+ * Returns:
+ *  The element or NULL if the index is out of range.
+ */
+void *vector_at(vector_t *vector, size_t index);
+
+/*
+ * Function: vector_find
+ *  Find an element in a vector.
+ *
+ * Parameters:
+ *  vector  - The vector to search in.
+ *  element - The element to search for.
+ *
+ * Returns:
+ *  True if the element is found, false otherwise.
+ */
+bool vector_find(vector_t *vector, const void *element);
+
+/*
+ * Function: vector_search
+ *  Search the vector with a user-defined invariant via predicate.
+ *
+ * Parameters:
+ *  vector    - The vector to search.
+ *  predicate - The predicate used for the invariant in the search.
+ *  pass      - The information to pass to the predicate's second argument.
+ *
+ * Returns:
+ *  The first element for which the predicate returned true, NULL if
+ *  there is none.
+ */
+#define vector_search_2(VECTOR, PREDICATE) \
+    vector_search_impl((VECTOR), NULL, (bool (*)(const void *, const void *))(PREDICATE))
+#define vector_search_3(VECTOR, PASS, PREDICATE) \
+    vector_search_impl((VECTOR), (void *)(PASS), (bool (*)(const void *, const void *))(PREDICATE))
+#define vector_search(...) \
+    DEFAULT(vector_search, __VA_ARGS__)
+
+void *vector_search_impl(vector_t *vector, const void *pass, bool (*predicate)(const void *, const void *));
+
+/*
+ * Function: vector_copy
+ *  Perform a copy of a vector.
+ *
+ * Parameters:
+ *  vector  - The vector to copy.
+ *
+ * Returns:
+ *  A copied vector.
+ */
+vector_t *vector_copy(vector_t *vector);
+
+/*
+ * Function: vector_length
+ *  Get the length of a vector (i.e number of elements).
+ *
+ * Parameters:
+ *  vector  - The vector to get the length of.
+ *
+ * Returns:
+ *  The amount of elements in the vector.
+ */
+size_t vector_length(vector_t *vector);
+
+/*
+ * Function: vector_foreach
+ *  Execute a callback passing in each value in the entire vector
+ *  as well as passing in an additional pointer.
+ *
+ * Parameters:
+ *  vector      - The vector to execute the callback over.
+ *  pass        - The additional thing to pass in for the callback to
+ *                get as its second argument.
+ *  callback    - Pointer to function callback.
+ *
+ * Remarks:
+ *  The callback must not change the vector.
+ */
+#define vector_foreach_2(VECTOR, CALLBACK) \
+    vector_foreach_impl((VECTOR), NULL, (void (*)(void *, void *))(CALLBACK))
+#define vector_foreach_3(VECTOR, PASS, CALLBACK) \
+    vector_foreach_impl((VECTOR), (void *)(PASS), (void (*)(void *, void *))(CALLBACK))
+#define vector_foreach(...) \
+    DEFAULT(vector_foreach, __VA_ARGS__)
+
+void vector_foreach_impl(vector_t *vector, void *pass, void (*callback)(void *, void *));
+
+/*
+ * Function: vector_erase
+ *  Erase the first occurrence of an element in a vector, the elements
+ *  after it keep their order.
+ *
+ * Parameters:
+ *  vector  - The vector to erase the element from.
+ *  element - The element to erase.
+ *
+ * Returns:
+ *  True if the element was found and erased, false otherwise.
+ */
+bool vector_erase(vector_t *vector, void *element);
+
+/*
+ * Function: vector_sort
+ *  Sort a vector, elements which compare equal keep their order.
+ *
+ * Parameters:
+ *  vector    - The vector to sort
+ *  predicate - Pointer to function predicate that returns a boolean
+ *              transitive relationship for two elements of the vector,
+ *              like for list_sort the second element goes first when
+ *              it returns true.
+ */
+#define vector_sort(VECTOR, PREDICATE) \
+    vector_sort_impl((VECTOR), (bool (*)(const void *, const void *))(PREDICATE))
+
+void vector_sort_impl(vector_t *vector, bool (*predicate)(const void *, const void *));
+
+/*
+ * Function: vector_clear
+ *  Clear the vector of all elements, keeping its storage.
+ *
+ * Parameters:
+ *  vector  - The vector to clear.
+ */
+void vector_clear(vector_t *vector);
+
+#endif
@@ -4,8 +4,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <inttypes.h>
 
 #include "web.h"
+#include "irc.h"
 #include "http.h"
 #include "mt.h"
 #include "ripemd.h"
@@ -85,6 +87,30 @@ static void web_hook_redirect(sock_t *client, void *data) {
     /* TODO: Send template "index.html" */
 }
 
+static void web_hook_lag(sock_t *client, void *data) {
+    web_t         *web     = data;
+    web_session_t *session = list_search(web->sessions, client,
+        lambda bool(const web_session_t *const session, const sock_t *const sock)
+            => return !strcmp(session->host, sock->host);
+    );
+
+    if (!session || !session->valid)
+        return http_send_error(client);
+
+    /* One line per instance, round trips in microseconds */
+    string_t *string = string_construct();
+    irc_manager_foreach(web->ircmanager, string,
+        lambda void(irc_t *instance, string_t *string) {
+            irc_lag_stats_t stats;
+            irc_lag_stats(instance, &stats);
+            string_catf(string, "%s samples=%zu missed=%zu last=%" PRIu64 " p50=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64 "\n",
+                irc_name(instance), stats.samples, stats.missed, stats.last, stats.p50, stats.p99, stats.max);
+        }
+    );
+    http_send_plain(client, string_contents(string));
+    string_destroy(string);
+}
+
 static void web_hook_postlogin(sock_t *client, list_t *post, void *data) {
     web_t *web = data;
 
@@ -235,6 +261,7 @@ web_t *web_create(void) {
 
     http_intercept_get(server, "index.html", &web_hook_redirect, web);
     http_intercept_get(server, "admin.html", &web_hook_redirect, web);
+    http_intercept_get(server, "lag.txt",    &web_hook_lag,      web);
 
     /*
      * The thread will keep running for as long as the mutex is locked.
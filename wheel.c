@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "wheel.h"
+
+/*
+ * Four levels of 64 slots each, the first level has a slot for every
+ * millisecond and every level after covers 64 times the range of the one
+ * before it. Timers are placed on the lowest level which can hold them
+ * and cascade down a level every time the wheel turns into their slot.
+ * Anything further out than the range of all levels combined (a little
+ * over four and a half hours) is parked in the furthest slot and placed
+ * again once it cascades.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE  ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct wheel_timer_s {
+    wheel_timer_t   *next;
+    wheel_timer_t  **prev;     /* Link pointing at this timer, NULL when not pending */
+    wheel_t         *wheel;
+    wheel_callback_t callback;
+    void            *data;
+    uint64_t         deadline;
+    unsigned char    level;
+    unsigned char    slot;
+};
+
+struct wheel_s {
+    pthread_mutex_t  mutex;
+    pthread_cond_t   done;
+    wheel_timer_t   *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t         occupied[WHEEL_LEVELS]; /* Bitmap of non empty slots per level */
+    uint64_t         current;                /* Last millisecond the wheel turned to */
+    wheel_timer_t   *running;                /* Timer whose callback is being called */
+    pthread_t        runner;
+};
+
+uint64_t wheel_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * Timers scheduled from outside can't be placed in the slot that already
+ * fired, cascading ones due right now go in the slot about to fire.
+ */
+static void wheel_link(wheel_t *wheel, wheel_timer_t *timer, uint64_t earliest) {
+    uint64_t deadline = timer->deadline;
+
+    if (deadline < wheel->current + earliest)
+        deadline = wheel->current + earliest;
+    if (deadline - wheel->current >= WHEEL_RANGE)
+        deadline = wheel->current + WHEEL_RANGE - 1;
+
+    uint64_t delta = deadline - wheel->current;
+    size_t   level = 0;
+    while (delta >> (WHEEL_BITS * (level + 1)))
+        level++;
+
+    size_t          slot = (deadline >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_timer_t **head = &wheel->slots[level][slot];
+
+    timer->level = level;
+    timer->slot  = slot;
+    timer->next  = *head;
+    timer->prev  = head;
+    if (*head)
+        (*head)->prev = &timer->next;
+    *head = timer;
+
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void wheel_unlink(wheel_t *wheel, wheel_timer_t *timer) {
+    if (!timer->prev)
+        return;
+
+    *timer->prev = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (!wheel->slots[timer->level][timer->slot])
+        wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* Move every timer of a slot to the level it now belongs in */
+static void wheel_cascade(wheel_t *wheel, size_t level) {
+    size_t         slot = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_timer_t *timer;
+
+    while ((timer = wheel->slots[level][slot])) {
+        wheel_unlink(wheel, timer);
+        wheel_link(wheel, timer, 0);
+    }
+}
+
+wheel_t *wheel_create(void) {
+    wheel_t *wheel = calloc(1, sizeof(*wheel));
+    if (!wheel)
+        return NULL;
+
+    pthread_mutex_init(&wheel->mutex, NULL);
+    pthread_cond_init (&wheel->done,  NULL);
+
+    wheel->current = wheel_now();
+    return wheel;
+}
+
+void wheel_destroy(wheel_t *wheel) {
+    pthread_mutex_destroy(&wheel->mutex);
+    pthread_cond_destroy (&wheel->done);
+    free(wheel);
+}
+
+int wheel_timeout(wheel_t *wheel) {
+    uint64_t earliest = UINT64_MAX;
+
+    pthread_mutex_lock(&wheel->mutex);
+    for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (!occupied)
+            continue;
+
+        /*
+         * Slots are in deadline order starting with the one after the
+         * wheel's position on this level, only the first non empty one
+         * can contain the earliest deadline of the level.
+         */
+        size_t   start  = ((wheel->current >> (WHEEL_BITS * level)) + 1) & WHEEL_MASK;
+        uint64_t rotate = (occupied >> start) | (start ? occupied << (WHEEL_SLOTS - start) : 0);
+        size_t   slot   = (start + __builtin_ctzll(rotate)) & WHEEL_MASK;
+
+        for (wheel_timer_t *timer = wheel->slots[level][slot]; timer; timer = timer->next)
+            if (timer->deadline < earliest)
+                earliest = timer->deadline;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+
+    if (earliest == UINT64_MAX)
+        return -1;
+
+    uint64_t now = wheel_now();
+    if (earliest <= now)
+        return 0;
+    return (earliest - now > INT_MAX) ? INT_MAX : (int)(earliest - now);
+}
+
+size_t wheel_advance(wheel_t *wheel) {
+    uint64_t now   = wheel_now();
+    size_t   fired = 0;
+
+    pthread_mutex_lock(&wheel->mutex);
+    while (wheel->current < now) {
+        /*
+         * Nothing can fire until the wheel turns into the next slot of
+         * the lowest level with timers, skip straight to it.
+         */
+        size_t level = 0;
+        while (level < WHEEL_LEVELS && !wheel->occupied[level])
+            level++;
+
+        if (level == WHEEL_LEVELS) {
+            wheel->current = now;
+            break;
+        }
+
+        if (level != 0) {
+            uint64_t skip = wheel->current | (((uint64_t)1 << (WHEEL_BITS * level)) - 1);
+            if (skip >= now) {
+                wheel->current = now;
+                break;
+            }
+            wheel->current = skip;
+        }
+
+        wheel->current++;
+
+        /* Cascade down every level the wheel turned over on */
+        for (size_t i = 1; i < WHEEL_LEVELS; i++) {
+            if (wheel->current & (((uint64_t)1 << (WHEEL_BITS * i)) - 1))
+                break;
+            wheel_cascade(wheel, i);
+        }
+
+        wheel_timer_t **head = &wheel->slots[0][wheel->current & WHEEL_MASK];
+        wheel_timer_t  *timer;
+        while ((timer = *head)) {
+            wheel_unlink(wheel, timer);
+
+            /* Parked timers which are still too far out */
+            if (timer->deadline > wheel->current) {
+                wheel_link(wheel, timer, 1);
+                continue;
+            }
+
+            wheel->running = timer;
+            wheel->runner  = pthread_self();
+            pthread_mutex_unlock(&wheel->mutex);
+
+            timer->callback(timer, timer->data);
+            fired++;
+
+            /* The timer may have been destroyed by its callback */
+            pthread_mutex_lock(&wheel->mutex);
+            wheel->running = NULL;
+            pthread_cond_broadcast(&wheel->done);
+        }
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+
+    return fired;
+}
+
+wheel_timer_t *wheel_timer_create(wheel_t *wheel, wheel_callback_t callback, void *data) {
+    wheel_timer_t *timer = malloc(sizeof(*timer));
+    if (!timer)
+        return NULL;
+
+    timer->next     = NULL;
+    timer->prev     = NULL;
+    timer->wheel    = wheel;
+    timer->callback = callback;
+    timer->data     = data;
+    timer->deadline = 0;
+    timer->level    = 0;
+    timer->slot     = 0;
+
+    return timer;
+}
+
+void wheel_timer_destroy(wheel_timer_t *timer) {
+    if (!timer)
+        return;
+
+    wheel_t *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->mutex);
+    wheel_unlink(wheel, timer);
+    while (wheel->running == timer && !pthread_equal(wheel->runner, pthread_self()))
+        pthread_cond_wait(&wheel->done, &wheel->mutex);
+    pthread_mutex_unlock(&wheel->mutex);
+
+    free(timer);
+}
+
+void wheel_timer_schedule(wheel_timer_t *timer, uint64_t delay) {
+    wheel_t *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->mutex);
+    wheel_unlink(wheel, timer);
+    timer->deadline = wheel_now() + delay;
+    wheel_link(wheel, timer, 1);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+void wheel_timer_cancel(wheel_timer_t *timer) {
+    wheel_t *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->mutex);
+    wheel_unlink(wheel, timer);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+bool wheel_timer_pending(wheel_timer_t *timer) {
+    wheel_t *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->mutex);
+    bool pending = timer->prev != NULL;
+    pthread_mutex_unlock(&wheel->mutex);
+    return pending;
+}
@@ -0,0 +1,120 @@
+#ifndef REDROID_WHEEL_HDR
+#define REDROID_WHEEL_HDR
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct wheel_s       wheel_t;
+typedef struct wheel_timer_s wheel_timer_t;
+
+typedef void (*wheel_callback_t)(wheel_timer_t *timer, void *data);
+
+/*
+ * Function: wheel_create
+ *  Create a hierarchical timer wheel with millisecond resolution. The
+ *  wheel runs on the monotonic clock.
+ *
+ * Returns:
+ *  A timer wheel
+ */
+wheel_t *wheel_create(void);
+
+/*
+ * Function: wheel_destroy
+ *  Destroy a timer wheel. The timers created on the wheel must be
+ *  destroyed before the wheel itself.
+ *
+ * Parameters:
+ *  wheel   - The timer wheel to destroy
+ */
+void wheel_destroy(wheel_t *wheel);
+
+/*
+ * Function: wheel_timeout
+ *  Get the amount of milliseconds until the next timer is due.
+ *
+ * Parameters:
+ *  wheel   - The timer wheel
+ *
+ * Returns:
+ *  The milliseconds until the earliest deadline, zero if a timer is
+ *  already due or -1 if there is nothing scheduled. Suitable as a
+ *  poll/epoll timeout.
+ */
+int wheel_timeout(wheel_t *wheel);
+
+/*
+ * Function: wheel_advance
+ *  Advance the wheel to the current time, firing the callback of every
+ *  timer which is due. Callbacks are called without the wheel locked
+ *  and may schedule, cancel and destroy any timer.
+ *
+ * Parameters:
+ *  wheel   - The timer wheel
+ *
+ * Returns:
+ *  The amount of timers that fired.
+ */
+size_t wheel_advance(wheel_t *wheel);
+
+/*
+ * Function: wheel_now
+ *  Get the current monotonic time in milliseconds.
+ */
+uint64_t wheel_now(void);
+
+/*
+ * Function: wheel_timer_create
+ *  Create a timer on a wheel. The timer isn't scheduled until a call
+ *  to wheel_timer_schedule.
+ *
+ * Parameters:
+ *  wheel    - The timer wheel the timer belongs to
+ *  callback - The function to call when the timer fires
+ *  data     - Data passed to the callback
+ *
+ * Returns:
+ *  A timer
+ */
+wheel_timer_t *wheel_timer_create(wheel_t *wheel, wheel_callback_t callback, void *data);
+
+/*
+ * Function: wheel_timer_destroy
+ *  Cancel and destroy a timer. When the timer is firing on another
+ *  thread this waits for the callback to finish first, after which
+ *  the data of the timer can be safely released.
+ *
+ * Parameters:
+ *  timer   - The timer to destroy
+ */
+void wheel_timer_destroy(wheel_timer_t *timer);
+
+/*
+ * Function: wheel_timer_schedule
+ *  (Re)schedule a timer to fire once after a delay. Scheduling a timer
+ *  which is already pending moves its deadline.
+ *
+ * Parameters:
+ *  timer   - The timer to schedule
+ *  delay   - The delay in milliseconds
+ */
+void wheel_timer_schedule(wheel_timer_t *timer, uint64_t delay);
+
+/*
+ * Function: wheel_timer_cancel
+ *  Cancel a pending timer, does nothing if the timer isn't pending.
+ *
+ * Parameters:
+ *  timer   - The timer to cancel
+ */
+void wheel_timer_cancel(wheel_timer_t *timer);
+
+/*
+ * Function: wheel_timer_pending
+ *  Check if a timer is scheduled to fire.
+ *
+ * Parameters:
+ *  timer   - The timer
+ */
+bool wheel_timer_pending(wheel_timer_t *timer);
+
+#endif